@@ -0,0 +1,108 @@
+#include "BufferPool.hh"
+#include <new>
+#include <sys/mman.h>
+
+const std::size_t PageSize(4096);
+
+void BufferSlab::Release(){
+  if (--references == 0) pool->Return(this);
+}
+
+BufferPool::BufferPool(std::size_t slab_bytes, int n_slabs){
+  // round up to whole pages so every slab stays page-aligned
+  fSlabBytes = ((slab_bytes + PageSize - 1)/PageSize)*PageSize;
+  fRetired = false;
+  fTotal = fInUse = fPeakInUse = 0;
+  fGrown = fOversize = 0;
+  for (int i = 0; i < n_slabs; i++) {
+    fFree.push_back(Allocate(fSlabBytes));
+    fTotal++;
+  }
+}
+
+BufferPool::~BufferPool(){
+  const std::lock_guard<std::mutex> lg(fMutex);
+  for (auto slab : fFree) Free(slab);
+  fFree.clear();
+}
+
+BufferSlab* BufferPool::Allocate(std::size_t bytes){
+  // straight from mmap so the pages are fresh and get placed wherever
+  // they're first touched, not wherever the allocator last had them
+  void *mem = mmap(nullptr, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    throw std::bad_alloc();
+  BufferSlab *slab = new BufferSlab;
+  slab->buff = (u_int32_t*)mem;
+  slab->bytes = bytes;
+  slab->references = 0;
+  slab->pool = this;
+  return slab;
+}
+
+void BufferPool::Free(BufferSlab* slab){
+  munmap(slab->buff, slab->bytes);
+  delete slab;
+}
+
+BufferSlab* BufferPool::Get(std::size_t min_bytes){
+  BufferSlab *slab = nullptr;
+  if (min_bytes > fSlabBytes) {
+    // a single readout bigger than a whole slab. Rare enough that it gets
+    // its own allocation, which is freed rather than recycled
+    slab = Allocate(((min_bytes + PageSize - 1)/PageSize)*PageSize);
+    fOversize++;
+  } else {
+    {
+      const std::lock_guard<std::mutex> lg(fMutex);
+      if (fFree.size() > 0) {
+        slab = fFree.back();
+        fFree.pop_back();
+      }
+    }
+    if (slab == nullptr) {
+      // pool ran dry. Grow it rather than stall the readout
+      slab = Allocate(fSlabBytes);
+      fTotal++;
+      fGrown++;
+    }
+  }
+  slab->references = 1;
+  int in_use = ++fInUse;
+  int peak = fPeakInUse.load();
+  while (in_use > peak && !fPeakInUse.compare_exchange_weak(peak, in_use)) {}
+  return slab;
+}
+
+void BufferPool::Return(BufferSlab* slab){
+  bool last = false;
+  {
+    // under the lock so this and Retire() agree on who deletes the pool
+    const std::lock_guard<std::mutex> lg(fMutex);
+    int in_use = --fInUse;
+    if (fRetired || slab->bytes != fSlabBytes) Free(slab);
+    else fFree.push_back(slab);
+    last = fRetired && in_use == 0;
+  }
+  if (last) delete this;
+}
+
+void BufferPool::Retire(){
+  bool last = false;
+  {
+    const std::lock_guard<std::mutex> lg(fMutex);
+    fRetired = true;
+    for (auto slab : fFree) Free(slab);
+    fFree.clear();
+    last = fInUse == 0;
+  }
+  if (last) delete this;
+}
+
+void BufferPool::Touch(){
+  const std::lock_guard<std::mutex> lg(fMutex);
+  for (auto slab : fFree) {
+    char *mem = (char*)slab->buff;
+    for (std::size_t i = 0; i < slab->bytes; i += PageSize) mem[i] = 0;
+  }
+}
@@ -0,0 +1,71 @@
+#ifndef _BUFFERPOOL_HH_
+#define _BUFFERPOOL_HH_
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/types.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+class BufferPool;
+
+struct BufferSlab{
+  /*
+    One page-aligned block of memory that BLTs are written into directly.
+    Each data_packet holds a reference to the slab its data lives in, and
+    the slab goes back to its pool once the last reference is dropped.
+  */
+  u_int32_t *buff;
+  std::size_t bytes;
+  std::atomic_int references;
+  BufferPool *pool;
+
+  void AddReference() {references++;}
+  void Release();
+};
+
+class BufferPool{
+  /*
+    Pre-allocated, recycled transfer slabs shared by the boards on one
+    optical link. Slabs are taken by the readout thread and returned by
+    whichever thread drops the last reference to them. Never deleted
+    directly: Retire() frees it once the last slab is back.
+  */
+
+public:
+  BufferPool(std::size_t slab_bytes, int n_slabs);
+
+  BufferSlab* Get(std::size_t min_bytes=0);
+  void Return(BufferSlab* slab);
+  // Faults in every free slab from the calling thread, so the pages end up
+  // on that thread's NUMA node
+  void Touch();
+  // Done with it. Deletes it now if nothing's in use, otherwise whichever
+  // Return() brings the last slab back does. Get() mustn't be called after
+  void Retire();
+
+  std::size_t SlabSize() {return fSlabBytes;}
+  int Total() {return fTotal.load();}
+  int InUse() {return fInUse.load();}
+  int PeakInUse() {return fPeakInUse.load();}
+  long Grown() {return fGrown.load();}
+  long Oversize() {return fOversize.load();}
+
+private:
+  ~BufferPool();
+  BufferSlab* Allocate(std::size_t bytes);
+  void Free(BufferSlab* slab);
+
+  std::size_t fSlabBytes;
+  std::vector<BufferSlab*> fFree;
+  std::mutex fMutex;
+  bool fRetired;
+  std::atomic_int fTotal;
+  std::atomic_int fInUse;
+  std::atomic_int fPeakInUse;
+  std::atomic_long fGrown;
+  std::atomic_long fOversize;
+};
+
+#endif
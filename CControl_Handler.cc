@@ -93,18 +93,18 @@ int CControl_Handler::DeviceArm(int run, Options *opts){
     BoardType mv_def = mv[0];
     fBID = mv_def.board;
     fV1495 = new V1495(fLog, fOptions, mv_def.board, fBoardHandle, mv_def.vme_address);
-	// Writing registers to the V1495 board
+	// Writing registers to the V1495 board, all in one go
+	std::vector<std::pair<u_int32_t, u_int32_t>> regs;
 	for(auto regi : fOptions->GetRegisters(fBID)){
 		if(regi.board != fBID)
 		       continue;
-		unsigned int reg = DAXHelpers::StringToHex(regi.reg);
-		unsigned int val = DAXHelpers::StringToHex(regi.val);
-		if(fV1495->WriteReg(reg, val)!=0){
-			fLog->Entry(MongoLog::Error, "Failed to initialise V1495 board");
-			fStatus = DAXHelpers::Idle;
-			return -1;
-		}
-    }
+		regs.emplace_back(DAXHelpers::StringToHex(regi.reg), DAXHelpers::StringToHex(regi.val));
+	}
+	if(fV1495->WriteRegs(regs)!=0){
+		fLog->Entry(MongoLog::Error, "Failed to initialise V1495 board");
+		fStatus = DAXHelpers::Idle;
+		return -1;
+	}
   }else{
     fLog->Entry(MongoLog::Debug, "No V1495");
   }
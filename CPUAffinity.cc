@@ -0,0 +1,81 @@
+#include "CPUAffinity.hh"
+#include <fstream>
+#include <sstream>
+#include <sched.h>
+#include <experimental/filesystem>
+
+std::string CPUAffinity::ReadLine(std::string path){
+  std::ifstream f(path);
+  std::string line;
+  if (f.is_open()) std::getline(f, line);
+  return line;
+}
+
+std::vector<int> CPUAffinity::ParseList(std::string list){
+  // The kernel's cpulist format: comma-separated cores or ranges of them
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (item.size() == 0) continue;
+    try{
+      std::size_t dash = item.find('-');
+      int first = std::stoi(item.substr(0, dash));
+      int last = dash == std::string::npos ? first : std::stoi(item.substr(dash+1));
+      for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+    }
+    catch(std::exception& e){
+      return std::vector<int>();
+    }
+  }
+  return cpus;
+}
+
+std::vector<int> CPUAffinity::Resolve(std::string spec){
+  if (spec.compare(0, 5, "node:") == 0)
+    return ParseList(ReadLine("/sys/devices/system/node/node" + spec.substr(5) + "/cpulist"));
+  if (spec.compare(0, 4, "pci:") == 0)
+    return ParseList(ReadLine("/sys/bus/pci/devices/" + spec.substr(4) + "/local_cpulist"));
+  return ParseList(spec);
+}
+
+int CPUAffinity::NodeOf(int cpu){
+  namespace fs = std::experimental::filesystem;
+  try{
+    for (auto& entry : fs::directory_iterator("/sys/devices/system/cpu/cpu" + std::to_string(cpu))) {
+      std::string name = entry.path().filename().string();
+      if (name.compare(0, 4, "node") == 0) return std::stoi(name.substr(4));
+    }
+  }
+  catch(std::exception& e){}
+  return -1;
+}
+
+int CPUAffinity::NodeOf(const std::vector<int>& cpus){
+  // only meaningful if they're all on the same one
+  int node = cpus.size() > 0 ? NodeOf(cpus[0]) : -1;
+  for (int cpu : cpus) if (NodeOf(cpu) != node) return -1;
+  return node;
+}
+
+int CPUAffinity::Pin(pthread_t thread, const std::vector<int>& cpus){
+  if (cpus.size() == 0) return -1;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+std::string CPUAffinity::Describe(const std::vector<int>& cpus){
+  // back into cpulist format
+  std::stringstream ss;
+  for (unsigned i = 0; i < cpus.size(); i++) {
+    unsigned j = i;
+    while (j+1 < cpus.size() && cpus[j+1] == cpus[j]+1) j++;
+    if (i > 0) ss << ',';
+    ss << cpus[i];
+    if (j > i) ss << '-' << cpus[j];
+    i = j;
+  }
+  return ss.str();
+}
@@ -0,0 +1,32 @@
+#ifndef _CPUAFFINITY_HH_
+#define _CPUAFFINITY_HH_
+
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+class CPUAffinity{
+  /*
+    Helpers for pinning threads to cores, using what the kernel tells us
+    about the machine through sysfs. CPU sets are given as one of
+      "0-3,8,10-11"  a plain cpulist
+      "node:1"       every core on that NUMA node
+      "pci:0000:03:00.0"  the cores local to that PCIe device (an A3818, say)
+    An empty spec means don't pin.
+  */
+
+public:
+  static std::vector<int> Resolve(std::string spec);
+  static std::vector<int> ParseList(std::string list);
+  // -1 if unknown
+  static int NodeOf(int cpu);
+  static int NodeOf(const std::vector<int>& cpus);
+  // 0 on success
+  static int Pin(pthread_t thread, const std::vector<int>& cpus);
+  static std::string Describe(const std::vector<int>& cpus);
+
+private:
+  static std::string ReadLine(std::string path);
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "ChunkAggregator.hh"
+#include "StraxWriter.hh"
+#include "MongoLog.hh"
+#include "MemoryGovernor.hh"
+#include "RecordSort.hh"
+#include <algorithm>
+#include <fstream>
+
+namespace fs=std::experimental::filesystem;
+
+ChunkAggregator::ChunkAggregator(StraxWriter *writer, MongoLog *log, std::string hostname,
+    int max_open, int record_bytes){
+  fWriter = writer;
+  fLog = log;
+  fHostname = hostname;
+  fMaxOpen = max_open;
+  fRecordBytes = record_bytes;
+  fNextMember = 0;
+  fNewest = 0;
+  fPending = 0;
+}
+
+ChunkAggregator::~ChunkAggregator(){
+  for (auto& p : fOpen) {
+    if (p.second.job->buffer != nullptr)
+      MemoryGovernor::Add(MemoryGovernor::Chunks, -long(p.second.job->buffer->size()));
+    delete p.second.job->buffer;
+    delete p.second.job;
+  }
+}
+
+int ChunkAggregator::Join(){
+  const std::lock_guard<std::mutex> lg(fMutex);
+  fMembers.insert(fNextMember);
+  return fNextMember++;
+}
+
+void ChunkAggregator::Leave(int member, fs::path end_dir){
+  std::vector<Entry> ready;
+  {
+    const std::lock_guard<std::mutex> lg(fMutex);
+    fMembers.erase(member);
+    if (!end_dir.empty()) fEndDir = end_dir;
+    Collect(ready, false);
+  }
+  Submit(ready);
+}
+
+void ChunkAggregator::Add(int member, std::string name, WriteJob *paths, std::string *buffer){
+  std::vector<Entry> ready;
+  if (buffer != nullptr && buffer->size() == 0) {
+    delete buffer;
+    buffer = nullptr;
+  }
+  {
+    const std::lock_guard<std::mutex> lg(fMutex);
+    // names start with the chunk number
+    int chunk_id = std::stoi(name);
+    fNewest = std::max(fNewest, chunk_id);
+    auto written = fWritten.find(name);
+    if (written != fWritten.end()) {
+      // too late for the merged file
+      if (buffer != nullptr) {
+        paths->buffer = buffer;
+        Name(paths, written->second++);
+        ready.push_back(Entry{chunk_id, paths, {}, {0}});
+      } else {
+        delete paths;
+      }
+    } else {
+      auto it = fOpen.find(name);
+      if (it == fOpen.end()) {
+        it = fOpen.emplace(name, Entry{chunk_id, paths, {}, {}}).first;
+      } else {
+        delete paths;
+      }
+      Entry& entry = it->second;
+      if (buffer != nullptr) {
+        MemoryGovernor::Add(MemoryGovernor::Chunks, buffer->size());
+        if (entry.job->buffer == nullptr) {
+          entry.job->buffer = buffer;
+          entry.runs.push_back(0);
+        } else {
+          entry.runs.push_back(entry.job->buffer->size());
+          entry.job->buffer->append(*buffer);
+          delete buffer;
+        }
+      }
+      entry.done.insert(member);
+    }
+    Collect(ready, false);
+  }
+  Submit(ready);
+}
+
+void ChunkAggregator::Collect(std::vector<Entry>& ready, bool all){
+  for (auto it = fOpen.begin(); it != fOpen.end(); ) {
+    Entry& entry = it->second;
+    bool complete = all || std::includes(entry.done.begin(), entry.done.end(),
+        fMembers.begin(), fMembers.end());
+    if (!complete && entry.chunk_id + fMaxOpen >= fNewest) {
+      it++;
+      continue;
+    }
+    if (!complete)
+      fLog->Entry(MongoLog::Local, "Writing out %s before every thread is done with it",
+          it->first.c_str());
+    if (entry.job->buffer != nullptr)
+      MemoryGovernor::Add(MemoryGovernor::Chunks, -long(entry.job->buffer->size()));
+    Name(entry.job, 0);
+    fWritten[it->first] = 1;
+    ready.push_back(std::move(entry));
+    it = fOpen.erase(it);
+  }
+}
+
+void ChunkAggregator::Name(WriteJob *job, int part){
+  std::string filename = fHostname;
+  if (part > 0) filename += "_" + std::to_string(part);
+  job->temp_path = job->temp_dir / filename;
+  job->final_path = job->final_dir / filename;
+}
+
+void ChunkAggregator::Submit(std::vector<Entry>& ready){
+  // Outside the lock, since the writer may make us wait for memory, and
+  // merging takes a while too
+  for (auto& entry : ready) {
+    WriteJob *job = entry.job;
+    if (fRecordBytes > 0 && job->buffer != nullptr)
+      MergeRecords(*job->buffer, entry.runs, fRecordBytes);
+    // nobody on this host had anything for it
+    if (job->buffer == nullptr) job->placeholders.push_back(job->final_path);
+    job->done = [this]{
+      const std::lock_guard<std::mutex> lg(fPendingMutex);
+      if (--fPending == 0) fPendingCV.notify_all();
+    };
+    {
+      const std::lock_guard<std::mutex> lg(fPendingMutex);
+      fPending++;
+    }
+    fWriter->Submit(job);
+  }
+  ready.clear();
+}
+
+void ChunkAggregator::Close(){
+  std::vector<Entry> ready;
+  {
+    const std::lock_guard<std::mutex> lg(fMutex);
+    Collect(ready, true);
+  }
+  Submit(ready);
+  {
+    std::unique_lock<std::mutex> lk(fPendingMutex);
+    fPendingCV.wait(lk, [&]{return fPending == 0;});
+  }
+  // THE_END means everything is on disk, so only now
+  if (fEndDir.empty()) return;
+  fWriter->EnsureDirectory(fEndDir);
+  std::ofstream outfile(fEndDir / fHostname, std::ios::out);
+  outfile<<"...my only friend";
+  outfile.close();
+  fEndDir.clear();
+}
@@ -0,0 +1,78 @@
+#ifndef _CHUNKAGGREGATOR_HH_
+#define _CHUNKAGGREGATOR_HH_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <condition_variable>
+#include <experimental/filesystem>
+
+class MongoLog;
+class StraxWriter;
+struct WriteJob;
+
+class ChunkAggregator{
+  /*
+    Puts what all the inserters on a host have for a chunk into one file,
+    rather than every thread writing its own. Each inserter hands over its
+    buffer for a chunk (or says it has nothing for it) once it's done with
+    it, and when all of them have, the lot goes through the StraxWriter like
+    any other chunk. A chunk nobody had data for gets one placeholder for the
+    whole host. Anything that shows up for a chunk after it's gone out is
+    written to a numbered file next to it.
+  */
+
+public:
+  // A chunk that's this many behind the newest one handed in goes out even
+  // if not everyone is done with it. With record_bytes set, what's handed in
+  // is taken to be in time order already and merged so the file is too
+  ChunkAggregator(StraxWriter *writer, MongoLog *log, std::string hostname, int max_open,
+      int record_bytes);
+  ~ChunkAggregator();
+
+  // Every inserter has to join before any of them starts handing in chunks
+  int Join();
+  // Nobody waits for this member any more. The end directory is where
+  // THE_END goes once everything is written, empty if it had no data
+  void Leave(int member, std::experimental::filesystem::path end_dir);
+  // name is the chunk number plus any _pre or _post. Takes ownership of
+  // both; the job only says which directories and compressor to use, and
+  // buffer is null if the member had nothing for this one
+  void Add(int member, std::string name, WriteJob *paths, std::string *buffer);
+  // Writes out whatever is left and waits until it's all on disk
+  void Close();
+
+private:
+  struct Entry{
+    int chunk_id;
+    WriteJob *job; // holds the merged buffer once there's any data
+    std::set<int> done; // members that handed theirs in
+    std::vector<std::size_t> runs; // where each contribution starts in the buffer
+  };
+  // Takes out everything that can go to disk now, or everything at all
+  void Collect(std::vector<Entry>& ready, bool all);
+  void Submit(std::vector<Entry>& ready);
+  void Name(WriteJob *job, int part);
+
+  StraxWriter *fWriter;
+  MongoLog *fLog;
+  std::string fHostname;
+  int fMaxOpen, fRecordBytes;
+
+  std::map<std::string, Entry> fOpen;
+  // Gone out already, and how many files each has so far. Kept for
+  // the whole run, so late data never lands on the merged file again
+  std::map<std::string, int> fWritten;
+  std::set<int> fMembers;
+  int fNextMember, fNewest;
+  std::experimental::filesystem::path fEndDir;
+  std::mutex fMutex;
+
+  int fPending;
+  std::mutex fPendingMutex;
+  std::condition_variable fPendingCV;
+};
+
+#endif
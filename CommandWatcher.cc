@@ -0,0 +1,128 @@
+#include "CommandWatcher.hh"
+#include "MongoLog.hh"
+#include <thread>
+#include <mongocxx/pipeline.hpp>
+#include <mongocxx/options/change_stream.hpp>
+#include <bsoncxx/builder/stream/document.hpp>
+#include <bsoncxx/builder/stream/array.hpp>
+
+CommandWatcher::CommandWatcher(mongocxx::collection control, std::string hostname,
+    MongoLog *log, std::chrono::milliseconds wait){
+  fControl = control;
+  fHostname = hostname;
+  fLog = log;
+  fWait = wait;
+  fRetryInterval = std::chrono::seconds(30);
+  fStream = nullptr;
+  fPollFailed = false;
+  fLastAttempt = fLastPoll = std::chrono::steady_clock::now() - fRetryInterval;
+}
+
+CommandWatcher::~CommandWatcher(){
+  if (fStream != nullptr) delete fStream;
+}
+
+std::vector<bsoncxx::document::value> CommandWatcher::Get(){
+  std::vector<bsoncxx::document::value> ret;
+  auto now = std::chrono::steady_clock::now();
+  if (fStream == nullptr && now - fLastAttempt >= fRetryInterval) {
+    Open(ret);
+    if (ret.size() > 0) return ret;
+  }
+  if (fStream != nullptr) {
+    try{
+      // comes back empty after fWait if nothing's happened
+      for (auto event : *fStream) {
+        Add(event["fullDocument"].get_document().view(), ret);
+      }
+      return ret;
+    }catch(const std::exception& e){
+      fLog->Entry(MongoLog::Warning, "Lost the command stream (%s), polling until it's back",
+          e.what());
+      delete fStream;
+      fStream = nullptr;
+      fLastAttempt = std::chrono::steady_clock::now();
+    }
+  }
+  std::this_thread::sleep_until(fLastPoll + fWait);
+  Poll(ret);
+  return ret;
+}
+
+void CommandWatcher::Open(std::vector<bsoncxx::document::value>& ret){
+  using namespace bsoncxx::builder::stream;
+  fLastAttempt = std::chrono::steady_clock::now();
+  try{
+    mongocxx::pipeline pipeline;
+    pipeline.match(document{} << "operationType" << "insert" <<
+        "fullDocument.host" << fHostname << finalize);
+    mongocxx::options::change_stream opts;
+    opts.max_await_time(fWait);
+    fStream = new mongocxx::change_stream(fControl.watch(pipeline, opts));
+    fLog->Entry(MongoLog::Local, "Watching for commands");
+  }catch(const std::exception& e){
+    fLog->Entry(MongoLog::Local, "Can't open the command stream, polling instead: %s",
+        e.what());
+    if (fStream != nullptr) delete fStream;
+    fStream = nullptr;
+  }
+  // whatever came in while nobody was watching
+  Poll(ret);
+}
+
+void CommandWatcher::Poll(std::vector<bsoncxx::document::value>& ret){
+  using namespace bsoncxx::builder::stream;
+  fLastPoll = std::chrono::steady_clock::now();
+  try{
+    // Sort oldest to newest
+    auto order = document{} << "_id" << 1 << finalize;
+    auto opts = mongocxx::options::find{};
+    opts.sort(order.view());
+    mongocxx::cursor cursor = fControl.find(document{} << "host" << fHostname <<
+        "acknowledged" << open_document << "$ne" << fHostname << close_document <<
+        finalize, opts);
+    for (auto doc : cursor) Add(doc, ret);
+    fPollFailed = false;
+  }catch(const std::exception& e){
+    // once per outage is plenty
+    if (!fPollFailed)
+      fLog->Entry(MongoLog::Local, "Can't query for commands: %s", e.what());
+    fPollFailed = true;
+  }
+}
+
+bool CommandWatcher::Add(bsoncxx::document::view doc,
+    std::vector<bsoncxx::document::value>& ret){
+  std::string id;
+  try{
+    id = doc["_id"].get_oid().value.to_string();
+  }catch(const std::exception& e){
+    return false;
+  }
+  if (!fSeen.insert(id).second) return false;
+  fSeenOrder.push_back(id);
+  if (fSeenOrder.size() > 1000) {
+    fSeen.erase(fSeenOrder.front());
+    fSeenOrder.pop_front();
+  }
+  ret.push_back(bsoncxx::document::value(doc));
+  return true;
+}
+
+void CommandWatcher::Acknowledge(const std::vector<bsoncxx::document::value>& commands){
+  using namespace bsoncxx::builder::stream;
+  if (commands.size() == 0) return;
+  try{
+    fControl.update_many(document{} << "_id" << open_document << "$in" << open_array <<
+        [&](array_context<> arr){
+        for (auto& doc : commands) arr << doc.view()["_id"].get_oid();
+        } << close_array << close_document <<
+        "acknowledged" << open_document << "$ne" << fHostname << close_document << finalize,
+        document{} << "$push" << open_document << "acknowledged" << fHostname <<
+        close_document << finalize);
+  }catch(const std::exception& e){
+    // They'll still be carried out, we just can't tell anyone
+    fLog->Entry(MongoLog::Warning, "Failed to acknowledge %i commands: %s",
+        int(commands.size()), e.what());
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef _COMMANDWATCHER_HH_
+#define _COMMANDWATCHER_HH_
+
+#include <string>
+#include <vector>
+#include <set>
+#include <deque>
+#include <chrono>
+#include <mongocxx/collection.hpp>
+#include <mongocxx/change_stream.hpp>
+#include <bsoncxx/document/value.hpp>
+
+class MongoLog;
+
+class CommandWatcher{
+  /*
+    Picks up the commands in the control collection addressed to one host.
+    Normally follows a change stream, so commands come to us as they're
+    inserted instead of everyone querying the collection all the time. If
+    the stream can't be opened or breaks (no replica set, failover, ...) it
+    falls back to polling until the stream can be reopened. Every time it
+    (re)opens there's one query to catch up on anything we missed.
+  */
+
+public:
+  // Get() waits at most about this long for something to show up, and
+  // that's also how often it polls when it has to
+  CommandWatcher(mongocxx::collection control, std::string hostname, MongoLog *log,
+      std::chrono::milliseconds wait);
+  ~CommandWatcher();
+
+  // The commands for us that we haven't acknowledged, oldest first
+  std::vector<bsoncxx::document::value> Get();
+  // Marks all of them as acknowledged by this host in one write
+  void Acknowledge(const std::vector<bsoncxx::document::value>& commands);
+  bool Streaming() {return fStream != nullptr;}
+
+private:
+  void Open(std::vector<bsoncxx::document::value>& ret);
+  void Poll(std::vector<bsoncxx::document::value>& ret);
+  // false if we already handed this one out
+  bool Add(bsoncxx::document::view doc, std::vector<bsoncxx::document::value>& ret);
+
+  mongocxx::collection fControl;
+  mongocxx::change_stream *fStream;
+  std::string fHostname;
+  MongoLog *fLog;
+  std::chrono::milliseconds fWait, fRetryInterval;
+  std::chrono::steady_clock::time_point fLastAttempt, fLastPoll;
+  // What was handed out recently, since a command can show up in both the
+  // catch-up query and the stream
+  std::set<std::string> fSeen;
+  std::deque<std::string> fSeenOrder;
+  bool fPollFailed;
+};
+
+#endif
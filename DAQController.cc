@@ -6,7 +6,15 @@
 #include "DAXHelpers.hh"
 #include "Options.hh"
 #include "StraxInserter.hh"
+#include "StraxWriter.hh"
 #include "MongoLog.hh"
+#include "BufferPool.hh"
+#include "HeaderScan.hh"
+#include "CPUAffinity.hh"
+#include "Metrics.hh"
+#include "PacketCapture.hh"
+#include "MemoryGovernor.hh"
+#include <fstream>
 #include <unistd.h>
 #include <algorithm>
 #include <bitset>
@@ -33,11 +41,18 @@ DAQController::DAQController(MongoLog *log, std::string hostname){
   fBufferLength = 0;
   fDataRate=0.;
   fHostname = hostname;
+  fRing = nullptr;
+  fWriter = nullptr;
+  fUseRing = false;
+  fWaiting = 0;
+  fRingFull = 0;
 }
 
 DAQController::~DAQController(){
   if(fProcessingThreads.size()!=0)
     CloseProcessingThreads();
+  for (auto& p : fParked) delete p.second;
+  fParked.clear();
 }
 
 std::string DAQController::run_mode(){
@@ -57,55 +72,160 @@ int DAQController::InitializeElectronics(Options *options, std::vector<int>&keys
   
   fOptions = options;
   fNProcessingThreads = fOptions->GetNestedInt("processing_threads."+fHostname, 8);  
+  fUseRing = fOptions->GetString("buffer_type", "dual") == "ring";
+  if (fUseRing) {
+    fRing = new RingBuffer<data_packet*>(fOptions->GetInt("buffer_ring_size", 0x10000));
+    fRingFull = 0;
+  }
   fLog->Entry(MongoLog::Local, "Beginning electronics initialization with %i threads",
 	      fNProcessingThreads);
 
   // Initialize digitizers
   fStatus = DAXHelpers::Arming;
   std::vector<int> BIDs;
+  long slab_bytes = fOptions->GetInt("blt_pool_slab_size", 0x400000);
+  int n_slabs = fOptions->GetInt("blt_pool_slabs", 32);
+  fPollStatus = fOptions->GetInt("readout_poll_status", 1) != 0;
+  fMinBackoff = std::max(1, fOptions->GetInt("readout_backoff_min_us", 10));
+  fMaxBackoff = std::max(fMinBackoff, (long)fOptions->GetInt("readout_backoff_max_us", 1000));
+  MemoryGovernor::Configure(long(fOptions->GetInt("memory_budget_mb", 0))<<20,
+      fOptions->GetDouble("memory_throttle_fraction", 0.7),
+      fOptions->GetDouble("memory_flush_fraction", 0.85),
+      fOptions->GetInt("memory_throttle_max_us", 5000));
+  using namespace std::chrono;
+  auto arm_start = steady_clock::now();
+  std::map<int, std::vector<std::pair<BoardType, V1724*>>> boards;
+  // Boards kept from the last run are picked back up if they're still where
+  // they were. The rest get closed and everything else starts from scratch
+  bool hot = fOptions->GetInt("rearm_hot", 0) != 0;
+  std::map<int, V1724*> parked;
+  parked.swap(fParked);
+  fReused.clear();
   for(auto d : fOptions->GetBoards("V17XX", fHostname)){
+    V1724 *digi;
+    auto kept = parked.find(d.board);
+    if (hot && kept != parked.end()) {
+      std::string why = MustReset(d);
+      if (why.empty()) {
+        fLog->Entry(MongoLog::Local, "Re-arming digitizer %i", d.board);
+        digi = kept->second;
+        parked.erase(kept);
+        fReused.insert(d.board);
+        boards[d.link].emplace_back(d, digi);
+        continue;
+      }
+      fLog->Entry(MongoLog::Local, "Digitizer %i gets a reset: %s", d.board, why.c_str());
+      // closed before the new one opens the link
+      delete kept->second;
+      parked.erase(kept);
+    }
     fLog->Entry(MongoLog::Local, "Arming new digitizer %i", d.board);
+    AppliedConfig& applied = fApplied[d.board];
+    applied = AppliedConfig();
+    applied.link = d.link;
+    applied.crate = d.crate;
+    applied.vme_address = d.vme_address;
+    applied.type = d.type;
 
-    V1724 *digi;
     if(d.type == "V1724_MV")
       digi = new V1724_MV(fLog, fOptions);
     else if(d.type == "V1730")
       digi = new V1730(fLog, fOptions);
     else
       digi = new V1724(fLog, fOptions);
+    boards[d.link].emplace_back(d, digi);
+  }
+  for (auto& p : parked) {
+    fApplied.erase(p.first);
+    delete p.second;
+  }
+  parked.clear();
 
+  // Links don't share anything, so their boards can be reset and brought up
+  // at the same time. Each one only returns once its board is ready again
+  std::map<int, int> init_rets;
+  for (auto& link : boards) init_rets[link.first] = 0;
+  std::vector<std::thread*> init_threads;
+  for (auto& link : boards) {
+    init_threads.push_back(new std::thread([&, l = link.first]{
+      for (auto& b : boards.at(l)) {
+        const BoardType& d = b.first;
+        if (fReused.count(d.board)) {
+          if (b.second->Rearm(fOptions)) continue;
+          // then it has to go the long way after all
+          fLog->Entry(MongoLog::Local, "Digitizer %i can't be re-armed, resetting it", d.board);
+          b.second->End();
+          const std::lock_guard<std::mutex> lg(fAppliedMutex);
+          fApplied[d.board].valid = false;
+        }
+        if (b.second->Init(d.link, d.crate, d.board, d.vme_address) != 0) {
+          fLog->Entry(MongoLog::Warning, "Failed to initialize digitizer %i", d.board);
+          init_rets.at(l) = -1;
+          return;
+        }
+        fLog->Entry(MongoLog::Debug, "Initialized digitizer %i", d.board);
+      }
+    }));
+  }
+  std::for_each(init_threads.begin(), init_threads.end(),
+      [](std::thread* t) {t->join(); delete t;});
+  init_threads.clear();
+  if (std::any_of(init_rets.begin(), init_rets.end(), [](auto& p) {return p.second != 0;})) {
+    for (auto& link : boards) {
+      for (auto& b : link.second) {
+        fApplied.erase(b.first.board);
+        delete b.second;
+      }
+    }
+    fReused.clear();
+    fStatus = DAXHelpers::Idle;
+    return -1;
+  }
 
-    if(digi->Init(d.link, d.crate, d.board, d.vme_address)==0){
-	fDigitizers[d.link].push_back(digi);
-        BIDs.push_back(digi->bid());
-        fBoardMap[digi->bid()] = digi;
-        fCheckFails[digi->bid()] = false;
+  for (auto& link : boards) {
+    for (auto& b : link.second) {
+      const BoardType& d = b.first;
+      V1724 *digi = b.second;
+      if (fBufferPools.count(d.link) == 0) {
+        const std::lock_guard<std::mutex> lg(fPoolMutex);
+        fBufferPools[d.link] = new BufferPool(slab_bytes, n_slabs);
+      }
+      digi->SetBufferPool(fBufferPools[d.link]);
+      fDigitizers[d.link].push_back(digi);
+      BIDs.push_back(digi->bid());
+      fBoardMap[digi->bid()] = digi;
+      fCheckFails[digi->bid()] = false;
+      {
+        const std::lock_guard<std::mutex> lg(fScheduleMutex);
+        BoardSchedule *sched = new BoardSchedule;
+        sched->fill_rate = 0;
+        sched->backoff_us = sched->reads = sched->bytes = 0;
+        sched->polls = sched->idle_polls = 0;
+        fSchedule[digi->bid()] = sched;
+      }
 
-	if(std::find(keys.begin(), keys.end(), d.link) == keys.end()){
-	  fLog->Entry(MongoLog::Local, "Defining a new optical link at %i", d.link);
-	  keys.push_back(d.link);
-	}
-	fLog->Entry(MongoLog::Debug, "Initialized digitizer %i", d.board);
-	
-    }
-    else{
-      delete digi;
-      fLog->Entry(MongoLog::Warning, "Failed to initialize digitizer %i", d.board);
-      fStatus = DAXHelpers::Idle;
-      return -1;
+      if(std::find(keys.begin(), keys.end(), d.link) == keys.end()){
+        fLog->Entry(MongoLog::Local, "Defining a new optical link at %i", d.link);
+        keys.push_back(d.link);
+      }
     }
   }
+  auto init_end = steady_clock::now();
   fLog->Entry(MongoLog::Local, "This host has %i boards", BIDs.size());
-  fLog->Entry(MongoLog::Local, "Sleeping for two seconds");
-  // For the sake of sanity and sleeping through the night,
-  // do not remove this statement.
-  sleep(2); // <-- this one. Leave it here.
-  // Seriously. This sleep statement is absolutely vital.
-  fLog->Entry(MongoLog::Local, "That felt great, thanks.");
+  ResolveAffinity(keys);
+  fCapturePath = fOptions->GetString("capture_file", "");
+  if (fCapturePath != "") {
+    // so the capture can be replayed with the same settings
+    std::ofstream opts(fCapturePath + ".json");
+    opts << fOptions->ExportToString();
+    fLog->Entry(MongoLog::Message, "Capturing raw data to %s_<link>", fCapturePath.c_str());
+  }
+  // This used to be a flat two second sleep. Init now waits until each board
+  // reports itself ready after its reset, which is what the sleep was for
   std::map<int, std::map<std::string, std::vector<double>>> dac_values;
-  if (fOptions->GetString("baseline_dac_mode") == "cached")
+  std::string bl_mode = fOptions->GetString("baseline_dac_mode");
+  if (bl_mode == "cached" || bl_mode == "hybrid")
     fOptions->GetDAC(dac_values, BIDs);
-  std::vector<std::thread*> init_threads;
   fMaxEventsPerThread = fOptions->GetInt("max_events_per_thread", 1024);
   std::map<int,int> rets;
   // Parallel digitizer programming to speed baselining
@@ -126,7 +246,8 @@ int DAQController::InitializeElectronics(Options *options, std::vector<int>&keys
     return -1;
   } else
     fLog->Entry(MongoLog::Debug, "Digitizer programming successful");
-  if (fOptions->GetString("baseline_dac_mode") == "fit") fOptions->UpdateDAC(dac_values);
+  auto program_end = steady_clock::now();
+  if (bl_mode == "fit" || bl_mode == "hybrid") fOptions->UpdateDAC(dac_values);
 
   for(auto const& link : fDigitizers ) {
     for(auto digi : link.second){
@@ -136,7 +257,23 @@ int DAQController::InitializeElectronics(Options *options, std::vector<int>&keys
 	digi->AcquisitionStop();
     }
   }
-  sleep(1);
+  int ready_timeout = fOptions->GetInt("arm_ready_timeout_ms", 2000);
+  for(auto const& link : fDigitizers ) {
+    for(auto digi : link.second){
+      if (!digi->WaitForReady(ready_timeout)) {
+        fLog->Entry(MongoLog::Warning, "Board %i not ready at the end of arming", digi->bid());
+        fStatus = DAXHelpers::Idle;
+        return -1;
+      }
+    }
+  }
+  auto arm_end = steady_clock::now();
+  fLog->Entry(MongoLog::Message,
+      "Armed %i boards (%i kept) in %li ms (init %li, program %li, finish %li)",
+      BIDs.size(), fReused.size(), duration_cast<milliseconds>(arm_end-arm_start).count(),
+      duration_cast<milliseconds>(init_end-arm_start).count(),
+      duration_cast<milliseconds>(program_end-init_end).count(),
+      duration_cast<milliseconds>(arm_end-program_end).count());
   fStatus = DAXHelpers::Armed;
 
   fLog->Entry(MongoLog::Local, "Arm command finished, returning to main loop");
@@ -172,22 +309,36 @@ int DAQController::Start(){
   return 0;
 }
 
-int DAQController::Stop(){
+void DAQController::BeginStop(){
+  if (fStopStart != std::chrono::steady_clock::time_point()) return;
+  long timeout = fOptions != NULL ? fOptions->GetInt("stop_timeout_ms", 10000) : 10000;
+  fStopStart = std::chrono::steady_clock::now();
+  fStopDeadline = fStopStart + std::chrono::milliseconds(std::max(0L, timeout));
+  fStopTimeline.clear();
+}
 
-  fReadLoop = false; // at some point.
-  int counter = 0;
-  bool one_still_running = false;
-  do{
-    one_still_running = false;
-    for (auto& p : fRunning) one_still_running |= p.second;
-    if (one_still_running) std::this_thread::sleep_for(std::chrono::milliseconds(100));
-  }while(one_still_running && counter++ < 10);
-  if (counter >= 10) fLog->Entry(MongoLog::Local, "Boards taking a while to clear");
+int DAQController::Stop(){
+  // the clock only starts once, not again for the Stop() that End() does
+  BeginStop();
+  fReadLoop = false;
+  {
+    std::unique_lock<std::mutex> lk(fStopMutex);
+    if (!fStopCV.wait_until(lk, fStopDeadline, [&]{
+          for (auto& p : fRunning) if (p.second) return false;
+          return true;}))
+      fLog->Entry(MongoLog::Local, "Readout threads taking a while to stop");
+  }
+  fStopTimeline.emplace("readout", std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - fStopStart).count());
   std::cout<<"Deactivating boards"<<std::endl;
+  // Tell all of them first, so they stop at the same time rather than one by one
   for( auto const& link : fDigitizers ){
     for(auto digi : link.second){
       digi->AcquisitionStop();
-
+    }
+  }
+  for( auto const& link : fDigitizers ){
+    for(auto digi : link.second){
       // Ensure digitizer is stopped
       if(digi->EnsureStopped(1000, 1000) != true){
 	fLog->Entry(MongoLog::Warning,
@@ -196,6 +347,8 @@ int DAQController::Stop(){
       }
     }
   }
+  fStopTimeline.emplace("boards", std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - fStopStart).count());
   fLog->Entry(MongoLog::Debug, "Stopped digitizers");
 
   fStatus = DAXHelpers::Idle;
@@ -203,10 +356,20 @@ int DAQController::Stop(){
 }
 
 void DAQController::End(){
+  // a board that ended up in an error state gets a proper reset next time
+  bool park = fOptions != NULL && fOptions->GetInt("rearm_hot", 0) != 0 &&
+    fStatus != DAXHelpers::Error;
   Stop();
-  fLog->Entry(MongoLog::Local, "Closing Digitizers");
+  fLog->Entry(MongoLog::Local, park ? "Keeping digitizers for the next run" :
+      "Closing Digitizers");
   for( auto const& link : fDigitizers ){
     for(auto digi : link.second){
+      if (park) {
+        digi->Park();
+        fParked[digi->bid()] = digi;
+        continue;
+      }
+      fApplied.erase(digi->bid());
       digi->End();
       delete digi;
     }
@@ -214,15 +377,36 @@ void DAQController::End(){
   fLog->Entry(MongoLog::Local, "Closing Processing Threads");
   CloseProcessingThreads();
   fDigitizers.clear();
+  {
+    const std::lock_guard<std::mutex> lg(fScheduleMutex);
+    for (auto& p : fSchedule) delete p.second;
+    fSchedule.clear();
+  }
   fStatus = DAXHelpers::Idle;
 
-  if(fBuffer.size() != 0){
+  if(fBufferLength.load() != 0){
     fLog->Entry(MongoLog::Warning, "Deleting uncleard buffer of size %i",
-		fBuffer.size());
-    std::for_each(fBuffer.begin(), fBuffer.end(), [](auto dp){delete dp;});
-    fBuffer.clear();
-    fBufferLength = 0;
-    fBufferSize = 0;
+		fBufferLength.load());
+    ClearBuffer();
+  }
+  if (fRing != nullptr) {
+    if (fRingFull > 0)
+      fLog->Entry(MongoLog::Local, "Readout found the ring buffer full %li times",
+          fRingFull.load());
+    delete fRing;
+    fRing = nullptr;
+  }
+  // Nothing of ours holds slabs any more, but anything that still does
+  // keeps its pool alive until it gives them back
+  {
+    const std::lock_guard<std::mutex> lg(fPoolMutex);
+    for (auto& p : fBufferPools) {
+      if (p.second->InUse() != 0)
+        fLog->Entry(MongoLog::Warning, "Link %i buffer pool still has %i slabs in use",
+            p.first, p.second->InUse());
+      p.second->Retire();
+    }
+    fBufferPools.clear();
   }
   fOptions = NULL;
   std::cout<<"Finished end"<<std::endl;
@@ -232,36 +416,70 @@ void DAQController::ReadData(int link){
   fReadLoop = true;
   
   // Raw data buffer should be NULL. If not then maybe it was not cleared since last time
-  fBufferMutex.lock();
-  if(fBuffer.size() != 0){
+  if(fBufferLength.load() != 0){
     fLog->Entry(MongoLog::Debug, "Raw data buffer being brute force cleared.");
-    std::for_each(fBuffer.begin(), fBuffer.end(), [](auto dp){delete dp;});
-    fBuffer.clear();
+    ClearBuffer();
   }
-  fBufferLength = 0;
   fDataRate = 0;
-  fBufferSize = 0;
-  fBufferMutex.unlock();
   
-  u_int32_t board_status = 0;
+  V1724::Status board_status;
   u_int32_t event_number = 0;
   int readcycler = 0;
   int err_val = 0;
   std::list<data_packet*> local_buffer;
   data_packet* dp = nullptr;
-  int local_size;
+  int local_size(0);
+  Metrics::Register("readout_" + std::to_string(link));
+  PacketCapture *capture = nullptr;
+  if (fCapturePath != "") {
+    std::map<int, std::map<std::string, int>> formats;
+    GetDataFormat(formats);
+    capture = new PacketCapture;
+    std::string path = fCapturePath + "_" + std::to_string(link);
+    if (capture->OpenWrite(path, formats, long(fOptions->GetInt("capture_max_mb", 1024))<<20)) {
+      fLog->Entry(MongoLog::Warning, "Can't open capture file %s", path.c_str());
+      delete capture;
+      capture = nullptr;
+    }
+  }
+  if (fReadoutCPUs.count(link)) {
+    if (CPUAffinity::Pin(pthread_self(), fReadoutCPUs.at(link)))
+      fLog->Entry(MongoLog::Warning, "Couldn't pin readout of link %i", link);
+    else if (fBufferPools.count(link))
+      fBufferPools[link]->Touch();
+  }
+  // Boards are read busiest first, so the ones filling up fastest don't wait
+  // behind the rest. One that turns out to be empty isn't looked at again
+  // for a while, and that while doubles each time it's still empty
+  std::vector<std::pair<V1724*, BoardSchedule*>> boards;
+  {
+    const std::lock_guard<std::mutex> lg(fScheduleMutex);
+    for (auto digi : fDigitizers[link]) boards.emplace_back(digi, fSchedule[digi->bid()]);
+  }
+  auto now = std::chrono::steady_clock::now();
+  for (auto& b : boards) b.second->next_poll = b.second->last_read = now;
   fRunning[link] = true;
   while(fReadLoop){
-    
-    for(auto digi : fDigitizers[link]) {
-
-      // Every 1k reads check board status
-      if(readcycler%10000==0){
-	readcycler=0;
-        board_status = digi->GetAcquisitionStatus();
-        fLog->Entry(MongoLog::Local, "Board %i has status 0x%04x",
-            digi->bid(), board_status);
+    now = std::chrono::steady_clock::now();
+    auto next_due = now + std::chrono::microseconds(fMaxBackoff);
+    bool got_data = false;
+    std::stable_sort(boards.begin(), boards.end(), [](auto& a, auto& b) {
+        return a.second->fill_rate > b.second->fill_rate;});
+
+    // Every 10k passes check board status, one transaction per board
+    if(readcycler%10000==0){
+      readcycler=0;
+      for (auto& b : boards) {
+        V1724 *digi = b.first;
+        digi->ReadStatus(board_status);
+        fLog->Entry(MongoLog::Local, "Board %i has status 0x%04x, readout 0x%04x",
+            digi->bid(), board_status.acquisition, board_status.readout);
       }
+    }
+    for(auto& b : boards) {
+      V1724 *digi = b.first;
+      BoardSchedule *sched = b.second;
+
       if (fCheckFails[digi->bid()]) {
         fCheckFails[digi->bid()] = false;
         err_val = fBoardMap[digi->bid()]->CheckErrors();
@@ -275,53 +493,149 @@ void DAQController::ReadData(int link){
                                          digi->bid());
         }
       }
+      if (now < sched->next_poll) {
+        next_due = std::min(next_due, sched->next_poll);
+        continue;
+      }
+      sched->polls++;
+      // one register read is much cheaper than a BLT that finds nothing.
+      // If the read fails, try the BLT anyway and let that report it
+      if (fPollStatus && digi->DataReady() == 0) {
+        Backoff(sched, now);
+        next_due = std::min(next_due, sched->next_poll);
+        continue;
+      }
       if (dp == nullptr) dp = new data_packet;
-      if((dp->size = digi->ReadMBLT(dp->buff, &dp->vBLT))<0){
-        if (dp->buff != nullptr) {
-	  delete[] dp->buff; // possible leak, catch here
-	  dp->buff = nullptr;
-          delete dp;
-          dp = nullptr;
-	}
+      auto read_start = std::chrono::steady_clock::now();
+      if((dp->size = digi->ReadMBLT(dp->buff, dp->slab, &dp->vBLT))<0){
+        delete dp;
+        dp = nullptr;
 	break;
       }
       if(dp->size>0){
         dp->bid = digi->bid();
+        dp->read_time = std::chrono::steady_clock::now();
+        Metrics::Record(Metrics::BLTRead, read_start, dp->size, dp->bid);
 	dp->header_time = digi->GetHeaderTime(dp->buff, dp->size, event_number);
 	dp->clock_counter = digi->GetClockCounter(dp->header_time, event_number);
+        if (capture != nullptr && capture->Write(dp)) {
+          fLog->Entry(MongoLog::Message, "Link %i capture done after %li MB", link,
+              capture->Bytes()>>20);
+          delete capture;
+          capture = nullptr;
+        }
+        MemoryGovernor::Add(MemoryGovernor::Raw, dp->size);
+        dp->governed = true;
         local_buffer.push_back(dp);
         local_size += dp->size;
+        sched->reads++;
+        sched->bytes += dp->size;
+        double dt = std::max(1., (double)std::chrono::duration_cast<std::chrono::microseconds>(
+              now - sched->last_read).count());
+        sched->fill_rate += (dp->size/dt - sched->fill_rate)/8.;
+        sched->last_read = now;
+        sched->backoff_us = 0;
+        got_data = true;
         dp = nullptr;
+      } else {
+        Backoff(sched, now);
+        next_due = std::min(next_due, sched->next_poll);
       }
     } // for digi in digitizers
     if (local_buffer.size() > 0) {
-      const std::lock_guard<std::mutex> lg(fBufferMutex);
-      fBufferLength += local_buffer.size();
-      fBuffer.splice(fBuffer.end(), local_buffer); // clears local_buffer
-      fBufferSize += local_size;
-      fDataRate += local_size;
+      auto enqueue_start = std::chrono::steady_clock::now();
+      long enqueued = local_size;
+      if (fUseRing) {
+        int pushed = 0;
+        bool queued = false;
+        for (auto dp_ : local_buffer) {
+          while (!(queued = fRing->Push(dp_)) && fReadLoop) {
+            // consumers are behind and the ring is full. Wait for them
+            fRingFull++;
+            fDataCV.notify_all();
+            usleep(10);
+          }
+          if (queued) pushed++;
+          else { // we're stopping and nobody is taking data any more
+            local_size -= dp_->size;
+            delete dp_;
+          }
+        }
+        local_buffer.clear();
+        fBufferSize += local_size;
+        fBufferLength += pushed;
+        fDataRate += local_size;
+        if (fWaiting.load() > 0) {
+          // taking the lock means no consumer is between its check and its wait
+          { const std::lock_guard<std::mutex> lg(fWaitMutex); }
+          if (pushed > 1) fDataCV.notify_all();
+          else fDataCV.notify_one();
+        }
+      } else {
+        const std::lock_guard<std::mutex> lg(fBufferMutex);
+        fBufferLength += local_buffer.size();
+        fBuffer.splice(fBuffer.end(), local_buffer); // clears local_buffer
+        fBufferSize += local_size;
+        fDataRate += local_size;
+      }
+      Metrics::Record(Metrics::Enqueue, enqueue_start, enqueued);
       local_size = 0;
     }
     readcycler++;
-    usleep(1);
+    // if everyone was quiet, there's nothing to do until the first of them
+    // is due again
+    if (!got_data && fReadLoop) std::this_thread::sleep_until(next_due);
+    // and if the rest of the host can't keep up, leave the data in the boards
+    long throttle = MemoryGovernor::ThrottleUs();
+    if (throttle > 0 && fReadLoop) std::this_thread::sleep_for(std::chrono::microseconds(throttle));
   } // while run
-  fRunning[link] = false;
+  if (capture != nullptr) delete capture;
+  {
+    const std::lock_guard<std::mutex> lg(fStopMutex);
+    fRunning[link] = false;
+  }
+  fStopCV.notify_all();
   fLog->Entry(MongoLog::Local, "RO thread %i returning", link);
 }
 
-std::map<int, int> DAQController::GetDataPerChan(){
-  // Return a map of data transferred per channel since last update
-  // Clears the private maps in the StraxInserters
+void DAQController::Backoff(BoardSchedule *sched, std::chrono::steady_clock::time_point now){
+  sched->idle_polls++;
+  long backoff = sched->backoff_us.load();
+  backoff = backoff == 0 ? fMinBackoff : std::min(2*backoff, fMaxBackoff);
+  sched->backoff_us = backoff;
+  sched->next_poll = now + std::chrono::microseconds(backoff);
+  // it isn't filling up right now
+  sched->fill_rate /= 2;
+}
+
+std::map<int, std::map<std::string, double>> DAQController::GetReadoutStats(){
+  // Since the last call
+  const std::lock_guard<std::mutex> lg(fScheduleMutex);
+  std::map<int, std::map<std::string, double>> ret;
+  for (auto& p : fSchedule) {
+    BoardSchedule *sched = p.second;
+    long polls = sched->polls.exchange(0), idle = sched->idle_polls.exchange(0);
+    ret[p.first]["reads"] = sched->reads.exchange(0);
+    ret[p.first]["bytes"] = sched->bytes.exchange(0);
+    ret[p.first]["polls"] = polls;
+    ret[p.first]["idle_fraction"] = polls > 0 ? idle/(double)polls : 1.;
+    ret[p.first]["backoff_us"] = sched->backoff_us.load();
+  }
+  return ret;
+}
+
+void DAQController::GetChannelStats(std::map<int, ChannelStats>& channels,
+    std::map<int, long>& board_bytes){
+  // Resets the counters in the StraxInserters
   const std::lock_guard<std::mutex> lg(fPTmutex);
-  std::map <int, int> retmap;
   for (const auto& pt : fProcessingThreads)
-    pt.inserter->GetDataPerChan(retmap);
-  return retmap;
+    pt.inserter->GetChannelStats(channels, board_bytes);
 }
 
 long DAQController::GetStraxBufferSize() {
   const std::lock_guard<std::mutex> lg(fPTmutex);
-  return std::accumulate(fProcessingThreads.begin(), fProcessingThreads.end(), 0,
+  long writer = fWriter != nullptr ? fWriter->GetBufferSize() : 0;
+  return std::accumulate(fProcessingThreads.begin(), fProcessingThreads.end(), writer,
       [=](long tot, processingThread pt) {return tot + pt.inserter->GetBufferSize();});
 }
 
@@ -332,6 +646,21 @@ int DAQController::GetBufferLength() {
       [](int tot, auto pt){return tot + pt.inserter->GetBufferLength();});
 }
 
+std::map<int, std::map<std::string, long>> DAQController::GetBufferPoolStatus(){
+  const std::lock_guard<std::mutex> lg(fPoolMutex);
+  std::map<int, std::map<std::string, long>> ret;
+  for (auto& p : fBufferPools) {
+    ret[p.first] = {
+      {"in_use", p.second->InUse()},
+      {"total", p.second->Total()},
+      {"peak", p.second->PeakInUse()},
+      {"grown", p.second->Grown()},
+      {"oversize", p.second->Oversize()},
+      {"slab_bytes", (long)p.second->SlabSize()}};
+  }
+  return ret;
+}
+
 void DAQController::GetDataFormat(std::map<int, std::map<std::string, int>>& retmap){
   for( auto const& link : fDigitizers )
     for(auto digi : link.second)
@@ -342,11 +671,22 @@ int DAQController::GetData(std::list<data_packet*>* retQ, unsigned num){
   if (fBufferLength == 0) return 0;
   int ret = 0;
   data_packet* dp = nullptr;
+  if (num == 0) num = std::max(16, std::min(fMaxEventsPerThread, fBufferLength >> 4));
+  if (fUseRing) {
+    unsigned popped = 0;
+    while (popped < num && fRing->Pop(dp)) {
+      fBufferLength--;
+      fBufferSize -= dp->size;
+      ret += dp->size;
+      retQ->push_back(dp);
+      popped++;
+    }
+    return ret;
+  }
   const std::lock_guard<std::mutex> lg(fBufferMutex);
   if (fBuffer.size() == 0) {
     return 0;
   }
-  if (num == 0) num = std::max(16, std::min(fMaxEventsPerThread, fBufferLength >> 4));
   do {
     dp = fBuffer.front();
     fBuffer.pop_front();
@@ -360,6 +700,12 @@ int DAQController::GetData(std::list<data_packet*>* retQ, unsigned num){
 
 int DAQController::GetData(data_packet* &dp) {
   if (fBufferLength == 0) return 0;
+  if (fUseRing) {
+    if (!fRing->Pop(dp)) return 0;
+    fBufferSize -= dp->size;
+    fBufferLength--;
+    return 1;
+  }
   const std::lock_guard<std::mutex> lg(fBufferMutex);
   if (fBuffer.size() == 0) {
     return 0;
@@ -371,6 +717,27 @@ int DAQController::GetData(data_packet* &dp) {
   return 1;
 }
 
+void DAQController::WaitForData(std::chrono::microseconds timeout) {
+  // Block until the readout has pushed something. The timeout is just a
+  // safety net so consumers still notice when they're being shut down
+  std::unique_lock<std::mutex> lk(fWaitMutex);
+  fWaiting++;
+  fDataCV.wait_for(lk, timeout, [&]{return fBufferLength.load() > 0;});
+  fWaiting--;
+}
+
+void DAQController::ClearBuffer() {
+  data_packet *dp = nullptr;
+  if (fRing != nullptr) {
+    while (fRing->Pop(dp)) delete dp;
+  }
+  const std::lock_guard<std::mutex> lg(fBufferMutex);
+  std::for_each(fBuffer.begin(), fBuffer.end(), [](auto dp){delete dp;});
+  fBuffer.clear();
+  fBufferLength = 0;
+  fBufferSize = 0;
+}
+
 bool DAQController::CheckErrors(){
 
   // This checks for errors from the threads by checking the
@@ -389,17 +756,59 @@ bool DAQController::CheckErrors(){
   return false;
 }
 
+void DAQController::ResolveAffinity(std::vector<int>& links){
+  // Readout threads go on the cores next to their A3818, since that's the
+  // node the DMA lands on, and their buffer pools get faulted in from
+  // there. The inserters get whatever is left
+  fReadoutCPUs.clear();
+  fProcessingCPUs.clear();
+  std::string base = "readout_cpus." + fHostname;
+  std::string host_spec = fOptions->GetNestedString(base, "");
+  for (int link : links) {
+    std::string spec = fOptions->GetNestedString(base + "." + std::to_string(link), host_spec);
+    if (spec == "") continue;
+    std::vector<int> cpus = CPUAffinity::Resolve(spec);
+    if (cpus.size() == 0) {
+      fLog->Entry(MongoLog::Warning, "Couldn't make sense of readout cpus '%s' for link %i",
+          spec.c_str(), link);
+      continue;
+    }
+    fReadoutCPUs[link] = cpus;
+    fLog->Entry(MongoLog::Local, "Link %i reads out on cpus %s (node %i)", link,
+        CPUAffinity::Describe(cpus).c_str(), CPUAffinity::NodeOf(cpus));
+  }
+  std::string spec = fOptions->GetNestedString("processing_cpus." + fHostname, "");
+  if (spec != "") {
+    fProcessingCPUs = CPUAffinity::Resolve(spec);
+    if (fProcessingCPUs.size() == 0)
+      fLog->Entry(MongoLog::Warning, "Couldn't make sense of processing cpus '%s'",
+          spec.c_str());
+    else
+      fLog->Entry(MongoLog::Local, "Processing threads run on cpus %s (node %i)",
+          CPUAffinity::Describe(fProcessingCPUs).c_str(),
+          CPUAffinity::NodeOf(fProcessingCPUs));
+  }
+}
+
 int DAQController::OpenProcessingThreads(){
   int ret = 0;
   const std::lock_guard<std::mutex> lg(fPTmutex);
+  fWriter = new StraxWriter(fLog);
+  fWriter->Initialize(fOptions, fHostname);
   for(int i=0; i<fNProcessingThreads; i++){
     processingThread p;
     p.inserter = new StraxInserter();
-    if (p.inserter->Initialize(fOptions, fLog, this, fHostname)) {
+    if (p.inserter->Initialize(fOptions, fLog, this, fWriter, fHostname)) {
       p.pthread = new std::thread(); // something to delete later
       ret++;
-    } else
-      p.pthread = new std::thread(&StraxInserter::ReadAndInsertData, p.inserter);
+    } else {
+      p.pthread = new std::thread([p, i]{
+          Metrics::Register("inserter_" + std::to_string(i));
+          p.inserter->ReadAndInsertData();});
+      if (fProcessingCPUs.size() > 0 &&
+          CPUAffinity::Pin(p.pthread->native_handle(), fProcessingCPUs))
+        fLog->Entry(MongoLog::Warning, "Couldn't pin processing thread %i", i);
+    }
     fProcessingThreads.push_back(p);
   }
   return ret;
@@ -408,16 +817,53 @@ int DAQController::OpenProcessingThreads(){
 void DAQController::CloseProcessingThreads(){
   std::map<int,int> board_fails;
   const std::lock_guard<std::mutex> lg(fPTmutex);
-  for(unsigned int i=0; i<fProcessingThreads.size(); i++){
-    fProcessingThreads[i].inserter->Close(board_fails);
-    // two stage process so there's time to clear data
+  BeginStop();
+  // Readout is done by now. Every inserter works through what's left in the
+  // queue and then writes out its chunks, all of them at the same time
+  for (auto& p : fProcessingThreads) p.inserter->Close(board_fails);
+  fDataCV.notify_all();
+  int stragglers = 0;
+  for (auto& p : fProcessingThreads) {
+    if (!p.inserter->WaitForStop(fStopDeadline)) {
+      p.inserter->ForceQuit();
+      stragglers++;
+    }
   }
-  std::this_thread::sleep_for(std::chrono::milliseconds(10));
-  for(unsigned int i=0; i<fProcessingThreads.size(); i++){
-    delete fProcessingThreads[i].inserter;
-    fProcessingThreads[i].pthread->join();
-    delete fProcessingThreads[i].pthread;
+  if (stragglers > 0)
+    fLog->Entry(MongoLog::Warning, "%i processing threads still busy at the stop deadline, "
+        "%i packets not processed", stragglers, fBufferLength.load());
+  std::chrono::steady_clock::time_point drained, stopped;
+  for (auto& p : fProcessingThreads) {
+    if (p.pthread->joinable()) p.pthread->join();
+    delete p.pthread;
+    drained = std::max(drained, p.inserter->DrainedAt());
+    stopped = std::max(stopped, p.inserter->StoppedAt());
+    delete p.inserter;
+  }
+  auto since_start = [&](std::chrono::steady_clock::time_point t){
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t - fStopStart).count();};
+  if (fProcessingThreads.size() > 0 && stopped > fStopStart) {
+    fStopTimeline["drain"] = since_start(drained);
+    fStopTimeline["flush"] = since_start(stopped);
+  }
+  // inserters are gone so nothing else gets submitted
+  if (fWriter != nullptr) {
+    fWriter->Close();
+    delete fWriter;
+    fWriter = nullptr;
+  }
+  if (fProcessingThreads.size() > 0) {
+    std::stringstream msg;
+    msg << "Stop took " << since_start(std::chrono::steady_clock::now()) << " ms";
+    std::string sep = ", done at: ";
+    for (auto stage : {"readout", "boards", "drain", "flush"}) {
+      if (fStopTimeline.count(stage) == 0) continue;
+      msg << sep << stage << " " << fStopTimeline[stage];
+      sep = ", ";
+    }
+    fLog->Entry(MongoLog::Local, msg.str());
   }
+  fStopStart = std::chrono::steady_clock::time_point();
 
   fProcessingThreads.clear();
   if (std::accumulate(board_fails.begin(), board_fails.end(), 0,
@@ -429,13 +875,84 @@ void DAQController::CloseProcessingThreads(){
   }
 }
 
+std::string DAQController::BaselineKey(){
+  return fOptions->GetString("baseline_dac_mode", "fixed") + ":" +
+    std::to_string(fOptions->GetInt("baseline_value", 16000));
+}
+
+std::string DAQController::MustReset(const BoardType& d){
+  // Anything a reset would have put back, or that needs a reset board to
+  // be done right, sends it the long way
+  if (fApplied.count(d.board) == 0 || !fApplied[d.board].valid) return "not programmed last run";
+  const AppliedConfig& last = fApplied[d.board];
+  if (last.link != d.link || last.crate != d.crate || last.vme_address != d.vme_address ||
+      last.type != d.type)
+    return "moved";
+  std::vector<std::pair<u_int32_t, u_int32_t>> regs;
+  std::set<u_int32_t> now;
+  for (auto regi : fOptions->GetRegisters(d.board)) {
+    regs.emplace_back(DAXHelpers::StringToHex(regi.reg), DAXHelpers::StringToHex(regi.val));
+    now.insert(regs.back().first);
+  }
+  // a register we don't write any more would keep last run's value
+  for (auto& r : last.registers)
+    if (now.count(r.first) == 0) return "register removed";
+  if (last.channels != fOptions->GetChannels(d.board)) return "channel map changed";
+  std::string mode = fOptions->GetString("baseline_dac_mode", "fixed");
+  if (mode == "fit" || mode == "hybrid") {
+    // the fit has to start from the board's defaults, not last run's settings
+    if (last.baseline_mode != BaselineKey() || last.registers != regs || last.dac.size() == 0)
+      return "baselines need a fit";
+    if (last.runs_since_fit >= fOptions->GetInt("rearm_baseline_max_runs", 10))
+      return "baselines are due for a fit";
+  }
+  return "";
+}
+
 void DAQController::InitLink(std::vector<V1724*>& digis,
     std::map<int, std::map<std::string, std::vector<double>>>& cal_values, int& ret) {
   std::string BL_MODE = fOptions->GetString("baseline_dac_mode", "fixed");
   std::map<int, std::vector<u_int16_t>> dac_values;
   int nominal_baseline = fOptions->GetInt("baseline_value", 16000);
-  if (BL_MODE == "fit") {
-    if ((ret = FitBaselines(digis, dac_values, nominal_baseline, cal_values))) {
+  std::string baseline_key = BaselineKey();
+
+  // What was last written to the boards kept from the last run. MustReset
+  // already made sure these don't need a fit, which only ever runs on a
+  // freshly reset board, so they keep their DAC values
+  std::map<int, AppliedConfig> applied;
+  std::map<int, std::vector<std::pair<u_int32_t, u_int32_t>>> registers;
+  std::vector<V1724*> to_fit;
+  std::set<int> fitted;
+  for (auto digi : digis) {
+    int bid = digi->bid();
+    for(auto regi : fOptions->GetRegisters(bid))
+      registers[bid].emplace_back(DAXHelpers::StringToHex(regi.reg),
+          DAXHelpers::StringToHex(regi.val));
+    {
+      const std::lock_guard<std::mutex> lg(fAppliedMutex);
+      AppliedConfig& a = fApplied[bid];
+      if (fReused.count(bid) && a.valid) applied[bid] = a;
+      // not valid until it's been programmed
+      a.valid = false;
+    }
+    if (applied.count(bid)) continue;
+    to_fit.push_back(digi);
+    fitted.insert(bid);
+  }
+  if ((BL_MODE == "fit" || BL_MODE == "hybrid") && to_fit.size() > 0) {
+    // The fit reads into slabs of its own. Whoever touches a page first
+    // decides which NUMA node it's on, and for the link's pool that has to
+    // be the readout thread, not this one
+    BufferPool *fit_pool = new BufferPool(fOptions->GetInt("blt_pool_slab_size", 0x400000), 0);
+    std::map<V1724*, BufferPool*> link_pools;
+    for (auto digi : to_fit) {
+      link_pools[digi] = digi->GetBufferPool();
+      digi->SetBufferPool(fit_pool);
+    }
+    ret = FitBaselines(to_fit, dac_values, nominal_baseline, cal_values, BL_MODE == "hybrid");
+    for (auto digi : to_fit) digi->SetBufferPool(link_pools[digi]);
+    fit_pool->Retire();
+    if (ret) {
       fLog->Entry(MongoLog::Warning, "Errors during baseline fitting");
       return;
     }
@@ -446,7 +963,12 @@ void DAQController::InitLink(std::vector<V1724*>& digis,
 
     // Multiple options here
     int bid = digi->bid(), success(0);
-    if(BL_MODE == "cached") {
+    bool kept = applied.count(bid) != 0;
+    if (kept && fitted.count(bid) == 0 && (BL_MODE == "fit" || BL_MODE == "hybrid")) {
+      fLog->Entry(MongoLog::Local, "Board %i keeps its baselines from the last run", bid);
+      dac_values[bid] = applied[bid].dac;
+    }
+    else if(BL_MODE == "cached") {
       fMapMutex.lock();
       auto board_dac_cal = cal_values.count(bid) ? cal_values[bid] : cal_values[-1];
       fMapMutex.unlock();
@@ -456,7 +978,7 @@ void DAQController::InitLink(std::vector<V1724*>& digis,
 	dac_values[bid][ch] = nominal_baseline*board_dac_cal["slope"][ch] + board_dac_cal["yint"][ch];
       digi->ClampDACValues(dac_values[bid], board_dac_cal);
     }
-    else if(BL_MODE != "fixed" && BL_MODE != "fit"){
+    else if(BL_MODE != "fixed" && BL_MODE != "fit" && BL_MODE != "hybrid"){
       fLog->Entry(MongoLog::Warning, "Received unknown baseline mode '%s', fallback to fixed", BL_MODE.c_str());
       BL_MODE = "fixed";
     }
@@ -482,17 +1004,34 @@ void DAQController::InitLink(std::vector<V1724*>& digis,
     fLog->Entry(MongoLog::Local, "Board %i survived baseline mode. Going into register setting",
 		bid);
 
-    for(auto regi : fOptions->GetRegisters(bid)){
-      unsigned int reg = DAXHelpers::StringToHex(regi.reg);
-      unsigned int val = DAXHelpers::StringToHex(regi.val);
-      success+=digi->WriteRegister(reg, val);
+    std::vector<std::pair<u_int32_t, u_int32_t>>& regs = registers[bid];
+    std::vector<u_int16_t> thresholds = fOptions->GetThresholds(bid);
+    if (!kept) {
+      success += digi->WriteRegisters(regs);
+      fLog->Entry(MongoLog::Local, "Board %i loaded user registers, loading DAC.", bid);
+
+      // Load the baselines you just configured
+      success += digi->LoadDAC(dac_values[bid]);
+      // Load all the other fancy stuff
+      success += digi->SetThresholds(thresholds);
+    } else {
+      // The board still has everything from last time, so only what's
+      // different goes out. MustReset made sure no register was dropped
+      AppliedConfig& last = applied[bid];
+      std::map<u_int32_t, u_int32_t> before;
+      for (auto& r : last.registers) before[r.first] = r.second;
+      std::vector<std::pair<u_int32_t, u_int32_t>> changed;
+      for (auto& r : regs)
+        if (before.count(r.first) == 0 || before[r.first] != r.second) changed.push_back(r);
+      success += digi->WriteRegisters(changed);
+      bool load_dac = last.dac != dac_values[bid];
+      if (load_dac) success += digi->LoadDAC(dac_values[bid]);
+      bool load_thresholds = last.thresholds != thresholds;
+      if (load_thresholds) success += digi->SetThresholds(thresholds);
+      fLog->Entry(MongoLog::Local, "Board %i re-armed: %i of %i registers written, DAC %s, "
+          "thresholds %s", bid, int(changed.size()), int(regs.size()),
+          load_dac ? "loaded" : "unchanged", load_thresholds ? "loaded" : "unchanged");
     }
-    fLog->Entry(MongoLog::Local, "Board %i loaded user registers, loading DAC.", bid);
-
-    // Load the baselines you just configured
-    success += digi->LoadDAC(dac_values[bid]);
-    // Load all the other fancy stuff
-    success += digi->SetThresholds(fOptions->GetThresholds(bid));
 
     fLog->Entry(MongoLog::Local,
 	"Board %i programmed", digi->bid());
@@ -502,20 +1041,160 @@ void DAQController::InitLink(std::vector<V1724*>& digis,
       ret = -1;
       return;
     }
+    {
+      const std::lock_guard<std::mutex> lg(fAppliedMutex);
+      AppliedConfig& a = fApplied[bid];
+      a.registers = regs;
+      a.dac = dac_values[bid];
+      a.thresholds = thresholds;
+      a.channels = fOptions->GetChannels(bid);
+      a.baseline_mode = baseline_key;
+      a.runs_since_fit = kept && fitted.count(bid) == 0 ? applied[bid].runs_since_fit + 1 : 0;
+      a.valid = true;
+    }
   } // loop over digis per link
 
   ret = 0;
   return;
 }
 
+namespace {
+class SampleHistogram{
+  /*
+    Histogram of the 14-bit samples in a channel. Consecutive samples go
+    into different sub-histograms, so increments of the same bin don't have
+    to wait on each other, and these get summed afterwards. Only the range
+    of bins that actually got filled is ever summed or cleared.
+  */
+public:
+  SampleHistogram(int rebin_factor) : fRebin(rebin_factor),
+    fSub(4*0x4000, 0), fBins(0x4000, 0), fLowest(0x4000), fHighest(-1) {}
+
+  void Fill(const u_int32_t *words, unsigned n){
+    int *h0 = fSub.data(), *h1 = h0+0x4000, *h2 = h1+0x4000, *h3 = h2+0x4000;
+    int lo = fLowest, hi = fHighest;
+    for (unsigned w = 0; w < n; w++) {
+      u_int32_t val0 = words[w]&0x3FFF, val1 = (words[w]>>16)&0x3FFF;
+      if (val0 == 0 || val1 == 0) continue;
+      int b0 = val0 >> fRebin, b1 = val1 >> fRebin;
+      if (w&1) {h2[b0]++; h3[b1]++;}
+      else {h0[b0]++; h1[b1]++;}
+      lo = std::min(lo, std::min(b0, b1));
+      hi = std::max(hi, std::max(b0, b1));
+    }
+    fLowest = lo;
+    fHighest = hi;
+    for (int b = fLowest; b <= fHighest; b++)
+      fBins[b] = h0[b] + h1[b] + h2[b] + h3[b];
+  }
+
+  void Clear(){
+    for (int b = fLowest; b <= fHighest; b++)
+      fBins[b] = fSub[b] = fSub[b+0x4000] = fSub[b+0x8000] = fSub[b+0xC000] = 0;
+    fLowest = 0x4000;
+    fHighest = -1;
+  }
+
+  bool Empty() {return fHighest < fLowest;}
+  int* Bins() {return fBins.data();}
+  int* First() {return fBins.data() + fLowest;}
+  int* Last() {return fBins.data() + fHighest + 1;}
+
+private:
+  int fRebin;
+  std::vector<int> fSub, fBins;
+  int fLowest, fHighest;
+};
+} // namespace
+
+bool DAQController::AnalyzeBaselines(V1724 *d, u_int32_t *buff, int bytes, unsigned step,
+    std::vector<std::vector<double>>& bl_per_channel, int rebin_factor, int bins_around_max,
+    double fraction_around_max) {
+  // Finds the baseline of every channel in one board's readout. Returns true
+  // if the data wasn't good enough and the step has to be repeated
+  bool redo_iter = false;
+  int bid = d->bid();
+  int channel_header_words = d->DataFormatDefinition["channel_header_words"];
+  bool mask_msb = d->DataFormatDefinition["channel_mask_msb_idx"] != -1;
+  u_int32_t words_in_event, channel_mask, words_per_channel;
+  u_int32_t idx = 0, total_words = bytes/sizeof(u_int32_t);
+  int channels_in_event, counts_total, counts_around_max;
+  double baseline;
+  int *bins, *first, *last, *max_it, *max_start, *max_end;
+  SampleHistogram hist(rebin_factor);
+
+  while (idx < total_words) {
+    if ((buff[idx]>>28) == 0xA) {
+      words_in_event = buff[idx]&0xFFFFFFF;
+      if (words_in_event == 4) {
+        idx += 4;
+        continue;
+      }
+      channel_mask = buff[idx+1]&0xFF;
+      if (mask_msb) {
+        channel_mask = ( ((buff[idx+2]>>24)&0xFF)<<8 ) | (buff[idx+1]&0xFF);
+      }
+      if (channel_mask == 0) { // should be impossible?
+        idx += 4;
+        continue;
+      }
+      channels_in_event = std::bitset<16>(channel_mask).count();
+      words_per_channel = (words_in_event - 4)/channels_in_event;
+      words_per_channel -= channel_header_words;
+
+      idx += 4;
+      for (unsigned ch = 0; ch < d->GetNumChannels(); ch++) {
+        if (!(channel_mask & (1 << ch))) continue;
+        idx += channel_header_words;
+        hist.Fill(buff+idx, std::min(words_per_channel, total_words-std::min(idx, total_words)));
+        idx += words_per_channel;
+        if (hist.Empty()) {
+          redo_iter = true;
+          continue;
+        }
+        bins = hist.Bins();
+        first = hist.First();
+        last = hist.Last();
+        max_it = std::max_element(first, last);
+        max_start = std::max(max_it - bins_around_max, first);
+        max_end = std::min(max_it + bins_around_max+1, last);
+        counts_total = std::accumulate(first, last, 0);
+        counts_around_max = std::accumulate(max_start, max_end, 0);
+        if (counts_around_max < fraction_around_max*counts_total) {
+          fLog->Entry(MongoLog::Local,
+              "Bd %i ch %i: %i out of %i counts around max %i",
+              bid, ch, counts_around_max, counts_total,
+              int(max_it - bins)<<rebin_factor);
+          redo_iter = true;
+        }
+        if (counts_total/words_per_channel < 1.5) //25% zeros
+          redo_iter = true;
+        baseline = 0;
+        // calculated weighted average
+        for (auto it = max_start; it < max_end; it++)
+          baseline += (int(it - bins)<<rebin_factor)*(*it);
+        baseline /= counts_around_max;
+        bl_per_channel[ch][step] = baseline;
+        hist.Clear();
+      } // for each channel
+
+    } else { // if header
+      idx = FindHeader(buff, idx+1, total_words);
+    }
+  } // end of while in buffer
+  return redo_iter;
+}
+
 int DAQController::FitBaselines(std::vector<V1724*> &digis,
     std::map<int, std::vector<u_int16_t>> &dac_values, int target_baseline,
-    std::map<int, std::map<std::string, std::vector<double>>> &cal_values) {
+    std::map<int, std::map<std::string, std::vector<double>>> &cal_values, bool warm_start) {
   using std::vector;
+  using namespace std::chrono;
   using namespace std::chrono_literals;
   int max_iter = fOptions->GetInt("baseline_max_iterations", 2);
   unsigned ch_this_digi(0), max_steps = fOptions->GetInt("baseline_max_steps", 20);
   int adjustment_threshold = fOptions->GetInt("baseline_adjustment_threshold", 10);
+  int drift_threshold = fOptions->GetInt("baseline_drift_threshold", 250);
   int convergence_threshold = fOptions->GetInt("baseline_convergence_threshold", 3);
   int min_adjustment = fOptions->GetInt("baseline_min_adjustment", 0xA);
   int rebin_factor = fOptions->GetInt("baseline_rebin_log2", 1); // log base 2
@@ -524,13 +1203,19 @@ int DAQController::FitBaselines(std::vector<V1724*> &digis,
   int steps_repeated(0), max_repeated_steps(10);
   int triggers_per_step = fOptions->GetInt("baseline_triggers_per_step", 3);
   std::chrono::milliseconds ms_between_triggers(fOptions->GetInt("baseline_ms_between_triggers", 10));
-  std::array<int, 0x4000> hist;
   vector<long> DAC_cal_points = {60000, 30000, 6000}; // arithmetic overflow
   std::map<int, vector<int>> channel_finished;
   std::map<int, u_int32_t*> buffers;
+  std::map<int, BufferSlab*> slabs;
+  // nulled once they're back, so no way out of here can give one back twice
+  auto release_slabs = [&]{
+    for (auto& p : slabs) if (p.second != nullptr) p.second->Release();
+    for (auto& p : slabs) p.second = nullptr;
+  };
   std::map<int, int> bytes_read;
   std::map<int, vector<vector<double>>> bl_per_channel;
   std::map<int, vector<int>> diff;
+  std::map<int, vector<char>> recalibrate; // which channels go through the DAC_cal_points
 
   for (auto digi : digis) { // alloc ALL the things!
     bid = digi->bid();
@@ -539,17 +1224,29 @@ int DAQController::FitBaselines(std::vector<V1724*> &digis,
     channel_finished[bid] = vector<int>(ch_this_digi, 0);
     bl_per_channel[bid] = vector<vector<double>>(ch_this_digi, vector<double>(max_steps,0));
     diff[bid] = vector<int>(ch_this_digi, 0);
+    recalibrate[bid] = vector<char>(ch_this_digi, !warm_start);
   }
 
-  bool done(false), redo_iter(false), fail(false), calibrate(true);
-  int counts_total(0), counts_around_max(0);
-  double B,C,D,E,F, slope, yint, baseline;
+  bool done(false), redo_iter(false), fail(false), calibrate(!warm_start), checked(!warm_start);
+  if (warm_start) {
+    // Start from wherever the last calibration says the target is. The first
+    // measurement then decides which channels still need the full treatment
+    for (auto d : digis) {
+      bid = d->bid();
+      fMapMutex.lock();
+      if (cal_values.count(bid) == 0) cal_values[bid] = cal_values[-1];
+      auto& cal = cal_values[bid];
+      fMapMutex.unlock();
+      for (unsigned ch = 0; ch < d->GetNumChannels(); ch++)
+        dac_values[bid][ch] = std::clamp((target_baseline-cal["yint"][ch])/cal["slope"][ch],
+            0., double(0xffff));
+      d->ClampDACValues(dac_values[bid], cal);
+    }
+  }
+  double B,C,D,E,F, slope, yint;
   double fraction_around_max = fOptions->GetDouble("baseline_fraction_around_max", 0.8);
-  u_int32_t words_in_event, channel_mask, words_per_channel, idx;
-  u_int16_t val0, val1;
-  int channels_in_event;
-  auto hist_start = hist.begin(), hist_end = hist.end();
-  auto max_it = hist.begin(), max_start = hist.begin(), max_end = hist.begin();
+  system_clock::time_point step_start, dac_end, trigger_start, readout_start;
+  system_clock::time_point analysis_start, analysis_end;
 
   for (int iter = 0; iter < max_iter; iter++) {
     if (done || fail) break;
@@ -560,7 +1257,9 @@ int DAQController::FitBaselines(std::vector<V1724*> &digis,
     steps_repeated = 0;
     fLog->Entry(MongoLog::Local, "Beginning baseline iteration %i/%i", iter, max_iter);
 
-    for (unsigned step = 0; step < max_steps; step++) {
+    bool restart(false);
+    for (unsigned step = 0; step < max_steps; step = restart ? 0 : step+1) {
+      restart = false;
       fLog->Entry(MongoLog::Local, "Beginning baseline step %i/%i", step, max_steps);
       if (std::all_of(channel_finished.begin(), channel_finished.end(),
             [&](auto& p) {
@@ -578,18 +1277,22 @@ int DAQController::FitBaselines(std::vector<V1724*> &digis,
       if (step < DAC_cal_points.size()) {
         if (!calibrate) continue;
         for (auto d : digis)
-          dac_values[d->bid()].assign(d->GetNumChannels(), (int)DAC_cal_points[step]);
+          for (unsigned ch = 0; ch < d->GetNumChannels(); ch++)
+            if (recalibrate[d->bid()][ch]) dac_values[d->bid()][ch] = DAC_cal_points[step];
       }
+      step_start = system_clock::now();
       for (auto d : digis) {
         if (d->LoadDAC(dac_values[d->bid()])) {
           fLog->Entry(MongoLog::Warning, "Board %i failed to load DAC", d->bid());
           return -2;
         }
       }
+      dac_end = system_clock::now();
       // "After writing, the user is recommended to wait for a few seconds before
       // a new RUN to let the DAC output get stabilized" - CAEN documentation
       std::this_thread::sleep_for(1s);
       // sleep(2) seems unnecessary after preliminary testing
+      trigger_start = system_clock::now();
 
       // start board
       for (auto d : digis) {
@@ -626,8 +1329,9 @@ int DAQController::FitBaselines(std::vector<V1724*> &digis,
       std::this_thread::sleep_for(1ms);
 
       // readout
+      readout_start = system_clock::now();
       for (auto d : digis) {
-        bytes_read[d->bid()] = d->ReadMBLT(buffers[d->bid()]);
+        bytes_read[d->bid()] = d->ReadMBLT(buffers[d->bid()], slabs[d->bid()]);
       }
 
       // decode
@@ -638,7 +1342,7 @@ int DAQController::FitBaselines(std::vector<V1724*> &digis,
             fLog->Entry(MongoLog::Error, "Board %i has readout error in baselines",
                 d->bid());
         }
-        std::for_each(buffers.begin(), buffers.end(), [](auto p){delete[] p.second;});
+        release_slabs();
         return -2;
       }
       if (std::any_of(bytes_read.begin(), bytes_read.end(), [=](auto p) {
@@ -648,76 +1352,37 @@ int DAQController::FitBaselines(std::vector<V1724*> &digis,
               p.first, p.second);
         step--;
         steps_repeated++;
-        for (auto p : buffers)
-            if (bytes_read[p.first] > 0) delete[] p.second;
+        release_slabs();
         continue;
       }
 
-      // analyze
-      for (auto d : digis) {
-        bid = d->bid();
-        idx = 0;
-        while (((int)idx * sizeof(u_int32_t) < bytes_read[bid])) {
-          if ((buffers[bid][idx]>>28) == 0xA) {
-            words_in_event = buffers[bid][idx]&0xFFFFFFF;
-            if (words_in_event == 4) {
-              idx += 4;
-              continue;
-            }
-            channel_mask = buffers[bid][idx+1]&0xFF;
-            if (d->DataFormatDefinition["channel_mask_msb_idx"] != -1) {
-              channel_mask = ( ((buffers[bid][idx+2]>>24)&0xFF)<<8 ) | (buffers[bid][idx+1]&0xFF); 
-            }
-            if (channel_mask == 0) { // should be impossible?
-              idx += 4;
-              continue;
-            }
-            channels_in_event = std::bitset<16>(channel_mask).count();
-            words_per_channel = (words_in_event - 4)/channels_in_event;
-            words_per_channel -= d->DataFormatDefinition["channel_header_words"];
-
-            idx += 4;
-            for (unsigned ch = 0; ch < d->GetNumChannels(); ch++) {
-              if (!(channel_mask & (1 << ch))) continue;
-              idx += d->DataFormatDefinition["channel_header_words"];
-              hist.fill(0);
-              for (unsigned w = 0; w < words_per_channel; w++) {
-                val0 = buffers[bid][idx+w]&0xFFFF;
-                val1 = (buffers[bid][idx+w]>>16)&0xFFFF;
-                if (val0*val1 == 0) continue;
-                hist[val0 >> rebin_factor]++;
-                hist[val1 >> rebin_factor]++;
-              }
-              idx += words_per_channel;
-              max_it = std::max_element(hist_start, hist_end);
-              max_start = std::max(max_it - bins_around_max, hist_start);
-              max_end = std::min(max_it + bins_around_max+1, hist_end);
-              counts_total = std::accumulate(hist_start, hist_end, 0);
-              counts_around_max = std::accumulate(max_start, max_end, 0);
-              if (counts_around_max < fraction_around_max*counts_total) {
-                fLog->Entry(MongoLog::Local,
-                    "Bd %i ch %i: %i out of %i counts around max %i",
-                    bid, ch, counts_around_max, counts_total,
-                    std::distance(max_it, hist_start)<<rebin_factor);
-                redo_iter = true;
-              }
-              if (counts_total/words_per_channel < 1.5) //25% zeros
-                redo_iter = true;
-              baseline = 0;
-              // calculated weighted average
-              for (auto it = max_start; it < max_end; it++)
-                baseline += (std::distance(it, hist_start)<<rebin_factor)*(*it);
-              baseline /= counts_around_max;
-              bl_per_channel[bid][ch][step] = baseline;
-            } // for each channel
-
-          } else { // if header
-            idx++;
-          }
-        } // end of while in buffer
-      } // process per digi
+      // analyze, each board on its own thread
+      analysis_start = system_clock::now();
+      std::vector<std::thread> analysis;
+      std::vector<char> board_redo(digis.size(), 0);
+      for (unsigned i = 0; i < digis.size(); i++) {
+        // look everything up here, the maps aren't safe to touch from the threads
+        int b = digis[i]->bid();
+        u_int32_t *buff = buffers[b];
+        int bytes = bytes_read[b];
+        vector<vector<double>> *bl = &bl_per_channel[b];
+        analysis.emplace_back([&, i, buff, bytes, bl]{
+          board_redo[i] = AnalyzeBaselines(digis[i], buff, bytes, step, *bl,
+              rebin_factor, bins_around_max, fraction_around_max);
+        });
+      }
+      for (auto& t : analysis) t.join();
+      redo_iter = std::any_of(board_redo.begin(), board_redo.end(), [](char r){return r;});
+      analysis_end = system_clock::now();
+      fLog->Entry(MongoLog::Local,
+          "Baseline step %i took %i/%i/%i/%i/%i ms (DAC/settle/trigger/readout/analysis)",
+          step, duration_cast<milliseconds>(dac_end-step_start).count(),
+          duration_cast<milliseconds>(trigger_start-dac_end).count(),
+          duration_cast<milliseconds>(readout_start-trigger_start).count(),
+          duration_cast<milliseconds>(analysis_start-readout_start).count(),
+          duration_cast<milliseconds>(analysis_end-analysis_start).count());
       // cleanup buffers
-      for (auto p : buffers) delete[] p.second;
+      release_slabs();
       if (redo_iter) {
         redo_iter = false;
         step--;
@@ -733,11 +1398,13 @@ int DAQController::FitBaselines(std::vector<V1724*> &digis,
         //for (unsigned d = 0; d < digis_this_link; d++) {
           bid = d->bid();
           fMapMutex.lock();
-          cal_values[bid] = std::map<std::string, vector<double>>(
-              {{"slope", vector<double>(d->GetNumChannels())},
-               {"yint", vector<double>(d->GetNumChannels())}});
+          if (!warm_start)
+            cal_values[bid] = std::map<std::string, vector<double>>(
+                {{"slope", vector<double>(d->GetNumChannels())},
+                 {"yint", vector<double>(d->GetNumChannels())}});
           fMapMutex.unlock();
           for (unsigned ch = 0; ch < d->GetNumChannels(); ch++) {
+            if (!recalibrate[bid][ch]) continue;
             B = C = D = E = F = 0;
             for (unsigned i = 0; i < DAC_cal_points.size(); i++) {
               B += DAC_cal_points[i]*DAC_cal_points[i];
@@ -753,6 +1420,34 @@ int DAQController::FitBaselines(std::vector<V1724*> &digis,
         }
         calibrate = false;
       } else {
+        if (!checked) {
+          // First look at the warm start. Channels already on target are done,
+          // ones that are way off get recalibrated, the rest just get fit
+          checked = true;
+          int n_recal = 0;
+          for (auto d : digis) {
+            bid = d->bid();
+            int good = 0, recal = 0;
+            for (unsigned ch = 0; ch < d->GetNumChannels(); ch++) {
+              float off_by = target_baseline - bl_per_channel[bid][ch][step];
+              if (abs(off_by) < adjustment_threshold) {
+                channel_finished[bid][ch] = convergence_threshold;
+                good++;
+              } else if (abs(off_by) > drift_threshold) {
+                recalibrate[bid][ch] = 1;
+                recal++;
+              }
+            }
+            fLog->Entry(MongoLog::Local, "Board %i: %i channels on target, %i to recalibrate",
+                bid, good, recal);
+            n_recal += recal;
+          }
+          if (n_recal > 0) {
+            calibrate = true;
+            restart = true; // back to the first calibration point
+            continue;
+          }
+        }
         // ******************
         // Do fitting process
         // ******************
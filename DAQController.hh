@@ -2,26 +2,63 @@
 #define _DAQCONTROLLER_HH_
 
 #include <thread>
+#include <chrono>
 #include <atomic>
 #include <string>
 #include <map>
 #include <vector>
 #include <cstdint>
 #include <mutex>
+#include <condition_variable>
 #include <list>
+#include <set>
+#include "RingBuffer.hh"
+#include "DataSource.hh"
 
 class StraxInserter;
+class StraxWriter;
 class MongoLog;
 class Options;
 class V1724;
 class data_packet;
+struct ChannelStats;
+struct BoardType;
+class BufferPool;
 
 struct processingThread{
   std::thread *pthread;
   StraxInserter *inserter;
 };
 
-class DAQController{
+struct AppliedConfig{
+  /*
+    What was last written to a board, so a hot re-arm only has to write what
+    changed. Only valid once the board was programmed successfully
+  */
+  bool valid = false;
+  int link = -1, crate = -1;
+  unsigned int vme_address = 0;
+  std::string type;
+  std::vector<std::pair<u_int32_t, u_int32_t>> registers;
+  std::vector<u_int16_t> dac, thresholds;
+  std::vector<int16_t> channels;
+  std::string baseline_mode; // where the DAC values came from
+  int runs_since_fit = 0; // DACs drift, so a kept fit only lasts so long
+};
+
+struct BoardSchedule{
+  /*
+    When the readout should next look at a board, and what it found so far.
+    The timing is only touched by the link's readout thread, the counters
+    are reset whenever they're reported
+  */
+  std::chrono::steady_clock::time_point next_poll, last_read;
+  double fill_rate; // bytes per us, running average
+  std::atomic_long backoff_us;
+  std::atomic_long reads, bytes, polls, idle_polls;
+};
+
+class DAQController : public DataSource{
   /*
     Main control interface for the DAQ. Control scripts and
     user-facing interfaces can call this directly.
@@ -44,9 +81,11 @@ public:
 
   int GetData(std::list<data_packet*>* retQ, unsigned num = 0);
   int GetData(data_packet* &dp);
+  void WaitForData(std::chrono::microseconds timeout);
 
   int GetDataSize(){int ds = fDataRate; fDataRate=0; return ds;}
-  std::map<int, int> GetDataPerChan();
+  // What the processing saw per channel and per board since the last call
+  void GetChannelStats(std::map<int, ChannelStats>& channels, std::map<int, long>& board_bytes);
   bool CheckErrors();
   void CheckError(int bid) {fCheckFails[bid] = true;}
   int OpenProcessingThreads();
@@ -55,22 +94,68 @@ public:
   int GetBufferSize() {return fBufferSize.load();}
 
   void GetDataFormat(std::map<int, std::map<std::string, int>>&);
+  std::map<int, std::map<std::string, long>> GetBufferPoolStatus();
+  std::map<int, std::map<std::string, double>> GetReadoutStats();
 
 private:
 
   void InitLink(std::vector<V1724*>&, std::map<int, std::map<std::string, std::vector<double>>>&, int&);
+  // Why a board kept from the last run has to be reset after all, empty if
+  // it can be re-armed as it is
+  std::string MustReset(const BoardType& d);
+  std::string BaselineKey();
   int FitBaselines(std::vector<V1724*>&, std::map<int, std::vector<u_int16_t>>&, int,
-      std::map<int, std::map<std::string, std::vector<double>>>&);
+      std::map<int, std::map<std::string, std::vector<double>>>&, bool warm_start=false);
+  bool AnalyzeBaselines(V1724*, u_int32_t*, int, unsigned, std::vector<std::vector<double>>&,
+      int, int, double);
 
   std::vector <processingThread> fProcessingThreads;
+  StraxWriter *fWriter;
   std::map<int, std::vector <V1724*>> fDigitizers;
+  // Hot re-arm (rearm_hot): boards kept open between runs by bid, and the
+  // ones picked back up for this run
+  std::map<int, V1724*> fParked;
+  std::map<int, AppliedConfig> fApplied;
+  std::set<int> fReused;
+  std::mutex fAppliedMutex;
+  std::map<int, BufferPool*> fBufferPools;
+  // Cores to pin each link's readout thread and the inserters to. Empty
+  // means leave it to the scheduler
+  std::map<int, std::vector<int>> fReadoutCPUs;
+  std::vector<int> fProcessingCPUs;
+  void ResolveAffinity(std::vector<int>& links);
+
+  // Per board, by bid
+  std::map<int, BoardSchedule*> fSchedule;
+  std::mutex fScheduleMutex;
+  void Backoff(BoardSchedule*, std::chrono::steady_clock::time_point);
+  bool fPollStatus;
+  std::string fCapturePath; // empty unless capture_file is set
+  long fMinBackoff, fMaxBackoff; // us
+  std::mutex fPoolMutex;
+  void ClearBuffer();
+
   std::list<data_packet*> fBuffer;
   std::mutex fBufferMutex;
+  // Used instead of fBuffer if buffer_type is 'ring'
+  RingBuffer<data_packet*> *fRing;
+  bool fUseRing;
+  std::mutex fWaitMutex;
+  std::condition_variable fDataCV;
+  std::atomic_int fWaiting;
+  std::atomic_long fRingFull;
   std::mutex fMapMutex;
   std::mutex fPTmutex;
 
   std::atomic_bool fReadLoop;
   std::map<int, std::atomic_bool> fRunning;
+  // One deadline for the whole stop, from readout to the last file. The
+  // timeline is ms since the stop began, logged once it's over
+  void BeginStop();
+  std::mutex fStopMutex;
+  std::condition_variable fStopCV;
+  std::chrono::steady_clock::time_point fStopStart, fStopDeadline;
+  std::map<std::string, long> fStopTimeline;
   int fStatus;
   int fNProcessingThreads;
   std::string fHostname;
@@ -0,0 +1,30 @@
+#ifndef _DATASOURCE_HH_
+#define _DATASOURCE_HH_
+
+#include <list>
+#include <map>
+#include <string>
+#include <chrono>
+
+struct data_packet;
+
+class DataSource{
+  /*
+    Where the processing threads get their data from. Normally that's the
+    DAQController, handing out what the readout threads put in its buffer,
+    but the benchmark replays a capture file through the same interface.
+  */
+
+public:
+  virtual ~DataSource() {}
+
+  // Both return how many bytes they handed out
+  virtual int GetData(std::list<data_packet*>* retQ, unsigned num = 0) = 0;
+  virtual int GetData(data_packet* &dp) = 0;
+  virtual void WaitForData(std::chrono::microseconds timeout) = 0;
+  // A processing thread found something wrong in this board's data
+  virtual void CheckError(int bid) = 0;
+  virtual void GetDataFormat(std::map<int, std::map<std::string, int>>&) = 0;
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include "HeaderScan.hh"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEADERSCAN_X86
+#endif
+
+static u_int32_t FindHeaderScalar(const u_int32_t *buff, u_int32_t start, u_int32_t end){
+  u_int32_t idx = start;
+  while (idx < end && (buff[idx]>>28) != 0xA) idx++;
+  return idx;
+}
+
+static u_int32_t FindExcursionScalar(const u_int16_t *samples, u_int32_t start,
+    u_int32_t end, u_int16_t baseline, u_int16_t threshold){
+  u_int32_t idx = start;
+  for (; idx < end; idx++) {
+    int diff = int(samples[idx]&0x3FFF) - baseline;
+    if (diff > threshold || -diff > threshold) break;
+  }
+  return idx;
+}
+
+#ifdef HEADERSCAN_X86
+__attribute__((target("avx2")))
+static u_int32_t FindHeaderAVX2(const u_int32_t *buff, u_int32_t start, u_int32_t end){
+  // 16 words per iteration, the buffers aren't guaranteed to be aligned
+  const __m256i header = _mm256_set1_epi32(0xA);
+  u_int32_t idx = start;
+  for (; idx + 16 <= end; idx += 16) {
+    __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buff+idx));
+    __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buff+idx+8));
+    a = _mm256_cmpeq_epi32(_mm256_srli_epi32(a, 28), header);
+    b = _mm256_cmpeq_epi32(_mm256_srli_epi32(b, 28), header);
+    unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(a)) |
+      (_mm256_movemask_ps(_mm256_castsi256_ps(b)) << 8);
+    if (mask != 0) return idx + __builtin_ctz(mask);
+  }
+  return FindHeaderScalar(buff, idx, end);
+}
+
+__attribute__((target("sse2")))
+static u_int32_t FindHeaderSSE(const u_int32_t *buff, u_int32_t start, u_int32_t end){
+  const __m128i header = _mm_set1_epi32(0xA);
+  u_int32_t idx = start;
+  for (; idx + 8 <= end; idx += 8) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buff+idx));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buff+idx+4));
+    a = _mm_cmpeq_epi32(_mm_srli_epi32(a, 28), header);
+    b = _mm_cmpeq_epi32(_mm_srli_epi32(b, 28), header);
+    unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(a)) |
+      (_mm_movemask_ps(_mm_castsi128_ps(b)) << 4);
+    if (mask != 0) return idx + __builtin_ctz(mask);
+  }
+  return FindHeaderScalar(buff, idx, end);
+}
+
+__attribute__((target("avx2")))
+static u_int32_t FindExcursionAVX2(const u_int16_t *samples, u_int32_t start,
+    u_int32_t end, u_int16_t baseline, u_int16_t threshold){
+  // |s - baseline| as the sum of the two saturated differences, and anything
+  // left after saturated-subtracting the threshold is over it. 16 samples
+  // at a time, two mask bits per sample
+  const __m256i bits = _mm256_set1_epi16(0x3FFF);
+  const __m256i bl = _mm256_set1_epi16(baseline);
+  const __m256i thr = _mm256_set1_epi16(threshold);
+  const __m256i zero = _mm256_setzero_si256();
+  u_int32_t idx = start;
+  for (; idx + 16 <= end; idx += 16) {
+    __m256i s = _mm256_and_si256(_mm256_loadu_si256(
+          reinterpret_cast<const __m256i*>(samples+idx)), bits);
+    __m256i diff = _mm256_or_si256(_mm256_subs_epu16(s, bl), _mm256_subs_epu16(bl, s));
+    __m256i quiet = _mm256_cmpeq_epi16(_mm256_subs_epu16(diff, thr), zero);
+    unsigned mask = ~unsigned(_mm256_movemask_epi8(quiet));
+    if (mask != 0) return idx + __builtin_ctz(mask)/2;
+  }
+  return FindExcursionScalar(samples, idx, end, baseline, threshold);
+}
+
+__attribute__((target("sse2")))
+static u_int32_t FindExcursionSSE(const u_int16_t *samples, u_int32_t start,
+    u_int32_t end, u_int16_t baseline, u_int16_t threshold){
+  const __m128i bits = _mm_set1_epi16(0x3FFF);
+  const __m128i bl = _mm_set1_epi16(baseline);
+  const __m128i thr = _mm_set1_epi16(threshold);
+  const __m128i zero = _mm_setzero_si128();
+  u_int32_t idx = start;
+  for (; idx + 8 <= end; idx += 8) {
+    __m128i s = _mm_and_si128(_mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(samples+idx)), bits);
+    __m128i diff = _mm_or_si128(_mm_subs_epu16(s, bl), _mm_subs_epu16(bl, s));
+    __m128i quiet = _mm_cmpeq_epi16(_mm_subs_epu16(diff, thr), zero);
+    unsigned mask = ~unsigned(_mm_movemask_epi8(quiet)) & 0xFFFF;
+    if (mask != 0) return idx + __builtin_ctz(mask)/2;
+  }
+  return FindExcursionScalar(samples, idx, end, baseline, threshold);
+}
+#endif
+
+typedef u_int32_t (*FindHeaderFn)(const u_int32_t*, u_int32_t, u_int32_t);
+
+static FindHeaderFn ChooseFindHeader(){
+#ifdef HEADERSCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return FindHeaderAVX2;
+  if (__builtin_cpu_supports("sse2")) return FindHeaderSSE;
+#endif
+  return FindHeaderScalar;
+}
+
+static const FindHeaderFn kFindHeader = ChooseFindHeader();
+
+u_int32_t FindHeader(const u_int32_t *buff, u_int32_t start, u_int32_t end){
+  return kFindHeader(buff, start, end);
+}
+
+typedef u_int32_t (*FindExcursionFn)(const u_int16_t*, u_int32_t, u_int32_t, u_int16_t,
+    u_int16_t);
+
+static FindExcursionFn ChooseFindExcursion(){
+#ifdef HEADERSCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return FindExcursionAVX2;
+  if (__builtin_cpu_supports("sse2")) return FindExcursionSSE;
+#endif
+  return FindExcursionScalar;
+}
+
+static const FindExcursionFn kFindExcursion = ChooseFindExcursion();
+
+u_int32_t FindExcursion(const u_int16_t *samples, u_int32_t start, u_int32_t end,
+    u_int16_t baseline, u_int16_t threshold){
+  return kFindExcursion(samples, start, end, baseline, threshold);
+}
@@ -0,0 +1,17 @@
+#ifndef _HEADERSCAN_HH_
+#define _HEADERSCAN_HH_
+
+#include <sys/types.h>
+
+// Returns the index of the first word in buff[start, end) that looks like an
+// event header (0xA in the top four bits), or end if there isn't one.
+// Uses AVX2 or SSE2 where the CPU has them, checked once at startup
+u_int32_t FindHeader(const u_int32_t *buff, u_int32_t start, u_int32_t end);
+
+// Returns the index of the first sample in samples[start, end) that's more than
+// threshold away from baseline, or end if there isn't one. Only the low 14
+// bits of each sample count. Same choice of instructions as FindHeader
+u_int32_t FindExcursion(const u_int16_t *samples, u_int32_t start, u_int32_t end,
+    u_int16_t baseline, u_int16_t threshold);
+
+#endif
@@ -0,0 +1,72 @@
+#include "MemoryGovernor.hh"
+#include <algorithm>
+
+std::atomic_long MemoryGovernor::fLimit(0);
+std::atomic_long MemoryGovernor::fThrottleAt(0);
+std::atomic_long MemoryGovernor::fFlushAt(0);
+std::atomic_long MemoryGovernor::fMaxThrottle(0);
+std::atomic_long MemoryGovernor::fUsed[NPools];
+std::atomic_long MemoryGovernor::fCounts[NResponses];
+std::atomic_long MemoryGovernor::fAmounts[NResponses];
+
+void MemoryGovernor::Configure(long limit_bytes, double throttle_at, double flush_at,
+    long max_throttle_us){
+  // a reader may see old and new values mixed for a moment, which is harmless
+  long limit = std::max(0L, limit_bytes);
+  long throttle = long(throttle_at*limit);
+  fMaxThrottle = std::max(1L, max_throttle_us);
+  fThrottleAt = throttle;
+  fFlushAt = std::max(throttle, long(flush_at*limit));
+  fLimit = limit;
+  for (int r = 0; r < NResponses; r++) fCounts[r] = fAmounts[r] = 0;
+}
+
+long MemoryGovernor::Used(){
+  long used = 0;
+  for (auto& u : fUsed) used += u.load(std::memory_order_relaxed);
+  return used;
+}
+
+MemoryGovernor::Response MemoryGovernor::Level(){
+  long limit = fLimit.load();
+  if (limit == 0) return None;
+  long used = Used();
+  if (used >= limit) return Drop;
+  if (used >= fFlushAt.load()) return Flush;
+  if (used >= fThrottleAt.load()) return Throttle;
+  return None;
+}
+
+long MemoryGovernor::ThrottleUs(){
+  long limit = fLimit.load(), throttle_at = fThrottleAt.load(), max_us = fMaxThrottle.load();
+  if (limit == 0) return 0;
+  long used = Used();
+  if (used < throttle_at) return 0;
+  // from nothing at the threshold to the maximum at the limit
+  long us = max_us;
+  if (used < limit)
+    us = std::max(1L, long(max_us*double(used-throttle_at)/(limit-throttle_at)));
+  Count(Throttle, us);
+  return us;
+}
+
+void MemoryGovernor::Count(Response response, long amount){
+  fCounts[response].fetch_add(1, std::memory_order_relaxed);
+  fAmounts[response].fetch_add(amount, std::memory_order_relaxed);
+}
+
+std::map<std::string, double> MemoryGovernor::Status(){
+  std::map<std::string, double> ret;
+  ret["limit_mb"] = fLimit.load()/1e6;
+  ret["used_mb"] = Used()/1e6;
+  ret["raw_mb"] = fUsed[Raw].load()/1e6;
+  ret["chunks_mb"] = fUsed[Chunks].load()/1e6;
+  ret["compression_mb"] = fUsed[Compression].load()/1e6;
+  ret["throttled"] = fCounts[Throttle].exchange(0);
+  ret["throttled_us"] = fAmounts[Throttle].exchange(0);
+  ret["flushed"] = fCounts[Flush].exchange(0);
+  ret["flushed_mb"] = fAmounts[Flush].exchange(0)/1e6;
+  ret["dropped"] = fCounts[Drop].exchange(0);
+  ret["dropped_mb"] = fAmounts[Drop].exchange(0)/1e6;
+  return ret;
+}
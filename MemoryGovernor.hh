@@ -0,0 +1,55 @@
+#ifndef _MEMORYGOVERNOR_HH_
+#define _MEMORYGOVERNOR_HH_
+
+#include <atomic>
+#include <map>
+#include <string>
+
+class MemoryGovernor{
+  /*
+    Keeps the memory held by the data path on this host under a budget.
+    Tracks raw packets from readout until they're parsed, uncompressed
+    chunks in the inserters, and whatever is waiting to be compressed. As
+    usage climbs it first slows the readout down (the boards buffer, and
+    eventually go busy), then has the inserters write out their oldest
+    chunks early, and once over the limit the inserters throw packets away
+    and leave artificial deadtime in their place instead of running out of
+    memory. Usage is always counted, so it stays right across runs; the
+    responses are off unless a budget is configured.
+  */
+
+public:
+  enum Pool {Raw = 0, Chunks, Compression, NPools};
+  enum Response {None = 0, Throttle, Flush, Drop, NResponses};
+
+  // Fractions are of the limit, limit 0 turns it off. Usage carries over,
+  // since what's left of the last run gives its memory back later
+  // (and the response counts are reset)
+  static void Configure(long limit_bytes, double throttle_at, double flush_at,
+      long max_throttle_us);
+
+  // Negative to give memory back
+  static void Add(Pool pool, long bytes){
+    fUsed[pool].fetch_add(bytes, std::memory_order_relaxed);
+  }
+  // The strongest response called for right now
+  static Response Level();
+  // How long the readout should wait before it polls its boards again.
+  // Counted as a throttle if it's not zero
+  static long ThrottleUs();
+  static void Count(Response response, long amount=0);
+
+  // Usage now, and how often each response happened since the last call
+  static std::map<std::string, double> Status();
+
+private:
+  static long Used();
+
+  // read by live threads while the next run is being configured
+  static std::atomic_long fLimit, fThrottleAt, fFlushAt, fMaxThrottle;
+  static std::atomic_long fUsed[NPools];
+  static std::atomic_long fCounts[NResponses];
+  static std::atomic_long fAmounts[NResponses]; // bytes, or us for throttles
+};
+
+#endif
@@ -0,0 +1,157 @@
+#include "Metrics.hh"
+
+std::map<std::string, Metrics::Shard*> Metrics::fShards;
+std::mutex Metrics::fMutex;
+std::chrono::steady_clock::time_point Metrics::fLastSnapshot = std::chrono::steady_clock::now();
+thread_local Metrics::Shard *Metrics::tShard = nullptr;
+
+const char* Metrics::StageName(Stage stage){
+  static const char* names[NStages] = {"blt_read", "enqueue", "dequeue", "decode",
+    "chunk_close", "compress", "write"};
+  return names[stage];
+}
+
+void Metrics::Register(std::string thread_name){
+  const std::lock_guard<std::mutex> lg(fMutex);
+  if (fShards.count(thread_name) == 0) {
+    Shard *shard = new Shard;
+    for (int s = 0; s < NStages; s++) {
+      for (int b = 0; b < NBins; b++) shard->bins[s][b] = 0;
+      shard->total[s].count = shard->total[s].ns = shard->total[s].bytes = 0;
+    }
+    fShards[thread_name] = shard;
+  }
+  tShard = fShards[thread_name];
+}
+
+int Metrics::Bin(long ns){
+  // The first eight bins are 0-7 ns, after that each power of two gets
+  // eight, indexed by the three bits below the leading one
+  if (ns < 8) return ns < 0 ? 0 : ns;
+  int exp = 63 - __builtin_clzl(ns);
+  int bin = (exp-2)*8 + ((ns >> (exp-3)) & 0x7);
+  return bin < NBins ? bin : NBins-1;
+}
+
+double Metrics::BinValue(int bin){
+  // the middle of the bin
+  if (bin < 8) return bin;
+  int exp = bin/8 + 2;
+  double width = double(1L << (exp-3));
+  return (8 + bin%8)*width + width/2;
+}
+
+void Metrics::Record(Stage stage, long ns, long bytes, int bid){
+  Shard *shard = tShard;
+  if (shard == nullptr) return;
+  Bump(shard->bins[stage][Bin(ns)], 1);
+  Bump(shard->total[stage].count, 1);
+  Bump(shard->total[stage].ns, ns);
+  Bump(shard->total[stage].bytes, bytes);
+  if (bid < 0) return;
+  auto it = shard->boards.find(bid);
+  if (it == shard->boards.end()) {
+    std::vector<Counters> *counters = new std::vector<Counters>(NStages);
+    for (auto& c : *counters) c.count = c.ns = c.bytes = 0;
+    const std::lock_guard<std::mutex> lg(shard->board_mutex);
+    it = shard->boards.emplace(bid, counters).first;
+  }
+  Counters& c = (*it->second)[stage];
+  Bump(c.count, 1);
+  Bump(c.ns, ns);
+  Bump(c.bytes, bytes);
+}
+
+double Metrics::Quantile(const std::vector<long>& bins, long count, double q){
+  long target = q*count, seen = 0;
+  for (int b = 0; b < NBins; b++) {
+    seen += bins[b];
+    if (seen > target) return BinValue(b);
+  }
+  return BinValue(NBins-1);
+}
+
+std::map<std::string, double> Metrics::Summarize(const std::vector<long>& bins,
+    long count, long ns, long bytes){
+  std::map<std::string, double> ret;
+  ret["count"] = count;
+  ret["MB"] = bytes/1e6;
+  ret["mean_us"] = ns/1e3/count;
+  if (bins.size() > 0) {
+    ret["p50_us"] = Quantile(bins, count, 0.5)/1e3;
+    ret["p90_us"] = Quantile(bins, count, 0.9)/1e3;
+    ret["p99_us"] = Quantile(bins, count, 0.99)/1e3;
+  }
+  return ret;
+}
+
+void Metrics::Snapshot(Summary& stages, std::map<std::string, Summary>& threads,
+    std::map<int, Summary>& boards){
+  const std::lock_guard<std::mutex> lg(fMutex);
+  auto now = std::chrono::steady_clock::now();
+  double elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      now - fLastSnapshot).count();
+  fLastSnapshot = now;
+
+  std::vector<std::vector<long>> all_bins(NStages, std::vector<long>(NBins, 0));
+  std::vector<long> all_total(NStages*3, 0);
+  std::map<int, std::vector<long>> all_boards;
+  for (auto& p : fShards) {
+    Shard *shard = p.second;
+    if (shard->last_bins.size() == 0) {
+      shard->last_bins.assign(NStages*NBins, 0);
+      shard->last_total.assign(NStages*3, 0);
+    }
+    for (int s = 0; s < NStages; s++) {
+      std::vector<long> bins(NBins);
+      for (int b = 0; b < NBins; b++) {
+        long now_count = shard->bins[s][b].load(std::memory_order_relaxed);
+        bins[b] = now_count - shard->last_bins[s*NBins+b];
+        shard->last_bins[s*NBins+b] = now_count;
+        all_bins[s][b] += bins[b];
+      }
+      long d[3];
+      long now_total[3] = {shard->total[s].count.load(std::memory_order_relaxed),
+        shard->total[s].ns.load(std::memory_order_relaxed),
+        shard->total[s].bytes.load(std::memory_order_relaxed)};
+      for (int i = 0; i < 3; i++) {
+        d[i] = now_total[i] - shard->last_total[s*3+i];
+        shard->last_total[s*3+i] = now_total[i];
+        all_total[s*3+i] += d[i];
+      }
+      if (d[0] == 0) continue;
+      threads[p.first][StageName(Stage(s))] = Summarize(bins, d[0], d[1], d[2]);
+      threads[p.first][StageName(Stage(s))]["busy"] = d[1]/elapsed_ns;
+    }
+
+    const std::lock_guard<std::mutex> blg(shard->board_mutex);
+    for (auto& bp : shard->boards) {
+      std::vector<long>& last = shard->last_boards[bp.first];
+      std::vector<long>& all = all_boards[bp.first];
+      if (last.size() == 0) last.assign(NStages*3, 0);
+      if (all.size() == 0) all.assign(NStages*3, 0);
+      for (int s = 0; s < NStages; s++) {
+        const Counters& c = (*bp.second)[s];
+        long now_total[3] = {c.count.load(std::memory_order_relaxed),
+          c.ns.load(std::memory_order_relaxed), c.bytes.load(std::memory_order_relaxed)};
+        for (int i = 0; i < 3; i++) {
+          all[s*3+i] += now_total[i] - last[s*3+i];
+          last[s*3+i] = now_total[i];
+        }
+      }
+    }
+  }
+
+  for (int s = 0; s < NStages; s++) {
+    if (all_total[s*3] == 0) continue;
+    stages[StageName(Stage(s))] = Summarize(all_bins[s], all_total[s*3], all_total[s*3+1],
+        all_total[s*3+2]);
+  }
+  for (auto& bp : all_boards) {
+    for (int s = 0; s < NStages; s++) {
+      if (bp.second[s*3] == 0) continue;
+      boards[bp.first][StageName(Stage(s))] = Summarize(std::vector<long>(),
+          bp.second[s*3], bp.second[s*3+1], bp.second[s*3+2]);
+    }
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef _METRICS_HH_
+#define _METRICS_HH_
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class Metrics{
+  /*
+    Latency and throughput of every stage of the data path, for the status
+    document. Each thread records into its own set of histograms, so the
+    hot path is a handful of uncontended stores and nothing is shared until
+    the status thread (the only reader) sums them up once a second.
+    Histograms are log-linear: eight bins per power of two of nanoseconds,
+    so anything from ns to minutes is covered to within ~10%.
+  */
+
+public:
+  enum Stage {
+    BLTRead = 0, // readout of one board, per ReadMBLT that returned data
+    Enqueue,     // handing a readout's packets to the shared buffer
+    Dequeue,     // how long a packet sat in the buffer before being picked up
+    Decode,      // parsing one packet into strax records
+    ChunkClose,  // closing out one chunk and handing it to the writer
+    Compress,    // compressing one file
+    Write,       // writing one file and moving it into place
+    NStages
+  };
+  static const char* StageName(Stage stage);
+
+  // Has to be called from a thread before anything it records is kept.
+  // Names should be unique, and should stay the same from run to run
+  // (like "readout_0") since the per-thread records are kept around
+  static void Register(std::string thread_name);
+
+  // bid < 0 means it isn't about one board
+  static void Record(Stage stage, long ns, long bytes=0, int bid=-1);
+  static void Record(Stage stage, std::chrono::steady_clock::time_point start,
+      long bytes=0, int bid=-1){
+    Record(stage, std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now()-start).count(), bytes, bid);
+  }
+
+  // What happened since the last call. Per stage: count, MB, mean/p50/p90/p99
+  // in microseconds. Per thread also 'busy', the fraction of the time it spent
+  // in that stage, per board only the count, MB, and mean
+  typedef std::map<std::string, std::map<std::string, double>> Summary;
+  static void Snapshot(Summary& stages, std::map<std::string, Summary>& threads,
+      std::map<int, Summary>& boards);
+
+  static const int NBins = 320;
+
+private:
+  struct Counters{
+    std::atomic_long count, ns, bytes;
+  };
+  struct Shard{
+    // Only the owning thread writes, the snapshot only reads
+    std::atomic_long bins[NStages][NBins];
+    Counters total[NStages];
+    std::map<int, std::vector<Counters>*> boards;
+    std::mutex board_mutex; // taken to add a board, and by the snapshot
+    // What the last snapshot saw. Only touched by the snapshot
+    std::vector<long> last_bins, last_total;
+    std::map<int, std::vector<long>> last_boards;
+  };
+  static int Bin(long ns);
+  static double BinValue(int bin);
+  static double Quantile(const std::vector<long>& bins, long count, double q);
+  static std::map<std::string, double> Summarize(const std::vector<long>& bins,
+      long count, long ns, long bytes);
+  static void Bump(std::atomic_long& counter, long by){
+    counter.store(counter.load(std::memory_order_relaxed)+by, std::memory_order_relaxed);
+  }
+
+  static std::map<std::string, Shard*> fShards;
+  static std::mutex fMutex;
+  static std::chrono::steady_clock::time_point fLastSnapshot;
+  static thread_local Shard *tShard;
+};
+
+#endif
@@ -6,8 +6,14 @@
 #include <mongocxx/database.hpp>
 #include <bsoncxx/builder/stream/document.hpp>
 
-MongoLog::MongoLog(bool LocalFileLogging, int DeleteAfterDays){
+// How often the flusher wakes up to write queued messages, in ms. Errors
+// and worse wake it immediately
+const int LogBatchPeriod(100);
+
+MongoLog::MongoLog(bool LocalFileLogging, int DeleteAfterDays) : fQueue(0x4000) {
   fLogLevel = 0;
+  fConnected = false;
+  fQueued = fWritten = fDropped = fCoalesced = 0;
   fHostname = "_host_not_set";
   fLogFileNameFormat = "%Y%m%d.log";
   fDeleteAfterDays = DeleteAfterDays;
@@ -23,19 +29,99 @@ MongoLog::MongoLog(bool LocalFileLogging, int DeleteAfterDays){
 }
 MongoLog::~MongoLog(){
   fFlush = false;
-  fFlushThread.join();
+  fWakeCV.notify_one();
+  fFlushThread.join(); // writes whatever is still queued
   fOutfile.close();
 }
 
 void MongoLog::Flusher() {
-  while (fFlush == true) {
-    std::this_thread::sleep_for(std::chrono::seconds(fFlushPeriod));
-    fMutex.lock();
-    fOutfile << std::flush;
-    fMutex.unlock();
+  std::vector<LogEntry*> batch;
+  LogEntry *entry;
+  auto last_file_flush = std::chrono::system_clock::now();
+  bool running = true;
+  while (running) {
+    running = fFlush;
+    {
+      std::unique_lock<std::mutex> lk(fWakeMutex);
+      fWakeCV.wait_for(lk, std::chrono::milliseconds(LogBatchPeriod));
+    }
+    const std::lock_guard<std::mutex> lg(fWriteMutex);
+    while (fQueue.Pop(entry)) batch.push_back(entry);
+    if (batch.size() > 0) Write(batch);
+    if (std::chrono::system_clock::now() - last_file_flush > std::chrono::seconds(fFlushPeriod)
+        || !running) {
+      fOutfile << std::flush;
+      last_file_flush = std::chrono::system_clock::now();
+    }
   }
 }
 
+void MongoLog::Flush() {
+  std::vector<LogEntry*> batch;
+  LogEntry *entry;
+  const std::lock_guard<std::mutex> lg(fWriteMutex);
+  while (fQueue.Pop(entry)) batch.push_back(entry);
+  if (batch.size() > 0) Write(batch);
+  fOutfile << std::flush;
+}
+
+void MongoLog::Write(std::vector<LogEntry*>& batch) {
+  // A run of identical messages (one board complaining about every event,
+  // say) goes to the database and stdout once, with a count. The local file
+  // still gets every one of them, with its own time
+  std::vector<bsoncxx::document::value> docs;
+  std::stringstream out;
+  unsigned i = 0;
+  while (i < batch.size()) {
+    LogEntry *e = batch[i];
+    unsigned j = i+1;
+    while (j < batch.size() && batch[j]->priority == e->priority &&
+        batch[j]->message == e->message) j++;
+    std::string message = e->message;
+    if (j - i > 1) {
+      message += " (repeated " + std::to_string(j-i) + " times)";
+      fCoalesced += j-i-1;
+    }
+    if(e->priority >= fLogLevel){
+      docs.push_back(bsoncxx::builder::stream::document{} <<
+				  "user" << fHostname <<
+				  "message" << message <<
+				  "priority" << e->priority <<
+				  bsoncxx::builder::stream::finalize);
+    }
+    auto tm = *std::gmtime(&e->time);
+    std::stringstream msg;
+    msg<<FormatTime(&tm)<<" ["<<fPriorities[e->priority+1]
+	    <<"]: "<<message<<'\n';
+    out << msg.str();
+    if(fLocalFileLogging){
+      for (unsigned k = i; k < j; k++) {
+        tm = *std::gmtime(&batch[k]->time);
+        if (Today(&tm) != fToday) RotateLogFile();
+        fOutfile<<FormatTime(&tm)<<" ["<<fPriorities[e->priority+1]
+          <<"]: "<<batch[k]->message<<'\n';
+      }
+    }
+    i = j;
+  }
+  std::cout << out.str() << std::flush;
+
+  if (docs.size() > 0) {
+    const std::lock_guard<std::mutex> lg(fMutex);
+    if (fConnected) {
+      try{
+        fMongoCollection.insert_many(docs);
+      }
+      catch(const std::exception &e){
+        std::cout<<"Failed to insert "<<docs.size()<<" log messages: "<<e.what()<<std::endl;
+      }
+    }
+  }
+  fWritten += batch.size();
+  for (auto e : batch) delete e;
+  batch.clear();
+}
+
 std::string MongoLog::FormatTime(struct tm* date) {
   std::stringstream s;
   s <<std::put_time(date, "%F %T");
@@ -88,10 +174,12 @@ int  MongoLog::Initialize(std::string connection_string,
 			  std::string db, std::string collection,
 			  std::string host,
 			  bool debug){
+  const std::lock_guard<std::mutex> lg(fMutex);
   try{
     mongocxx::uri uri{connection_string};
     fMongoClient = mongocxx::client(uri);
     fMongoCollection = fMongoClient[db][collection];
+    fConnected = true;
   }
   catch(const std::exception &e){
     std::cout<<"Couldn't initialize the log. So gonna fail then."<<std::endl;
@@ -120,37 +208,28 @@ int MongoLog::Entry(int priority, std::string message, ...){
   va_start (args, message);  // Fill the vector we just made
   std::vsnprintf(&vec[0], len + 1, message.c_str(), args);
   va_end (args);
-  message = &vec[0];
 
-  fMutex.lock();
-  if(priority >= fLogLevel){
-    try{
-      fMongoCollection.insert_one(bsoncxx::builder::stream::document{} <<
-				  "user" << fHostname <<
-				  "message" << message <<
-				  "priority" << priority <<
-				  bsoncxx::builder::stream::finalize);
-    }
-    catch(const std::exception &e){
-      std::cout<<"Failed to insert log message "<<message<<" ("<<
-	priority<<")"<<std::endl;
-      fMutex.unlock();
+  LogEntry *entry = new LogEntry{priority, &vec[0], std::time(nullptr)};
+  fQueued++;
+  if (!fQueue.Push(entry)) {
+    if (priority < Error) {
+      // the flusher can't keep up. Better to lose a message than block
+      delete entry;
+      fQueued--;
+      fDropped++;
       return -1;
     }
+    // but not one of these. Write out the backlog from here so it stays in
+    // order, and if someone else filled the queue up again in the meantime
+    // this one goes out by itself
+    Flush();
+    if (!fQueue.Push(entry)) {
+      const std::lock_guard<std::mutex> lg(fWriteMutex);
+      std::vector<LogEntry*> batch{entry};
+      Write(batch);
+    }
   }
-
-  auto t = std::time(nullptr);
-  auto tm = *std::gmtime(&t);
-  std::stringstream msg;
-  msg<<FormatTime(&tm)<<" ["<<fPriorities[priority+1]
-	    <<"]: "<<message<<std::endl;
-  std::cout << msg.str();
-  if(fLocalFileLogging){
-    if (Today(&tm) != fToday) RotateLogFile();
-    fOutfile<<msg.str();
-  }
-  fMutex.unlock();
-
+  if (priority == Fatal) Flush();
+  else if (priority >= Error) fWakeCV.notify_one();
   return 0;
 }
-
@@ -13,9 +13,13 @@
 #include <vector>
 #include <atomic>
 #include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <ctime>
 
 #include <mongocxx/client.hpp>
 #include <mongocxx/collection.hpp>
+#include "RingBuffer.hh"
 
 /* 
    A brief treatise on log priorities. 
@@ -48,7 +52,8 @@
 
 class MongoLog{
   /*
-    Logging class that writes to MongoDB
+    Logging class that writes to MongoDB. Entry() only formats the message
+    and queues it, the flusher thread does the writing
   */
   
 public:
@@ -67,9 +72,23 @@ public:
   const static int Local   = -1; // Write to local (file) log only
 
   int Entry(int priority,std::string message, ...);
+  // Writes everything queued so far before returning, for when the process
+  // is about to go away
+  void Flush();
+
+  // For the status doc
+  long QueueDepth() {return fQueued.load() - fWritten.load();}
+  long Dropped() {return fDropped.load();}
+  long Coalesced() {return fCoalesced.load();}
 
 private:
+  struct LogEntry{
+    int priority;
+    std::string message;
+    std::time_t time;
+  };
   void Flusher();
+  void Write(std::vector<LogEntry*>& batch);
   std::string FormatTime(struct tm* date);
   int Today(struct tm* date);
   int RotateLogFile();
@@ -85,9 +104,16 @@ private:
   int fDeleteAfterDays;
   int fToday;
   std::mutex fMutex;
+  std::mutex fWriteMutex; // whoever is draining the queue
   std::thread fFlushThread;
   std::atomic_bool fFlush;
   int fFlushPeriod;
+  bool fConnected;
+
+  RingBuffer<LogEntry*> fQueue;
+  std::mutex fWakeMutex;
+  std::condition_variable fWakeCV;
+  std::atomic_long fQueued, fWritten, fDropped, fCoalesced;
 };
 
 #endif
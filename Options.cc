@@ -24,6 +24,26 @@ Options::Options(MongoLog *log, std::string options_name, std::string hostname,
     throw std::runtime_error("Can't initialize options class");
 }
 
+Options::Options(MongoLog *log, std::string json, std::string hostname,
+    std::string override_json){
+  using namespace bsoncxx::builder::stream;
+  fLog = log;
+  fHostname = hostname;
+  fDBname = "";
+  try{
+    auto doc = bsoncxx::from_json(json);
+    auto over = bsoncxx::from_json(override_json == "" ? "{}" : override_json);
+    // lookups take the first match, so the overrides go first
+    bson_value = new bsoncxx::document::value(document{} <<
+        bsoncxx::builder::concatenate_doc{over.view()} <<
+        bsoncxx::builder::concatenate_doc{doc.view()} << finalize);
+  }catch(const std::exception& e){
+    throw std::runtime_error(std::string("Can't parse options: ") + e.what());
+  }
+  bson_options = bson_value->view();
+  BuildSnapshot();
+}
+
 Options::~Options(){
   if(bson_value != NULL) {
     delete bson_value;
@@ -46,15 +66,9 @@ int Options::Load(std::string name, mongocxx::collection& opts_collection,
     fLog->Entry(MongoLog::Warning, "Failed to find your options file '%s' in DB", name);
     return -1;
   }
-  if(bson_value != NULL) {
-    delete bson_value;
-    bson_value = NULL;
-  }
-  bson_value = new bsoncxx::document::value((*trydoc).view());
-  bson_options = bson_value->view();
-  
-  // Pull all subdocuments
-  int success = 0;
+  // Pull all subdocuments. They get tacked on all at once at the end, since
+  // every concatenation copies the whole document
+  std::vector<bsoncxx::document::value> includes;
   try{
     bsoncxx::array::view include_array = (*trydoc).view()["includes"].get_array().value;
     for(bsoncxx::array::element ele : include_array){
@@ -62,20 +76,26 @@ int Options::Load(std::string name, mongocxx::collection& opts_collection,
 					 "name" << ele.get_utf8().value.to_string() <<
 					 bsoncxx::builder::stream::finalize);
       if(sd)
-	success += Override(*sd); // include_json.push_back(bsoncxx::to_json(*sd));
+	includes.push_back(*sd);
       else
 	fLog->Entry(MongoLog::Warning, "Possible improper run config. Check your options includes");
     }
   }catch(...){}; // will catch if there are no includes, for example
 
   if(override_opts != "")
-    success += Override(bsoncxx::from_json(override_opts));
+    includes.push_back(bsoncxx::from_json(override_opts));
 
-  if(success!=0){
-    fLog->Entry(MongoLog::Warning, "Failed to override options doc with includes and overrides.");
-    return -1;
+  bsoncxx::builder::stream::document doc{};
+  doc << bsoncxx::builder::concatenate_doc{(*trydoc).view()};
+  for(auto& inc : includes)
+    doc << bsoncxx::builder::concatenate_doc{inc.view()};
+  if(bson_value != NULL) {
+    delete bson_value;
+    bson_value = NULL;
   }
-
+  bson_value = new bsoncxx::document::value(doc.extract());
+  bson_options = bson_value->view();
+  BuildSnapshot();
 
   return 0;
 }
@@ -104,146 +124,193 @@ int Options::Override(bsoncxx::document::view override_opts){
   // Set to new
   bson_value = new_value;
   bson_options = bson_value->view();
+  BuildSnapshot();
 
   return 0;  
 }
 
-long int Options::GetLongInt(std::string path, long int default_value){
-  try{
-    return bson_options[path.c_str()].get_int64();
+void Options::Flatten(bsoncxx::document::view doc, std::string prefix,
+    std::set<std::string>& seen, OptionsSnapshot *snap){
+  for(auto ele : doc){
+    std::string key = prefix + ele.key().to_string();
+    if(!seen.insert(key).second)
+      continue; // a lookup would have found the earlier one
+    switch(ele.type()){
+      case bsoncxx::type::k_int32:
+	snap->ints[key] = ele.get_int32().value;
+	break;
+      case bsoncxx::type::k_int64:
+	snap->longs[key] = ele.get_int64().value;
+	break;
+      case bsoncxx::type::k_double:
+	snap->doubles[key] = ele.get_double().value;
+	break;
+      case bsoncxx::type::k_utf8:
+	snap->strings[key] = ele.get_utf8().value.to_string();
+	break;
+      case bsoncxx::type::k_document:
+	Flatten(ele.get_document().value, key + ".", seen, snap);
+	break;
+      default: // arrays are dealt with below, the rest we don't use
+	break;
+    }
   }
-  catch (const std::exception &e){
-    // Some APIs autoconvert big ints to doubles. Why? I don't know.
-    // But we can handle this here rather than chase those silly things
-    // around in each implementation.
-    try{
-      return (long int)(bson_options[path.c_str()].get_double());
+}
+
+void Options::BuildSnapshot(){
+  OptionsSnapshot *snap = new OptionsSnapshot;
+  std::set<std::string> seen;
+  Flatten(bson_options, "", seen, snap);
+
+  std::set<int> bids = {-1};
+  try{
+    for(bsoncxx::array::element ele : bson_options["boards"].get_array().value){
+      try{
+	BoardType bt;
+	bt.link = ele["link"].get_int32();
+	bt.crate = ele["crate"].get_int32();
+	bt.board = ele["board"].get_int32();
+	bt.type = ele["type"].get_utf8().value.to_string();
+	bt.vme_address = DAXHelpers::StringToHex(ele["vme_address"].get_utf8().value.to_string());
+	try{
+	  bt.host = ele["host"].get_utf8().value.to_string();
+	}catch(const std::exception &e){
+	  bt.host = ""; // no biggie, assume we have just 1 host
+	}
+	snap->boards.push_back(bt);
+	bids.insert(bt.board);
+      }catch(const std::exception &e){
+	fLog->Entry(MongoLog::Warning, "Skipping malformed board entry in options");
+      }
     }
-    catch(const std::exception &e){
-      fLog->Entry(MongoLog::Local, "Using default value for %s", path.c_str());
-      return default_value;
+  }catch(const std::exception &e){}
+
+  std::vector<RegisterType> regs;
+  try{
+    for(bsoncxx::array::element ele : bson_options["registers"].get_array().value){
+      RegisterType rt;
+      rt.board = ele["board"].get_int32();
+      rt.reg = ele["reg"].get_utf8().value.to_string();
+      rt.val = ele["val"].get_utf8().value.to_string();
+      regs.push_back(rt);
+      bids.insert(rt.board);
     }
-  }  
-  return -1;
+  }catch(const std::exception &e){
+    fLog->Entry(MongoLog::Local, "Problem reading registers: %s", e.what());
+  }
+  for(int bid : bids){
+    auto& these = snap->registers[bid];
+    for(auto& rt : regs)
+      if(rt.board == bid || rt.board == -1)
+	these.push_back(rt);
+  }
+
+  // thresholds and channels are both {bid: [per channel]}
+  for(std::string field : {"thresholds", "channels"}){
+    try{
+      for(auto ele : bson_options[field].get_document().value){
+	try{
+	  int bid = std::stoi(ele.key().to_string());
+	  std::vector<int> values;
+	  for(auto& val : ele.get_array().value)
+	    values.push_back(val.get_int32().value);
+	  if(field == "thresholds")
+	    snap->thresholds[bid].assign(values.begin(), values.end());
+	  else
+	    snap->channels[bid].assign(values.begin(), values.end());
+	}catch(const std::exception &e){
+	  fLog->Entry(MongoLog::Warning, "Can't parse %s for '%s'", field.c_str(),
+	      ele.key().to_string().c_str());
+	}
+      }
+    }catch(const std::exception &e){}
+  }
+
+  // anyone still reading the old one keeps it until they're done
+  std::atomic_store(&fSnapshot, std::shared_ptr<const OptionsSnapshot>(snap));
+}
+
+long int Options::GetLongInt(std::string path, long int default_value){
+  auto snap = std::atomic_load(&fSnapshot);
+  auto it = snap->longs.find(path);
+  if (it != snap->longs.end()) return it->second;
+  // Some APIs autoconvert big ints to doubles. Why? I don't know.
+  // But we can handle this here rather than chase those silly things
+  // around in each implementation.
+  auto dit = snap->doubles.find(path);
+  if (dit != snap->doubles.end()) return (long int)(dit->second);
+  fLog->Entry(MongoLog::Local, "Using default value for %s", path.c_str());
+  return default_value;
 }
 
 double Options::GetDouble(std::string path, double default_value) {
-  try{
-    return bson_options[path].get_double();
-  } catch (const std::exception& e) {
-    fLog->Entry(MongoLog::Local, "Using default value for %s", path.c_str());
-    return default_value;
-  }
+  auto snap = std::atomic_load(&fSnapshot);
+  auto it = snap->doubles.find(path);
+  if (it != snap->doubles.end()) return it->second;
+  fLog->Entry(MongoLog::Local, "Using default value for %s", path.c_str());
+  return default_value;
 }
 
 int Options::GetInt(std::string path, int default_value){
-
-  try{
-    return bson_options[path.c_str()].get_int32();
-  }
-  catch (const std::exception &e){
-    //LOG
-    fLog->Entry(MongoLog::Local, "Using default value for %s", path.c_str());
-    return default_value;
-  }
-  return -1;  
+  auto snap = std::atomic_load(&fSnapshot);
+  auto it = snap->ints.find(path);
+  if (it != snap->ints.end()) return it->second;
+  fLog->Entry(MongoLog::Local, "Using default value for %s", path.c_str());
+  return default_value;
 }
 
 int Options::GetNestedInt(std::string path, int default_value){
-  // Parse string
-  std::vector<std::string> fields;
-  std::stringstream ss(path);
-  while( ss.good() ){
-    std::string substr;
-    getline( ss, substr, '.' );
-    fields.push_back( substr );
-  }
-  try{
-    auto val = bson_options[fields[0].c_str()];
-    for(unsigned int i=1; i<fields.size(); i++)
-      val = val[fields[i].c_str()];
-    return val.get_int32();
-  }catch(const std::exception &e){
-    fLog->Entry(MongoLog::Local, "Using default value for %s",path.c_str());
-    return default_value;
-  }
-  return 0;
+  // the snapshot keys are already dotted paths
+  return GetInt(path, default_value);
+}
+
+std::string Options::GetNestedString(std::string path, std::string default_value){
+  return GetString(path, default_value);
 }
 
 std::string Options::GetString(std::string path, std::string default_value){
-  try{
-    return bson_options[path.c_str()].get_utf8().value.to_string();
-  }
-  catch (const std::exception &e){
-    //LOG
-    fLog->Entry(MongoLog::Local, "Using default value for %s", path.c_str());
-    return default_value;
-  }  
-  return "";
+  auto snap = std::atomic_load(&fSnapshot);
+  auto it = snap->strings.find(path);
+  if (it != snap->strings.end()) return it->second;
+  fLog->Entry(MongoLog::Local, "Using default value for %s", path.c_str());
+  return default_value;
 }
 
 std::vector<BoardType> Options::GetBoards(std::string type, std::string hostname){
+  auto snap = std::atomic_load(&fSnapshot);
   std::vector<BoardType> ret;
-  bsoncxx::array::view subarr = bson_options["boards"].get_array().value;
-
   std::vector <std::string> types;
   if(type == "V17XX")
     types = {"V1724", "V1730", "V1724_MV"};
   else
     types.push_back(type);
-  
-  for(bsoncxx::array::element ele : subarr){
-    std::string btype = ele["type"].get_utf8().value.to_string();
-    if(!std::count(types.begin(), types.end(), btype))
+
+  for(auto& bt : snap->boards){
+    if(!std::count(types.begin(), types.end(), bt.type))
+      continue;
+    // If there is no host field then no biggie. Assume we have just 1 host.
+    if(bt.host != "" && bt.host != hostname)
       continue;
-    try{
-      if(ele["host"].get_utf8().value.to_string() != hostname)
-	continue;
-    }
-    catch(const std::exception &e){
-      // If there is no host field then no biggie. Assume we have just 1 host.
-    };
-    BoardType bt;
-    bt.link = ele["link"].get_int32();
-    bt.crate = ele["crate"].get_int32();
-    bt.board = ele["board"].get_int32();
-    bt.type = ele["type"].get_utf8().value.to_string();    
-    bt.vme_address = DAXHelpers::StringToHex(ele["vme_address"].get_utf8().value.to_string());
     ret.push_back(bt);
   }
-  
   return ret;
 }
-    
-std::vector<RegisterType> Options::GetRegisters(int board){
-  std::vector<RegisterType> ret;
-  
-  bsoncxx::array::view regarr = bson_options["registers"].get_array().value;
-  for(bsoncxx::array::element ele : regarr){
-    if(board != ele["board"].get_int32() && ele["board"].get_int32() != -1)
-      continue;
-    RegisterType rt;
-    rt.board = ele["board"].get_int32();
-    rt.reg = ele["reg"].get_utf8().value.to_string();
-    rt.val = ele["val"].get_utf8().value.to_string();
 
-    ret.push_back(rt);
-  }
-  return ret;
+std::vector<RegisterType> Options::GetRegisters(int board){
+  auto snap = std::atomic_load(&fSnapshot);
+  auto it = snap->registers.find(board);
+  if (it != snap->registers.end()) return it->second;
+  // a board not mentioned anywhere only gets the ones for all boards
+  return snap->registers.at(-1);
 }
 
 std::vector<u_int16_t> Options::GetThresholds(int board) {
-  std::vector<u_int16_t> thresholds;
+  auto snap = std::atomic_load(&fSnapshot);
   u_int16_t default_threshold = 0xA;
-  try{
-    for (auto& val : bson_options["thresholds"][std::to_string(board)].get_array().value)
-      thresholds.push_back(val.get_int32().value);
-    return thresholds;
-  }
-  catch(std::exception& e){
-    fLog->Entry(MongoLog::Local, "Using default thresholds for %i", board);
-    return std::vector<u_int16_t>(16, default_threshold);
-  }
+  auto it = snap->thresholds.find(board);
+  if (it != snap->thresholds.end()) return it->second;
+  fLog->Entry(MongoLog::Local, "Using default thresholds for %i", board);
+  return std::vector<u_int16_t>(16, default_threshold);
 }
 
 int Options::GetCrateOpt(CrateOptions &ret){
@@ -267,14 +334,21 @@ int Options::GetCrateOpt(CrateOptions &ret){
 }
 
 int16_t Options::GetChannel(int bid, int cid){
-  std::string boardstring = std::to_string(bid);
-  try{
-    return bson_options["channels"][boardstring][cid].get_int32().value;
-  }
-  catch(std::exception& e){
-    fLog->Entry(MongoLog::Error, "Failed to look up board %i ch %i", bid, cid);
-    return -1;
-  }
+  auto snap = std::atomic_load(&fSnapshot);
+  auto it = snap->channels.find(bid);
+  if (it != snap->channels.end() && cid >= 0 && cid < (int)it->second.size())
+    return it->second[cid];
+  fLog->Entry(MongoLog::Error, "Failed to look up board %i ch %i", bid, cid);
+  return -1;
+}
+
+std::vector<int16_t> Options::GetChannels(int bid){
+  // The whole channel map for a board, for callers that want to look it up once
+  auto snap = std::atomic_load(&fSnapshot);
+  auto it = snap->channels.find(bid);
+  if (it != snap->channels.end()) return it->second;
+  fLog->Entry(MongoLog::Error, "Failed to look up channel map for board %i", bid);
+  return std::vector<int16_t>();
 }
 
 int Options::GetHEVOpt(HEVOptions &ret){
@@ -358,6 +432,7 @@ void Options::UpdateDAC(std::map<int, std::map<std::string, std::vector<double>>
   auto update_doc = document{};
   update_doc<< "$set" << open_document << "run" << run_id;
   for (auto& bid_map : all_dacs) { // (bid, map<string, vector>)
+    if (bid_map.first < 0) continue; // the defaults GetDAC filled in, not a board
     update_doc << std::to_string(bid_map.first) << open_document;
     for(auto& str_vec : bid_map.second){ // (string, vector)
       update_doc << str_vec.first << open_array <<
@@ -375,22 +450,21 @@ void Options::UpdateDAC(std::map<int, std::map<std::string, std::vector<double>>
   return;
 }
 
-void Options::SaveBenchmarks(std::map<std::string, long>& byte_counter,
+void Options::SaveBenchmarks(std::map<std::string, long>& counters,
     std::map<int, long>& buffer_counter,
-    double proc_time_us, double comp_time_us) {
+    std::map<std::string, double>& times_us) {
   using namespace bsoncxx::builder::stream;
+  if (fDBname == "") return; // offline
   std::string run_id = GetString("run_identifier", "latest");
   auto search_doc = document{} << "run" << run_id << finalize;
   auto update_doc = document{};
   update_doc << "$set" << open_document << "run" << run_id << close_document;
   update_doc << "$push" << open_document;
   update_doc << "host" << fHostname;
-  update_doc << "bytes" << byte_counter["bytes"];
-  update_doc << "fragments" << byte_counter["fragments"];
-  update_doc << "events" << byte_counter["events"];
-  update_doc << "data_packets" << byte_counter["data_packets"];
-  update_doc << "processing_time_us" << proc_time_us;
-  update_doc << "compression_time_us" << comp_time_us;
+  for (auto& p : counters)
+    update_doc << p.first << p.second;
+  for (auto& p : times_us)
+    update_doc << p.first << p.second;
   update_doc << "buffer_xfers" << open_document;
   for (auto& p : buffer_counter) {
     update_doc << std::to_string(p.first) << p.second;
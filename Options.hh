@@ -3,6 +3,10 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <unordered_map>
 #include <fstream>
 #include <streambuf>
 #include <iostream>
@@ -58,6 +62,24 @@ struct HEVOptions{
 
 };
 
+struct OptionsSnapshot{
+  /*
+    Everything the readout and processing look up, parsed out of the bson
+    once whenever the document changes. Nested keys are flattened with '.'
+    and, as with the bson lookups, the first occurrence of a key wins.
+    Never modified after it's built, so any thread can read it.
+  */
+  std::unordered_map<std::string, int> ints;
+  std::unordered_map<std::string, long> longs;
+  std::unordered_map<std::string, double> doubles;
+  std::unordered_map<std::string, std::string> strings;
+  std::vector<BoardType> boards;
+  std::unordered_map<int, std::vector<int16_t>> channels;
+  // per board, including the board -1 ones. Key -1 has only those
+  std::unordered_map<int, std::vector<RegisterType>> registers;
+  std::unordered_map<int, std::vector<u_int16_t>> thresholds;
+};
+
 class MongoLog;
 
 class Options{
@@ -65,6 +87,10 @@ class Options{
 public:
   Options(MongoLog *log, std::string name, std::string hostname, std::string suri,
   	std::string dbname, std::string override_opts);
+  // Offline, from a json document (as from ExportToString). Keys in
+  // override_json take precedence. Nothing gets saved to the database
+  Options(MongoLog *log, std::string json, std::string hostname,
+      std::string override_json="");
   ~Options();
 
   int Load(std::string name, mongocxx::collection& opts_collection, std::string override_opts);
@@ -82,12 +108,19 @@ public:
   int GetCrateOpt(CrateOptions &ret);
   int GetHEVOpt(HEVOptions &ret);
   int16_t GetChannel(int bid, int cid);
+  std::vector<int16_t> GetChannels(int bid);
   int GetNestedInt(std::string path, int default_value);
+  std::string GetNestedString(std::string path, std::string default_value="");
   std::vector<u_int16_t> GetThresholds(int board);
 
   void UpdateDAC(std::map<int, std::map<std::string, std::vector<double>>>&);
-  void SaveBenchmarks(std::map<std::string, long>&, std::map<int, long>&, double, double);
+  void SaveBenchmarks(std::map<std::string, long>&, std::map<int, long>&,
+      std::map<std::string, double>&);
 private:
+  void BuildSnapshot();
+  void Flatten(bsoncxx::document::view doc, std::string prefix,
+      std::set<std::string>& seen, OptionsSnapshot *snap);
+
   mongocxx::client fClient;
   bsoncxx::document::view bson_options;
   bsoncxx::document::value *bson_value;
@@ -95,6 +128,9 @@ private:
   mongocxx::collection fDAC_collection;
   std::string fDBname;
   std::string fHostname;
+  // All the lookups that don't go to the database read from this. Swapped
+  // atomically when the document changes
+  std::shared_ptr<const OptionsSnapshot> fSnapshot;
 };
 
 #endif
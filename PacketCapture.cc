@@ -0,0 +1,113 @@
+#include "PacketCapture.hh"
+#include "StraxInserter.hh"
+#include <cstring>
+
+const char CaptureMagic[8] = {'R','D','X','C','A','P','0','1'};
+
+PacketCapture::PacketCapture(){
+  fBytes = fMaxBytes = 0;
+}
+
+PacketCapture::~PacketCapture(){
+  Close();
+}
+
+void PacketCapture::Close(){
+  if (fOut.is_open()) fOut.close();
+  if (fIn.is_open()) fIn.close();
+}
+
+void PacketCapture::WriteString(const std::string& s){
+  u_int32_t len = s.size();
+  fOut.write((const char*)&len, sizeof(len));
+  fOut.write(s.data(), len);
+}
+
+std::string PacketCapture::ReadString(){
+  u_int32_t len = 0;
+  fIn.read((char*)&len, sizeof(len));
+  std::string s(len, '\0');
+  fIn.read(&s[0], len);
+  return s;
+}
+
+int PacketCapture::OpenWrite(std::string path, std::map<int, std::map<std::string, int>>& formats,
+    long max_bytes){
+  fOut.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!fOut.is_open()) return -1;
+  fFormats = formats;
+  fMaxBytes = max_bytes;
+  fOut.write(CaptureMagic, sizeof(CaptureMagic));
+  u_int32_t n = formats.size();
+  fOut.write((const char*)&n, sizeof(n));
+  for (auto& board : formats) {
+    int32_t bid = board.first;
+    n = board.second.size();
+    fOut.write((const char*)&bid, sizeof(bid));
+    fOut.write((const char*)&n, sizeof(n));
+    for (auto& p : board.second) {
+      int32_t val = p.second;
+      WriteString(p.first);
+      fOut.write((const char*)&val, sizeof(val));
+    }
+  }
+  fBytes = fOut.tellp();
+  return fOut.good() ? 0 : -1;
+}
+
+int PacketCapture::OpenRead(std::string path){
+  fIn.open(path, std::ios::in | std::ios::binary);
+  if (!fIn.is_open()) return -1;
+  char magic[sizeof(CaptureMagic)];
+  fIn.read(magic, sizeof(magic));
+  if (!fIn.good() || std::memcmp(magic, CaptureMagic, sizeof(magic)) != 0) return -1;
+  u_int32_t n_boards = 0, n_keys = 0;
+  int32_t bid = 0, val = 0;
+  fIn.read((char*)&n_boards, sizeof(n_boards));
+  for (u_int32_t b = 0; b < n_boards && fIn.good(); b++) {
+    fIn.read((char*)&bid, sizeof(bid));
+    fIn.read((char*)&n_keys, sizeof(n_keys));
+    for (u_int32_t k = 0; k < n_keys && fIn.good(); k++) {
+      std::string key = ReadString();
+      fIn.read((char*)&val, sizeof(val));
+      fFormats[bid][key] = val;
+    }
+  }
+  fBytes = 0;
+  return fIn.good() ? 0 : -1;
+}
+
+int PacketCapture::Write(data_packet *dp){
+  if (!fOut.is_open() || fBytes >= fMaxBytes) return -1;
+  int32_t head[4] = {dp->bid, (int32_t)dp->header_time, (int32_t)dp->clock_counter, dp->size};
+  u_int32_t n_blt = dp->vBLT.size();
+  fOut.write((const char*)head, sizeof(head));
+  fOut.write((const char*)&n_blt, sizeof(n_blt));
+  fOut.write((const char*)dp->vBLT.data(), n_blt*sizeof(u_int32_t));
+  fOut.write((const char*)dp->buff, dp->size);
+  fBytes += sizeof(head) + sizeof(n_blt) + n_blt*sizeof(u_int32_t) + dp->size;
+  return fOut.good() ? 0 : -1;
+}
+
+data_packet* PacketCapture::Read(){
+  int32_t head[4];
+  u_int32_t n_blt = 0;
+  if (!fIn.read((char*)head, sizeof(head))) return nullptr;
+  fIn.read((char*)&n_blt, sizeof(n_blt));
+  if (!fIn.good() || head[3] < 0) return nullptr;
+  data_packet *dp = new data_packet;
+  dp->bid = head[0];
+  dp->header_time = head[1];
+  dp->clock_counter = head[2];
+  dp->size = head[3];
+  dp->vBLT.resize(n_blt);
+  fIn.read((char*)dp->vBLT.data(), n_blt*sizeof(u_int32_t));
+  dp->buff = new u_int32_t[(dp->size+3)/4];
+  fIn.read((char*)dp->buff, dp->size);
+  if (!fIn.good()) {
+    delete dp;
+    return nullptr;
+  }
+  fBytes += dp->size;
+  return dp;
+}
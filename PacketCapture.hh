@@ -0,0 +1,47 @@
+#ifndef _PACKETCAPTURE_HH_
+#define _PACKETCAPTURE_HH_
+
+#include <string>
+#include <map>
+#include <fstream>
+#include <sys/types.h>
+
+struct data_packet;
+
+class PacketCapture{
+  /*
+    Raw readouts, exactly as they came off the boards, dumped to a file so
+    they can be replayed through the processing threads later (see bench.cc).
+    The file starts with the data format of every board, then each packet is
+    its bid, header_time, clock_counter, BLT sizes, and the data itself.
+  */
+
+public:
+  PacketCapture();
+  ~PacketCapture();
+
+  // Stops writing (and returns -1 from Write) once max_bytes are in the file
+  int OpenWrite(std::string path, std::map<int, std::map<std::string, int>>& formats,
+      long max_bytes);
+  int OpenRead(std::string path);
+  void Close();
+
+  // 0 on success
+  int Write(data_packet *dp);
+  // A new packet that owns its data, or nullptr at the end of the file
+  data_packet* Read();
+
+  std::map<int, std::map<std::string, int>>& Formats() {return fFormats;}
+  long Bytes() {return fBytes;}
+
+private:
+  void WriteString(const std::string& s);
+  std::string ReadString();
+
+  std::ofstream fOut;
+  std::ifstream fIn;
+  std::map<int, std::map<std::string, int>> fFormats;
+  long fBytes, fMaxBytes;
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include "RecordSort.hh"
+#include "StraxInserter.hh"
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <queue>
+#include <map>
+
+static inline int64_t RecordTime(const std::string& buffer, std::size_t record, int record_bytes){
+  int64_t time;
+  std::memcpy(&time, buffer.data() + record*record_bytes + offsetof(StraxHeader, time),
+      sizeof(time));
+  return time;
+}
+
+static inline int16_t RecordChannel(const std::string& buffer, std::size_t record,
+    int record_bytes){
+  int16_t channel;
+  std::memcpy(&channel, buffer.data() + record*record_bytes + offsetof(StraxHeader, channel),
+      sizeof(channel));
+  return channel;
+}
+
+// Merges runs of record numbers, each in time order, and rearranges the
+// buffer to match
+static void Merge(std::string& buffer, std::vector<std::vector<std::size_t>>& runs,
+    int record_bytes){
+  // (time, run), smallest first
+  typedef std::pair<int64_t, std::size_t> Head;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+  std::vector<std::size_t> next(runs.size(), 0);
+  for (std::size_t r = 0; r < runs.size(); r++)
+    if (runs[r].size() > 0) heads.emplace(RecordTime(buffer, runs[r][0], record_bytes), r);
+  std::string *sorted = new std::string();
+  sorted->reserve(buffer.size());
+  while (!heads.empty()) {
+    std::size_t r = heads.top().second;
+    heads.pop();
+    std::size_t record = runs[r][next[r]++];
+    sorted->append(buffer, record*record_bytes, record_bytes);
+    if (next[r] < runs[r].size())
+      heads.emplace(RecordTime(buffer, runs[r][next[r]], record_bytes), r);
+  }
+  buffer.swap(*sorted);
+  delete sorted;
+}
+
+void SortRecords(std::string& buffer, int record_bytes){
+  if (record_bytes <= 0) return;
+  std::size_t n = buffer.size()/record_bytes;
+  // already in order costs one pass, and happens a lot with few channels
+  std::size_t i = 1;
+  while (i < n && RecordTime(buffer, i-1, record_bytes) <= RecordTime(buffer, i, record_bytes))
+    i++;
+  if (i >= n) return;
+
+  std::map<int16_t, std::vector<std::size_t>> by_channel;
+  for (i = 0; i < n; i++) by_channel[RecordChannel(buffer, i, record_bytes)].push_back(i);
+  std::vector<std::vector<std::size_t>> runs;
+  runs.reserve(by_channel.size());
+  for (auto& p : by_channel) {
+    std::vector<std::size_t>& run = p.second;
+    auto earlier = [&](std::size_t a, std::size_t b){
+      return RecordTime(buffer, a, record_bytes) < RecordTime(buffer, b, record_bytes);};
+    if (!std::is_sorted(run.begin(), run.end(), earlier))
+      std::stable_sort(run.begin(), run.end(), earlier);
+    runs.push_back(std::move(run));
+  }
+  Merge(buffer, runs, record_bytes);
+}
+
+void MergeRecords(std::string& buffer, const std::vector<std::size_t>& runs, int record_bytes){
+  if (record_bytes <= 0 || runs.size() < 2) return;
+  std::size_t n = buffer.size()/record_bytes;
+  std::vector<std::vector<std::size_t>> records(runs.size());
+  for (std::size_t r = 0; r < runs.size(); r++) {
+    std::size_t end = r+1 < runs.size() ? runs[r+1]/record_bytes : n;
+    for (std::size_t i = runs[r]/record_bytes; i < end; i++) records[r].push_back(i);
+  }
+  Merge(buffer, records, record_bytes);
+}
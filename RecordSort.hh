@@ -0,0 +1,20 @@
+#ifndef _RECORDSORT_HH_
+#define _RECORDSORT_HH_
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+// Puts the strax records in buffer in time order. The records of any one
+// channel are expected to be in order already (they come out of the packets
+// that way), so they're picked apart by channel and merged back together,
+// which is a lot cheaper than sorting the lot. A channel that turns out not
+// to be in order is sorted by itself first. Records with the same time keep
+// the order of their channels. record_bytes is header plus payload
+void SortRecords(std::string& buffer, int record_bytes);
+
+// The same for a buffer made of runs that are each in time order, starting
+// at these byte offsets
+void MergeRecords(std::string& buffer, const std::vector<std::size_t>& runs, int record_bytes);
+
+#endif
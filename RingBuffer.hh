@@ -0,0 +1,91 @@
+#ifndef _RINGBUFFER_HH_
+#define _RINGBUFFER_HH_
+
+#include <atomic>
+#include <cstddef>
+
+template<typename T>
+class RingBuffer{
+  /*
+    Bounded lock-free multi-producer/multi-consumer queue. Each cell carries
+    a sequence number that tells producers and consumers whose turn it is, so
+    the only shared writes are one CAS per push or pop (D. Vyukov's design).
+    Capacity is rounded up to a power of two.
+  */
+
+public:
+  RingBuffer(std::size_t capacity){
+    std::size_t size = 2;
+    while (size < capacity) size <<= 1;
+    fMask = size-1;
+    fCells = new Cell[size];
+    for (std::size_t i = 0; i < size; i++)
+      fCells[i].sequence.store(i, std::memory_order_relaxed);
+    fEnqueuePos.store(0, std::memory_order_relaxed);
+    fDequeuePos.store(0, std::memory_order_relaxed);
+  }
+  ~RingBuffer(){
+    delete[] fCells;
+  }
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  // Returns false if the queue is full
+  bool Push(const T& item){
+    Cell *cell;
+    std::size_t pos = fEnqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &fCells[pos & fMask];
+      std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+      std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+      if (diff == 0) {
+        if (fEnqueuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = fEnqueuePos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->data = item;
+    cell->sequence.store(pos+1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false if the queue is empty
+  bool Pop(T& item){
+    Cell *cell;
+    std::size_t pos = fDequeuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &fCells[pos & fMask];
+      std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+      std::ptrdiff_t diff = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos+1);
+      if (diff == 0) {
+        if (fDequeuePos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = fDequeuePos.load(std::memory_order_relaxed);
+      }
+    }
+    item = cell->data;
+    cell->sequence.store(pos+fMask+1, std::memory_order_release);
+    return true;
+  }
+
+  std::size_t Capacity() {return fMask+1;}
+
+private:
+  struct alignas(64) Cell{
+    std::atomic<std::size_t> sequence;
+    T data;
+  };
+
+  Cell *fCells;
+  std::size_t fMask;
+  alignas(64) std::atomic<std::size_t> fEnqueuePos;
+  alignas(64) std::atomic<std::size_t> fDequeuePos;
+};
+
+#endif
@@ -1,15 +1,24 @@
 #include "StraxInserter.hh"
-#include <lz4frame.h>
-#include "DAQController.hh"
+#include "DataSource.hh"
 #include "MongoLog.hh"
 #include "Options.hh"
-#include <blosc.h>
+#include "BufferPool.hh"
+#include "StraxWriter.hh"
+#include "ChunkAggregator.hh"
+#include "RecordSort.hh"
+#include "V1724.hh"
+#include "V1724_MV.hh"
+#include "V1730.hh"
+#include "HeaderScan.hh"
+#include "Metrics.hh"
+#include "MemoryGovernor.hh"
 #include <thread>
 #include <cstring>
 #include <cstdarg>
 #include <numeric>
 #include <sstream>
 #include <list>
+#include <algorithm>
 
 namespace fs=std::experimental::filesystem;
 
@@ -17,6 +26,7 @@ StraxInserter::StraxInserter(){
   fOptions = NULL;
   fDataSource = NULL;
   fActive = true;
+  fRunning = fForceQuit = false;
   fChunkLength=0x7fffffff; // DAQ magic number
   fChunkNameLength=6;
   fChunkOverlap = 0x2FAF080;
@@ -29,74 +39,160 @@ StraxInserter::StraxInserter(){
   fThreadId = std::this_thread::get_id();
   fBytesProcessed = 0;
   fFragmentSize = 0;
+  fReportedSize = 0;
+  fChannelCounters = fBoardCounters = nullptr;
+  fNChannels = fNBoards = 0;
+  fStreamBlockBytes = 0;
+  fSortRecords = false;
+  fIndexFiles = false;
+  fAggregator = nullptr;
+  fMember = -1;
   fForceQuit = false;
+  fStopTimeout = 10000;
   fFullChunkLength = fChunkLength+fChunkOverlap;
   fFragmentsProcessed = 0;
   fEventsProcessed = 0;
+  fChunkReserve = fOverlapReserve = 0;
 }
 
 StraxInserter::~StraxInserter(){
-  fActive = false;
-  int counter_short = 0, counter_long = 0;
-  fLog->Entry(MongoLog::Local, "Thread %lx waiting to stop, has %i events left",
-      fThreadId, fBufferLength.load());
-  int events_start = fBufferLength.load();
-  do{
-    events_start = fBufferLength.load();
-    while (fRunning && counter_short++ < 500)
-      std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    if (counter_short >= 500)
-      fLog->Entry(MongoLog::Message, "Thread %lx taking a while to stop, still has %i evts",
-          fThreadId, fBufferLength.load());
-    counter_short = 0;
-  } while (fRunning && fBufferLength.load() > 0 && events_start > fBufferLength.load() && counter_long++ < 10);
   if (fRunning) {
-    fLog->Entry(MongoLog::Warning, "Force-quitting thread %lx: %i events lost",
+    // Nobody waited for us to stop, so at least don't take forever about it
+    fActive = false;
+    fLog->Entry(MongoLog::Local, "Thread %lx waiting to stop, has %i events left",
         fThreadId, fBufferLength.load());
-    fForceQuit = true;
-    std::this_thread::sleep_for(std::chrono::seconds(2));
-  }
-  while (fRunning) {
-    fLog->Entry(MongoLog::Message, "Still waiting for thread %lx to stop", fThreadId);
-    std::this_thread::sleep_for(std::chrono::seconds(2));
+    if (!WaitForStop(std::chrono::steady_clock::now() +
+          std::chrono::milliseconds(fStopTimeout))) {
+      fLog->Entry(MongoLog::Warning, "Force-quitting thread %lx", fThreadId);
+      fForceQuit = true;
+    }
+    while (!WaitForStop(std::chrono::steady_clock::now() + std::chrono::seconds(2)))
+      fLog->Entry(MongoLog::Message, "Still waiting for thread %lx to stop", fThreadId);
   }
+  // the writer still calls back into us until our last file is out
+  WaitForWrites();
   long total_dps = std::accumulate(fBufferCounter.begin(), fBufferCounter.end(), 0,
       [&](long tot, auto& p){return tot + p.second;});
+  long unknown_dps = 0;
+  for (auto& p : fUnknownBoards) {
+    fLog->Entry(MongoLog::Warning, "Thread %lx dropped %li packets from unknown board %i",
+        fThreadId, p.second, p.first);
+    unknown_dps += p.second;
+  }
   std::map<std::string, long> counters {
     {"bytes", fBytesProcessed},
     {"fragments", fFragmentsProcessed},
     {"events", fEventsProcessed},
-    {"data_packets", total_dps}};
-  fOptions->SaveBenchmarks(counters, fBufferCounter,
-      fProcTime.count(), fCompTime.count());
+    {"data_packets", total_dps},
+    {"unknown_board_packets", unknown_dps}};
+  std::map<std::string, double> times {
+    {"processing_time_us", double(fProcTime.count())},
+    {"submit_time_us", double(fSubmitTime.count())}};
+  fOptions->SaveBenchmarks(counters, fBufferCounter, times);
+  if (fChannelCounters != nullptr) delete[] fChannelCounters;
+  if (fBoardCounters != nullptr) delete[] fBoardCounters;
 }
 
-int StraxInserter::Initialize(Options *options, MongoLog *log, DAQController *dataSource,
-			      std::string hostname){
+template<typename Format>
+static bool MatchesFormat(const DataFormat& f){
+  return f.channel_mask_msb_idx == Format::channel_mask_msb_idx &&
+    f.channel_header_words == Format::channel_header_words &&
+    f.channel_time_msb_idx == Format::channel_time_msb_idx &&
+    f.ns_per_sample == Format::ns_per_sample &&
+    f.ns_per_clk == Format::ns_per_clk;
+}
+
+int StraxInserter::Initialize(Options *options, MongoLog *log, DataSource *dataSource,
+			      StraxWriter *writer, std::string hostname){
   fOptions = options;
   fChunkLength = long(fOptions->GetDouble("strax_chunk_length", 5)*1e9); // default 5s
   fChunkOverlap = long(fOptions->GetDouble("strax_chunk_overlap", 0.5)*1e9); // default 0.5s
   fFragmentBytes = fOptions->GetInt("strax_fragment_payload_bytes", 110*2);
+  fStopTimeout = std::max(0, fOptions->GetInt("stop_timeout_ms", 10000));
   fCompressor = fOptions->GetString("compressor", "lz4");
+  fStreamBlockBytes = 0;
+  if (fOptions->GetString("strax_compression_mode", "chunk") == "stream") {
+    // blosc has no frame format that can be built up a block at a time
+    if (fCompressor == "blosc")
+      log->Entry(MongoLog::Warning, "Streaming compression needs lz4, compressing whole chunks");
+    else
+      fStreamBlockBytes = fOptions->GetInt("strax_stream_block_bytes", 0x40000);
+  }
+  fSortRecords = fOptions->GetInt("strax_sort", 1) != 0;
+  fIndexFiles = fOptions->GetInt("strax_index", 0) != 0;
+  if (fIndexFiles && fCompressor == "blosc") {
+    log->Entry(MongoLog::Warning, "Chunk indices need lz4, not writing any");
+    fIndexFiles = false;
+  }
+  fZLEThreshold = std::max(0, std::min(0x3FFF, fOptions->GetInt("zle_threshold", 0)));
+  // with DAC calibration, that's where the baselines are
+  fZLEBaseline = fOptions->GetInt("zle_baseline", fOptions->GetInt("baseline_value", 16000));
+  fZLEPreSamples = std::max(0, fOptions->GetInt("zle_pre_samples", 50));
+  fZLEPostSamples = std::max(0, fOptions->GetInt("zle_post_samples", 50));
+  fZLEPrescale = std::max(0, fOptions->GetInt("zle_prescale", 0));
+  fZLEPulses = 0;
   fFullChunkLength = fChunkLength+fChunkOverlap;
+  fChunkSlots.assign(std::max(4, fOptions->GetInt("strax_chunk_slots", 16)),
+      ChunkSlot{-1, nullptr, nullptr, nullptr});
   fHostname = hostname;
   std::string run_name = fOptions->GetString("run_identifier", "run");
 
   fMissingVerified = 0;
   fDataSource = dataSource;
-  dataSource->GetDataFormat(fFmt);
+  fWriter = writer;
+  fPendingWrites = 0;
+  fSubmitted.clear();
+  fChunkWrites.clear();
+  fUnknownBoards.clear();
+  std::map<int, std::map<std::string, int>> fmt;
+  dataSource->GetDataFormat(fmt);
+  int max_bid = fmt.size() > 0 ? fmt.rbegin()->first : -1;
+  fFormats.assign(max_bid+1, DataFormat{false, Decoder::Generic, -1, 0, -1, 0, 0});
+  std::array<int16_t, 16> unmapped;
+  unmapped.fill(-1);
+  fChannelMap.assign(max_bid+1, unmapped);
+  for (auto& p : fmt) {
+    DataFormat& f = fFormats[p.first];
+    f = DataFormat{true, Decoder::Generic, p.second["channel_mask_msb_idx"],
+      p.second["channel_header_words"], p.second["channel_time_msb_idx"],
+      p.second["ns_per_sample"], p.second["ns_per_clk"]};
+    if (MatchesFormat<V1724::Format>(f)) f.decoder = Decoder::V1724;
+    else if (MatchesFormat<V1724_MV::Format>(f)) f.decoder = Decoder::V1724_MV;
+    else if (MatchesFormat<V1730::Format>(f)) f.decoder = Decoder::V1730;
+    else fLog->Entry(MongoLog::Local, "Board %i has a nonstandard data format, using generic decoder",
+        p.first);
+    std::vector<int16_t> channels = fOptions->GetChannels(p.first);
+    for (unsigned ch = 0; ch < channels.size() && ch < unmapped.size(); ch++)
+      fChannelMap[p.first][ch] = channels[ch];
+  }
+  fNChannels = 0;
+  for (auto& board : fChannelMap)
+    for (int16_t ch : board) fNChannels = std::max(fNChannels, ch+1);
+  fNBoards = max_bid+1;
+  if (fChannelCounters != nullptr) delete[] fChannelCounters;
+  if (fBoardCounters != nullptr) delete[] fBoardCounters;
+  fChannelCounters = new ChannelCounters[std::max(fNChannels, 1)];
+  fBoardCounters = new ChannelCounters[std::max(fNBoards, 1)];
+  for (int i = 0; i < std::max(fNChannels, 1); i++) {
+    ChannelCounters& c = fChannelCounters[i];
+    c.bytes = c.fragments = c.zle_kept = c.zle_dropped = 0;
+  }
+  for (int i = 0; i < std::max(fNBoards, 1); i++) {
+    ChannelCounters& c = fBoardCounters[i];
+    c.bytes = c.fragments = c.zle_kept = c.zle_dropped = 0;
+  }
   fLog = log;
   fErrorBit = false;
 
   fProcTime = std::chrono::microseconds(0);
-  fCompTime = std::chrono::microseconds(0);
+  fSubmitTime = std::chrono::microseconds(0);
 
   std::string output_path = fOptions->GetString("strax_output_path", "./");
   try{    
     fs::path op(output_path);
     op /= run_name;
     fOutputPath = op;
-    fs::create_directory(op);
+    if (!fWriter->EnsureDirectory(op)) throw std::runtime_error("mkdir");
   }
   catch(...){
     fLog->Entry(MongoLog::Error, "StraxInserter::Initialize tried to create output directory but failed. Check that you have permission to write here.");
@@ -104,6 +200,16 @@ int StraxInserter::Initialize(Options *options, MongoLog *log, DAQController *da
   }
   //fLog->Entry(MongoLog::Local, "Strax output initialized with %li ns chunks and %li ns overlap time",
   //  fChunkLength, fChunkOverlap);
+  fAggregator = fWriter->Aggregator();
+  if (fAggregator != nullptr) {
+    // the merged file is only put together once everyone's done with the chunk
+    if (fStreamBlockBytes != 0)
+      fLog->Entry(MongoLog::Local, "Merging chunks per host, compressing whole chunks");
+    fStreamBlockBytes = 0;
+    fMember = fAggregator->Join();
+  }
+  if (fIndexFiles && fStreamBlockBytes > 0)
+    fLog->Entry(MongoLog::Warning, "Streamed chunks don't get indices");
 
   return 0;
 }
@@ -114,60 +220,152 @@ void StraxInserter::Close(std::map<int,int>& ret){
   for (auto& iter : fFailCounter) ret[iter.first] += iter.second;
 }
 
-void StraxInserter::GetDataPerChan(std::map<int, int>& ret) {
-  if (!fActive) return;
-  fDPC_mutex.lock();
-  for (auto& pair : fDataPerChan) {
-    ret[pair.first] += pair.second;
-    pair.second = 0;
+bool StraxInserter::WaitForStop(std::chrono::steady_clock::time_point deadline){
+  std::unique_lock<std::mutex> lk(fStopMutex);
+  return fStopCV.wait_until(lk, deadline, [&]{return !fRunning.load();});
+}
+
+bool StraxInserter::WaitForStart(std::chrono::steady_clock::time_point deadline){
+  std::unique_lock<std::mutex> lk(fStopMutex);
+  return fStopCV.wait_until(lk, deadline, [&]{return fRunning.load();});
+}
+
+void StraxInserter::GetChannelStats(std::map<int, ChannelStats>& channels,
+    std::map<int, long>& board_bytes) {
+  if (!fActive || fChannelCounters == nullptr) return;
+  for (int ch = 0; ch < fNChannels; ch++) {
+    ChannelCounters& c = fChannelCounters[ch];
+    long bytes = c.bytes.exchange(0, std::memory_order_relaxed);
+    long fragments = c.fragments.exchange(0, std::memory_order_relaxed);
+    long kept = c.zle_kept.exchange(0, std::memory_order_relaxed);
+    long dropped = c.zle_dropped.exchange(0, std::memory_order_relaxed);
+    if (bytes == 0 && fragments == 0 && kept == 0 && dropped == 0) continue;
+    ChannelStats& stats = channels[ch];
+    stats.bytes += bytes;
+    stats.fragments += fragments;
+    stats.zle_kept += kept;
+    stats.zle_dropped += dropped;
+  }
+  for (int bid = 0; bid < fNBoards; bid++) {
+    long bytes = fBoardCounters[bid].bytes.exchange(0, std::memory_order_relaxed);
+    if (bytes > 0) board_bytes[bid] += bytes;
   }
-  fDPC_mutex.unlock();
-  return;
 }
 
 void StraxInserter::GenerateArtificialDeadtime(int64_t timestamp, int16_t bid) {
-  std::string fragment;
-  fragment.append((char*)&timestamp, sizeof(timestamp));
-  int32_t length = fFragmentBytes>>1;
-  fragment.append((char*)&length, sizeof(length));
-  int16_t sw = 10;
-  fragment.append((char*)&sw, sizeof(sw));
-  int16_t channel = 790; // TODO add MV and NV support
-  fragment.append((char*)&channel, sizeof(channel));
-  fragment.append((char*)&length, sizeof(length));
-  int16_t fragment_i = 0;
-  fragment.append((char*)&fragment_i, sizeof(fragment_i));
-  int16_t baseline = 0;
-  fragment.append((char*)&baseline, sizeof(baseline));
-  fragment.append((char*)&bid, sizeof(bid));
-  int8_t zero = 0;
-  while ((int)fragment.size() < fFragmentBytes+fStraxHeaderSize)
-    fragment.append((char*)&zero, sizeof(zero));
-  AddFragmentToBuffer(fragment, timestamp);
+  StraxHeader header;
+  header.time = timestamp;
+  header.length = header.pulse_length = fFragmentBytes>>1;
+  header.sample_width = 10;
+  header.channel = 790; // TODO add MV and NV support
+  header.fragment_i = 0;
+  header.baseline = 0;
+  // the payload is just the board id
+  AddFragmentToBuffer(header, (const char*)&bid, sizeof(bid));
 }
 
 void StraxInserter::ParseDocuments(data_packet* dp){
 
   using namespace std::chrono;
-  system_clock::time_point proc_start, proc_end;
+  steady_clock::time_point proc_start, proc_end;
+
+  if (dp->bid < 0 || dp->bid >= (int)fFormats.size() || !fFormats[dp->bid].valid) {
+    // once per board, the count goes out when the run's over
+    if (fUnknownBoards[dp->bid]++ == 0)
+      fLog->Entry(MongoLog::Error, "Thread %lx got data from unknown board %i", fThreadId, dp->bid);
+    delete dp;
+    return;
+  }
+  const DataFormat& fmt = fFormats[dp->bid];
+  if (MemoryGovernor::Level() == MemoryGovernor::Drop) {
+    // Out of memory. The data's gone, but at least make sure it's noticed.
+    // The time is only as good as the packet header
+    GenerateArtificialDeadtime(int64_t(fmt.ns_per_clk)*((int64_t(dp->clock_counter)<<31) +
+          dp->header_time), dp->bid);
+    MemoryGovernor::Count(MemoryGovernor::Drop, dp->size);
+    delete dp;
+    ReportMemory();
+    return;
+  }
+  int smallest_latest_index_seen = -1;
+
+  proc_start = steady_clock::now();
+  Metrics::Record(Metrics::Dequeue, dp->read_time, dp->size, dp->bid);
+  switch (fmt.decoder) {
+    case Decoder::V1724:
+      smallest_latest_index_seen = DecodePacket(dp, V1724::Format());
+      break;
+    case Decoder::V1724_MV:
+      smallest_latest_index_seen = DecodePacket(dp, V1724_MV::Format());
+      break;
+    case Decoder::V1730:
+      smallest_latest_index_seen = DecodePacket(dp, V1730::Format());
+      break;
+    default:
+      smallest_latest_index_seen = DecodePacket(dp, fmt);
+      break;
+  }
+  Bump(fBoardCounters[dp->bid].bytes, dp->size);
+  proc_end = steady_clock::now();
+  Metrics::Record(Metrics::Decode, duration_cast<nanoseconds>(proc_end-proc_start).count(),
+      dp->size, dp->bid);
+  if(smallest_latest_index_seen != -1) {
+    WriteOutFiles(smallest_latest_index_seen);
+    if (MemoryGovernor::Level() >= MemoryGovernor::Flush)
+      FlushOldest(smallest_latest_index_seen);
+  }
+
+  fBytesProcessed += dp->size;
+  fProcTime += duration_cast<microseconds>(proc_end - proc_start);
+  delete dp;
+  ReportMemory();
+}
+
+void StraxInserter::FlushOldest(int current_chunk){
+  // Write out the oldest chunk we still have open, as long as it's older than
+  // what we're filling now
+  ChunkSlot *oldest = nullptr;
+  for (auto& slot : fChunkSlots)
+    if (slot.chunk_id != -1 && slot.chunk_id < current_chunk &&
+        (oldest == nullptr || slot.chunk_id < oldest->chunk_id))
+      oldest = &slot;
+  if (oldest == nullptr) return;
+  long bytes = 0;
+  for (auto chunk : {oldest->main, oldest->pre, oldest->post})
+    if (chunk != nullptr) bytes += chunk->Size();
+  MemoryGovernor::Count(MemoryGovernor::Flush, bytes);
+  WriteOutChunk(*oldest);
+}
+
+void StraxInserter::ReportMemory(){
+  // Once per packet rather than per fragment, it's a shared counter
+  long size = fFragmentSize.load();
+  MemoryGovernor::Add(MemoryGovernor::Chunks, size - fReportedSize);
+  fReportedSize = size;
+}
+
+template<typename Format>
+int StraxInserter::DecodePacket(data_packet* dp, const Format& fmt){
+  // Format is either one of the digitizers' compile-time format traits, in
+  // which case everything that depends on it folds away, or a DataFormat for
+  // boards that don't match any of them.
 
   // Take a buffer and break it up into one document per channel
-  unsigned int max_channels = 16; // hardcoded to accomodate V1730
+  const unsigned int max_channels = 16; // hardcoded to accomodate V1730
 
   // Unpack the things from the data packet
-  std::vector<u_int32_t> clock_counters(max_channels, dp->clock_counter);
-  std::vector<u_int32_t> last_times_seen(max_channels, 0xFFFFFFFF);
+  std::array<u_int32_t, max_channels> clock_counters, last_times_seen;
+  clock_counters.fill(dp->clock_counter);
+  last_times_seen.fill(0xFFFFFFFF);
 
   u_int32_t size = dp->size;
   u_int32_t *buff = dp->buff;
   int smallest_latest_index_seen = -1;
+  const int16_t *channel_map = fChannelMap[dp->bid].data();
   const int event_header_words = 4;
 
   u_int32_t idx = 0;
-  std::map<std::string, int> fmt = fFmt[dp->bid];
-  std::map<int, int> data_per_chan;
   unsigned total_words = size/sizeof(u_int32_t);
-  proc_start = system_clock::now();
   while(idx < total_words && buff[idx] != 0xFFFFFFFF){
     
     if(buff[idx]>>28 == 0xA){ // 0xA indicates header at those bits
@@ -181,7 +379,7 @@ void StraxInserter::ParseDocuments(data_packet* dp){
             dp->bid, idx, buff[idx]&0xFFFFFFF, total_words-idx, dp->vBLT.size());
       }
 
-      if (fmt["channel_mask_msb_idx"] != -1) {
+      if (fmt.channel_mask_msb_idx != -1) {
 	channel_mask = ( ((buff[idx+2]>>24)&0xFF)<<8 ) | (buff[idx+1]&0xFF);
       }
       
@@ -214,32 +412,32 @@ void StraxInserter::ParseDocuments(data_packet* dp){
         bool whoops = false;
 
 	// Presence of a channel header indicates non-default firmware (DPP-DAW) so override
-	if(fmt["channel_header_words"] > 0){
+	if(fmt.channel_header_words > 0){
 	  channel_words = std::min(buff[idx]&0x7FFFFF, words_in_event - (idx - event_start_idx));
           if (channel_words < (buff[idx]&0x7FFFFF)) {
             fLog->Entry(MongoLog::Local, "Board %i ch %i garbled header at idx %i: %x/%x",
                   dp->bid, channel, idx, buff[idx]&0x7FFFFF, words_in_event);
-            idx += fmt["channel_header_words"];
+            idx += fmt.channel_header_words;
             break;
           }
-          if (channel_words <= fmt["channel_header_words"]) {
+          if (channel_words <= fmt.channel_header_words) {
             fLog->Entry(MongoLog::Local, "Board %i ch %i empty (%i/%i)",
-                dp->bid, channel, channel_words, fmt["channel_header_words"]);
-            idx += (fmt["channel_header_words"]-channel_words);
+                dp->bid, channel, channel_words, fmt.channel_header_words);
+            idx += (fmt.channel_header_words-channel_words);
             continue;
           }
-          channel_words -= fmt["channel_header_words"];
+          channel_words -= fmt.channel_header_words;
 	  channel_time = buff[idx+1]&0xFFFFFFFF;
 
-	  if (fmt["channel_time_msb_idx"] == 2) {
+	  if (fmt.channel_time_msb_idx == 2) {
 	    channel_timeMSB = buff[idx+2]&0xFFFF;
 	    baseline_ch = (buff[idx+2]>>16)&0x3FFF;
 	  }
 	  
-	  idx += fmt["channel_header_words"];
+	  idx += fmt.channel_header_words;
 
 	  // V1724 only. 1730 has a **26-day** clock counter. 
-	  if(fmt["channel_header_words"] <= 2){    
+	  if(fmt.channel_header_words <= 2){    
 	    // OK. Here's the logic for the clock reset, and I realize this is the
 	    // second place in the code where such weird logic is needed but that's it
 	    // First, on the first instance of a channel we gotta check if
@@ -265,14 +463,14 @@ void StraxInserter::ParseDocuments(data_packet* dp){
 	  }
 	} // channel_header_words > 0
 
-        // let's sanity-check the data first to make sure we didn't get CAENed
-        for (unsigned w = 0; w < channel_words; w++) {
-          if ((idx+w >= total_words) || (buff[idx+w]>>28) == 0xA) {
-            fLog->Entry(MongoLog::Local, "Board %i has CAEN'd itself at idx %x",
-                dp->bid, idx+w);
-            whoops = true;
-            break;
-          }
+        // let's sanity-check the data first to make sure we didn't get CAENed.
+        // This is its own pass rather than part of the copy below because by the
+        // time the copy found something, earlier fragments would already be out
+        u_int32_t bad_word = FindHeader(buff, idx, std::min(idx+channel_words, total_words));
+        if (bad_word < idx+channel_words) {
+          fLog->Entry(MongoLog::Local, "Board %i has CAEN'd itself at idx %x",
+              dp->bid, bad_word);
+          whoops = true;
         }
         if (idx - event_start_idx >= words_in_event) {
           fLog->Entry(MongoLog::Local, "Board %i CAEN'd itself at idx %x",
@@ -285,10 +483,10 @@ void StraxInserter::ParseDocuments(data_packet* dp){
 	int iBitShift = 31;
 	int64_t Time64;
 
-	 if (fmt["channel_time_msb_idx"] == 2) { 
-	   Time64 = fmt["ns_per_clk"]*( ( (unsigned long)channel_timeMSB<<(int)32) + channel_time); 
+	 if (fmt.channel_time_msb_idx == 2) { 
+	   Time64 = fmt.ns_per_clk*( ( (unsigned long)channel_timeMSB<<(int)32) + channel_time); 
 	 } else {
-	   Time64 = fmt["ns_per_clk"]*(((unsigned long)clock_counters[channel] <<
+	   Time64 = fmt.ns_per_clk*(((unsigned long)clock_counters[channel] <<
 					      iBitShift) + channel_time); // in ns
 	}
 
@@ -303,72 +501,81 @@ void StraxInserter::ParseDocuments(data_packet* dp){
 	// as FragmentLength
 	u_int16_t *payload = reinterpret_cast<u_int16_t*>(buff);
 	u_int32_t samples_in_pulse = channel_words<<1;
-	u_int32_t index_in_pulse = 0;
 	u_int32_t offset = idx<<1;
-	u_int16_t fragment_index = 0;
-	u_int16_t sw = fmt["ns_per_sample"];
+	u_int16_t sw = fmt.ns_per_sample;
         int fragment_samples = fFragmentBytes>>1;
-	int16_t cl = fOptions->GetChannel(dp->bid, channel);
-        data_per_chan[cl] += samples_in_pulse<<1;
+	int16_t cl = channel_map[channel];
 	// Failing to discern which channel we're getting data from seems serious enough to throw
 	if(cl==-1)
 	  throw std::runtime_error("Failed to parse channel map. I'm gonna just kms now.");
-          
-	
-	while(index_in_pulse < samples_in_pulse){
-	  std::string fragment;
-	  
-	  // How long is this fragment?
-	  u_int32_t max_sample = index_in_pulse + fragment_samples;
-	  u_int32_t samples_this_fragment = fragment_samples;
-	  if((unsigned int)(fragment_samples + (fragment_index*fragment_samples)) >
-	     samples_in_pulse){
-	    max_sample = index_in_pulse + (samples_in_pulse -
-					    (fragment_index*fragment_samples));
-	    samples_this_fragment = max_sample-index_in_pulse;
+	ChannelCounters& counters = fChannelCounters[cl];
+	Bump(counters.bytes, samples_in_pulse<<1);
+
+	// Only the time, length, and fragment index change between fragments
+	StraxHeader header;
+	header.sample_width = sw;
+	header.channel = cl;
+	header.baseline = baseline_ch;
+
+	// Cuts samples [first, first+length) of the waveform into fragments
+	auto emit_pulse = [&](u_int32_t first, u_int32_t length){
+	  u_int32_t index_in_pulse = 0;
+	  u_int16_t fragment_index = 0;
+	  header.pulse_length = length;
+	  while(index_in_pulse < length){
+
+	    // How long is this fragment?
+	    u_int32_t samples_this_fragment = std::min<u_int32_t>(fragment_samples,
+		length - index_in_pulse);
+	    fFragmentsProcessed++;
+
+	    u_int64_t time_this_fragment = Time64 + sw*(first + index_in_pulse);
+	    header.time = time_this_fragment;
+	    header.length = samples_this_fragment;
+	    header.fragment_i = fragment_index;
+
+	    // The raw buffer gets copied straight into the chunk
+	    const char *data_loc = reinterpret_cast<const char*>(
+		&(payload[offset+first+index_in_pulse]));
+	    int chunk_id = AddFragmentToBuffer(header, data_loc, samples_this_fragment*2);
+
+	    // Check if this is the smallest_latest_index_seen
+	    if(smallest_latest_index_seen == -1 || chunk_id < smallest_latest_index_seen)
+	      smallest_latest_index_seen = chunk_id;
+
+	    fragment_index++;
+	    index_in_pulse += samples_this_fragment;
+	    if (fForceQuit == true) break;
 	  }
-          fFragmentsProcessed++;
-
-	  u_int64_t time_this_fragment = Time64 + fragment_samples*sw*fragment_index;
-	  char *pulseTime = reinterpret_cast<char*> (&time_this_fragment);
-	  fragment.append(pulseTime, 8);
-
-	  char *fragmentlength = reinterpret_cast<char*> (&samples_this_fragment);
-	  fragment.append(fragmentlength, 4);
-
-	  char *sampleWidth = reinterpret_cast<char*> (&sw);
-	  fragment.append(sampleWidth, 2);
-
-	  char *channelLoc = reinterpret_cast<char*> (&cl);
-	  fragment.append(channelLoc, 2);
-
-	  char *samplesinpulse = reinterpret_cast<char*> (&samples_in_pulse);
-	  fragment.append(samplesinpulse, 4);
-
-	  char *fragmentindex = reinterpret_cast<char*> (&fragment_index);
-	  fragment.append(fragmentindex, 2);
-
-          char* bl = reinterpret_cast<char*>(&baseline_ch);
-          fragment.append(bl, 2);
-
-	  // Copy the raw buffer
-	  const char *data_loc = reinterpret_cast<const char*>(&(payload[offset+index_in_pulse]));
-	  fragment.append(data_loc, samples_this_fragment*2);
-          uint8_t zero_filler = 0;
-          char *zero = reinterpret_cast<char*> (&zero_filler);
-	  while((int)fragment.size()<fFragmentBytes+fStraxHeaderSize)
-	    fragment.append(zero, 1); // int(0) != int("0")
-
-          int chunk_id = AddFragmentToBuffer(fragment, time_this_fragment);
-
-	  // Check if this is the smallest_latest_index_seen
-	  if(smallest_latest_index_seen == -1 || chunk_id < smallest_latest_index_seen)
-	    smallest_latest_index_seen = chunk_id;
-	
-	  fragment_index++;
-	  index_in_pulse = max_sample;
-          if (fForceQuit == true) break;
-	} // while in pulse
+	  Bump(counters.fragments, fragment_index);
+	};
+
+	if (fZLEThreshold == 0 || (fZLEPrescale > 0 && fZLEPulses++ % fZLEPrescale == 0)) {
+	  emit_pulse(0, samples_in_pulse);
+	  if (fZLEThreshold != 0) Bump(counters.zle_kept, samples_in_pulse);
+	} else {
+	  // Only what's around excursions from the baseline, each stretch as its
+	  // own pulse. Excursions closer together than pre+post samples merge
+	  const u_int16_t *samples = payload + offset;
+	  u_int16_t baseline = baseline_ch != 0 ? baseline_ch : fZLEBaseline;
+	  u_int32_t kept = 0, done = 0, hit;
+	  while ((hit = FindExcursion(samples, done, samples_in_pulse, baseline,
+		  fZLEThreshold)) < samples_in_pulse) {
+	    u_int32_t first = std::max(done, hit > fZLEPreSamples ? hit - fZLEPreSamples : 0);
+	    u_int32_t last = hit, window, next;
+	    do {
+	      window = std::min(samples_in_pulse, last + 1 + fZLEPreSamples + fZLEPostSamples);
+	      next = FindExcursion(samples, last+1, window, baseline, fZLEThreshold);
+	      if (next < window) last = next;
+	    } while (next < window);
+	    done = std::min(samples_in_pulse, last + 1 + fZLEPostSamples);
+	    emit_pulse(first, done - first);
+	    kept += done - first;
+	    if (fForceQuit == true) break;
+	  }
+	  Bump(counters.zle_kept, kept);
+	  Bump(counters.zle_dropped, samples_in_pulse - kept);
+	}
 	idx+=channel_words;
         if (fForceQuit == true) break;
       } // channel loop
@@ -377,61 +584,111 @@ void StraxInserter::ParseDocuments(data_packet* dp){
     else
       idx++;
   }
-  fDPC_mutex.lock();
-  for (auto& p : data_per_chan) fDataPerChan[p.first] += p.second;
-  fDPC_mutex.unlock();
-  proc_end = system_clock::now();
-  if(smallest_latest_index_seen != -1)
-    WriteOutFiles(smallest_latest_index_seen);
-
-  fBytesProcessed += dp->size;
-  fProcTime += duration_cast<microseconds>(proc_end - proc_start);
-  delete dp;
+  return smallest_latest_index_seen;
 }
 
-int StraxInserter::AddFragmentToBuffer(std::string& fragment, int64_t timestamp) {
+int StraxInserter::AddFragmentToBuffer(const StraxHeader& header, const char* payload,
+    int payload_bytes) {
   // Get the CHUNK and decide if this event also goes into a PRE/POST file
+  int64_t timestamp = header.time;
   int chunk_id = timestamp/fFullChunkLength;
   bool nextpre = (chunk_id+1)* fFullChunkLength - timestamp < fChunkOverlap;
-  // Minor mess to maintain the same width of file names and do the pre/post stuff
-  // If not in pre/post
-  std::string chunk_index = std::to_string(chunk_id);
-  while(chunk_index.size() < fChunkNameLength)
-    chunk_index.insert(0, "0");
-
-  fFragmentSize += fragment.size();
 
+  ChunkSlot& slot = GetChunkSlot(chunk_id);
   if(!nextpre){
-    if(fFragments.count(chunk_index) == 0){
-      fFragments[chunk_index] = new std::string();
-    }
-    fFragments[chunk_index]->append(fragment);
+    if(slot.main == nullptr)
+      slot.main = NewChunkBuffer(chunk_id, "");
+    WriteRecord(slot.main, header, payload, payload_bytes);
   } else {
-    std::string nextchunk_index = std::to_string(chunk_id+1);
-    while(nextchunk_index.size() < fChunkNameLength)
-      nextchunk_index.insert(0, "0");
-
-    if(fFragments.count(nextchunk_index+"_pre") == 0){
-      fFragments[nextchunk_index+"_pre"] = new std::string();
+    if(slot.post == nullptr)
+      slot.post = NewChunkBuffer(chunk_id, "_post");
+    WriteRecord(slot.post, header, payload, payload_bytes);
+
+    ChunkSlot& next = GetChunkSlot(chunk_id+1);
+    if(next.pre == nullptr)
+      next.pre = NewChunkBuffer(chunk_id+1, "_pre");
+    if (slot.post->Streaming()) {
+      // the record may be on its way to the writer already
+      WriteRecord(next.pre, header, payload, payload_bytes);
+    } else {
+      // the record is identical in both, so copy the one we just wrote
+      int record_bytes = fStraxHeaderSize + fFragmentBytes;
+      fFragmentSize += record_bytes;
+      next.pre->Append(slot.post->Tail(record_bytes), record_bytes);
     }
-    fFragments[nextchunk_index+"_pre"]->append(fragment);
+  }
+  return chunk_id;
+}
 
-    if(fFragments.count(chunk_index+"_post") == 0){
-      fFragments[chunk_index+"_post"] = new std::string();
+ChunkSlot& StraxInserter::GetChunkSlot(int chunk_id) {
+  // % of a negative id is negative, and an int against the size is unsigned
+  int n = fChunkSlots.size();
+  ChunkSlot& slot = fChunkSlots[((chunk_id % n) + n) % n];
+  if (slot.chunk_id != chunk_id) {
+    if (slot.chunk_id != -1) {
+      // Data way out of order, or a lot of chunks open at once. Either way this
+      // slot's previous owner has to go to disk now
+      fLog->Entry(slot.chunk_id > chunk_id ? MongoLog::Warning : MongoLog::Local,
+          "Thread %lx writing out chunk %i early to make room for %i",
+          fThreadId, slot.chunk_id, chunk_id);
+      // the new owner moves in first, so it counts as open, not missing
+      ChunkSlot evicted = slot;
+      slot = ChunkSlot{chunk_id, nullptr, nullptr, nullptr};
+      WriteOutChunk(evicted);
     }
-    fFragments[chunk_index+"_post"]->append(fragment);
+    slot.chunk_id = chunk_id;
   }
-  return chunk_id;
+  return slot;
+}
+
+void StraxInserter::WriteRecord(ChunkBuffer* buffer, const StraxHeader& header,
+    const char* payload, int payload_bytes) {
+  // Header, payload, and zero padding go straight onto the end of the chunk,
+  // which has (usually) already reserved enough space for them. In streaming
+  // mode some of it may get compressed away immediately
+  fFragmentSize += fStraxHeaderSize + fFragmentBytes;
+  long flushed = buffer->Append(reinterpret_cast<const char*>(&header), sizeof(header));
+  flushed += buffer->Append(payload, payload_bytes);
+  flushed += buffer->AppendZeros(fFragmentBytes - payload_bytes);
+  fFragmentSize -= flushed;
 }
 
+ChunkBuffer* StraxInserter::NewChunkBuffer(int chunk_id, std::string suffix) {
+  if (fStreamBlockBytes == 0)
+    return new ChunkBuffer(suffix == "" ? fChunkReserve : fOverlapReserve);
+  std::string chunk_index = GetStringFormat(chunk_id) + suffix;
+  int part = fChunkWrites.count(chunk_id) ? fChunkWrites[chunk_id] : 0;
+  WriteJob *paths = new WriteJob;
+  paths->buffer = nullptr;
+  paths->writer = fWriter;
+  paths->temp_dir = GetDirectoryPath(chunk_index, true);
+  paths->temp_path = GetFilePath(chunk_index, true, part);
+  paths->final_dir = GetDirectoryPath(chunk_index, false);
+  paths->final_path = GetFilePath(chunk_index, false, part);
+  // it's only on disk once it's finished, but nothing else may go there
+  fSubmitted.insert(chunk_index);
+  return new ChunkBuffer(paths, fStreamBlockBytes);
+}
 
 int StraxInserter::ReadAndInsertData(){
   fThreadId = std::this_thread::get_id();
-  fActive = fRunning = true;
+  // fActive isn't touched, a Close() that came before we got here still counts
+  {
+    const std::lock_guard<std::mutex> lg(fStopMutex);
+    fRunning = true;
+  }
+  fStopCV.notify_all();
   fBufferLength = 0;
+  long discarded = 0;
   std::chrono::microseconds sleep_time(10);
-  if (fOptions->GetString("buffer_type", "dual") == "dual") {
-    while(fActive == true){
+  std::chrono::microseconds wait_time(fOptions->GetInt("buffer_ring_wait_us", 1000));
+  std::string buffer_type = fOptions->GetString("buffer_type", "dual");
+  // After Close() we keep going until the queue is empty, readout is stopped
+  // by then so it stays that way
+  if (buffer_type == "dual" || buffer_type == "ring") {
+    // the ring lets us sleep until there's data rather than poll for it
+    bool blocking = buffer_type == "ring";
+    while (!fForceQuit) {
       std::list<data_packet*> b;
       if (fDataSource->GetData(&b)) {
         fBufferLength = b.size();
@@ -442,117 +699,71 @@ int StraxInserter::ReadAndInsertData(){
           dp_ = nullptr;
           if (fForceQuit) break;
         }
-        if (fForceQuit) for (auto& dp_ : b) if (dp_ != nullptr) delete dp_;
+        if (fForceQuit) for (auto& dp_ : b) if (dp_ != nullptr) {delete dp_; discarded++;}
         b.clear();
+      } else if (!fActive) {
+        break;
+      } else if (blocking) {
+        fDataSource->WaitForData(wait_time);
       } else {
         std::this_thread::sleep_for(sleep_time);
       }
     }
   } else {
     data_packet* dp;
-    while (fActive == true) {
+    while (!fForceQuit) {
       if (fDataSource->GetData(dp)) {
         fBufferLength = 1;
         fBufferCounter[1]++;
         ParseDocuments(dp);
         fBufferLength = 0;
+      } else if (!fActive) {
+        break;
       } else {
         std::this_thread::sleep_for(sleep_time);
       }
     }
   }
+  fDrainedAt = std::chrono::steady_clock::now();
+  if (discarded > 0)
+    fLog->Entry(MongoLog::Warning, "Thread %lx quit with %li packets unprocessed",
+        fThreadId, discarded);
   if (fBytesProcessed > 0)
     WriteOutFiles(1000000, true);
-  fRunning = false;
+  if (fAggregator != nullptr)
+    fAggregator->Leave(fMember,
+        fBytesProcessed > 0 ? fs::path(fOutputPath) / "THE_END" : fs::path());
+  ReportMemory();
+  {
+    const std::lock_guard<std::mutex> lg(fStopMutex);
+    fStoppedAt = std::chrono::steady_clock::now();
+    fRunning = false;
+  }
+  fStopCV.notify_all();
   return 0;
 }
 
-// Can tune here as needed, these are defaults from the LZ4 examples
-static const LZ4F_preferences_t kPrefs = {
-  { LZ4F_max256KB, LZ4F_blockLinked, LZ4F_noContentChecksum, LZ4F_frame, 0, { 0, 0 } },
-    0,   /* compression level; 0 == default */
-    0,   /* autoflush */
-    { 0, 0, 0 },  /* reserved, must be set to 0 */
-};
-
 void StraxInserter::WriteOutFiles(int smallest_index_seen, bool end){
-  // Write the contents of fFragments to blosc-compressed files
-  using namespace std::chrono;
-  system_clock::time_point comp_start, comp_end;
-  std::vector<std::string> idx_to_clear;
-  for (auto& iter : fFragments) {
-    if (iter.first == "")
-        break; // not sure why, but this sometimes happens during bad shutdowns
-    std::string chunk_index = iter.first;
-    std::string idnr = chunk_index.substr(0, fChunkNameLength);
-    int idnrint = std::stoi(idnr);
-    if(!(idnrint < smallest_index_seen-1 || end))
-      continue;
-
-    comp_start = system_clock::now();
-    if(!fs::exists(GetDirectoryPath(chunk_index, true)))
-      fs::create_directory(GetDirectoryPath(chunk_index, true));
-
-    size_t uncompressed_size = iter.second->size();
-
-    // Compress it
-    char *out_buffer = NULL;
-    int wsize = 0;
-    if(fCompressor == "blosc"){
-      out_buffer = new char[uncompressed_size+BLOSC_MAX_OVERHEAD];
-      wsize = blosc_compress_ctx(5, 1, sizeof(char), uncompressed_size,  iter.second->data(),
-				   out_buffer, uncompressed_size+BLOSC_MAX_OVERHEAD, "lz4", 0, 2);
-    }
-    else{
-      // Note: the current package repo version for Ubuntu 18.04 (Oct 2019) is 1.7.1, which is
-      // so old it is not tracked on the lz4 github. The API for frame compression has changed
-      // just slightly in the meantime. So if you update and it breaks you'll have to tune at least
-      // the LZ4F_preferences_t object to the new format.
-      size_t max_compressed_size = LZ4F_compressFrameBound(uncompressed_size, &kPrefs);
-      out_buffer = new char[max_compressed_size];
-      wsize = LZ4F_compressFrame(out_buffer, max_compressed_size,
-				 iter.second->data(), uncompressed_size, &kPrefs);
-    }
-    delete iter.second;
-    iter.second = nullptr;
-    fFragmentSize -= uncompressed_size;
-    idx_to_clear.push_back(chunk_index);
-
-    std::ofstream writefile(GetFilePath(chunk_index, true), std::ios::binary);
-    writefile.write(out_buffer, wsize);
-    delete[] out_buffer;
-    writefile.close();
-
-    // Move this chunk from *_TEMP to the same path without TEMP
-    if(!fs::exists(GetDirectoryPath(chunk_index, false)))
-      fs::create_directory(GetDirectoryPath(chunk_index, false));
-    fs::rename(GetFilePath(chunk_index, true),
-	       GetFilePath(chunk_index, false));
-    comp_end = system_clock::now();
-    fCompTime += duration_cast<microseconds>(comp_end-comp_start);
-    
-    CreateMissing(idnrint);
-  } // End for through fragments
-  // clear now because c++ sometimes overruns its buffers
-  for (auto s : idx_to_clear) {
-    if (fFragments.count(s) != 0) fFragments.erase(s);
+  // Write out every chunk we're done with, oldest first
+  std::vector<int> to_write;
+  for (auto& slot : fChunkSlots) {
+    if (slot.chunk_id != -1 && (slot.chunk_id < smallest_index_seen-1 || end))
+      to_write.push_back(slot.chunk_id);
   }
+  std::sort(to_write.begin(), to_write.end());
+  for (int id : to_write)
+    WriteOutChunk(GetChunkSlot(id));
 
   if(end){
-    for (auto& p : fFragments)
-        if (p.second != nullptr) delete p.second;
-    fFragments.clear();
+    // THE_END means everything is on disk, so the writer has to catch up first
+    WaitForWrites();
     fFragmentSize = 0;
+    // with merged chunks there's one for the whole host, once they're written
+    if (fAggregator != nullptr) return;
     fs::path write_path(fOutputPath);
     std::string filename = fHostname;
     write_path /= "THE_END";
-    if(!fs::exists(write_path)){
-      fLog->Entry(MongoLog::Local,"Creating END directory at %s",write_path.c_str());
-      try{
-        fs::create_directory(write_path);
-      }
-      catch(...){};
-    }
+    fWriter->EnsureDirectory(write_path);
     std::stringstream ss;
     ss<<std::this_thread::get_id();
     write_path /= fHostname + "_" + ss.str();
@@ -564,6 +775,92 @@ void StraxInserter::WriteOutFiles(int smallest_index_seen, bool end){
 
 }
 
+void StraxInserter::WriteOutChunk(ChunkSlot& slot){
+  // The chunk name only gets formatted here (or when a streamed file is opened)
+  auto start = std::chrono::steady_clock::now();
+  long bytes = 0;
+  for (auto chunk : {slot.main, slot.pre, slot.post}) if (chunk != nullptr) bytes += chunk->Size();
+  std::string chunk_index = GetStringFormat(slot.chunk_id);
+  int part = fChunkWrites[slot.chunk_id]++;
+  if (slot.main != nullptr) {
+    fChunkReserve = slot.main->Size();
+    WriteOutFile(slot.main, chunk_index, part);
+  }
+  if (slot.post != nullptr) {
+    fOverlapReserve = slot.post->Size();
+    WriteOutFile(slot.post, chunk_index + "_post", part);
+  }
+  if (slot.pre != nullptr) {
+    WriteOutFile(slot.pre, chunk_index + "_pre", part);
+  }
+  CreateMissing(slot.chunk_id);
+  slot = ChunkSlot{-1, nullptr, nullptr, nullptr};
+  Metrics::Record(Metrics::ChunkClose, start, bytes);
+}
+
+void StraxInserter::WriteOutFile(ChunkBuffer* chunk, std::string chunk_index, int part){
+  // Hand one buffer to the writer threads to compress and move into place.
+  // Paths are worked out here since the filename has this thread's id in it.
+  // Takes ownership of the buffer
+  using namespace std::chrono;
+  system_clock::time_point submit_start, submit_end;
+
+  auto done = [this]{
+    const std::lock_guard<std::mutex> lg(fPendingMutex);
+    if (--fPendingWrites == 0) fPendingCV.notify_all();
+  };
+  submit_start = system_clock::now();
+  if (chunk->Streaming()) {
+    // the writer has most of it already, this hands over the rest
+    {
+      const std::lock_guard<std::mutex> lg(fPendingMutex);
+      fPendingWrites++;
+    }
+    fFragmentSize -= chunk->Finish(done);
+    delete chunk;
+    fSubmitTime += duration_cast<microseconds>(system_clock::now()-submit_start);
+    return;
+  }
+  std::string *buffer = chunk->Release();
+  delete chunk;
+  // streamed chunks are already on their way out in whatever order they came
+  if (fSortRecords) SortRecords(*buffer, fStraxHeaderSize + fFragmentBytes);
+  long uncompressed_size = buffer->size();
+  WriteJob *job = new WriteJob;
+  job->compressor = fCompressor;
+  job->temp_dir = GetDirectoryPath(chunk_index, true);
+  job->final_dir = GetDirectoryPath(chunk_index, false);
+  if (fIndexFiles) {
+    job->index_record_bytes = fStraxHeaderSize + fFragmentBytes;
+    job->index_dir = fs::path(fOutputPath) / "index" / chunk_index;
+  }
+  fSubmitted.insert(chunk_index);
+  fFragmentSize -= uncompressed_size;
+  if (fAggregator != nullptr) {
+    // it names the file, and late data gets its own part there too
+    fAggregator->Add(fMember, chunk_index, job, buffer);
+    fSubmitTime += duration_cast<microseconds>(system_clock::now()-submit_start);
+    return;
+  }
+  job->buffer = buffer;
+  job->temp_path = GetFilePath(chunk_index, true, part);
+  job->final_path = GetFilePath(chunk_index, false, part);
+  job->done = done;
+  {
+    const std::lock_guard<std::mutex> lg(fPendingMutex);
+    fPendingWrites++;
+  }
+  // blocks if the writer is over its memory budget
+  fWriter->Submit(job);
+  submit_end = system_clock::now();
+  fSubmitTime += duration_cast<microseconds>(submit_end-submit_start);
+}
+
+void StraxInserter::WaitForWrites(){
+  std::unique_lock<std::mutex> lk(fPendingMutex);
+  fPendingCV.wait(lk, [&]{return fPendingWrites == 0;});
+}
+
 std::string StraxInserter::GetStringFormat(int id){
   std::string chunk_index = std::to_string(id);
   while(chunk_index.size() < fChunkNameLength)
@@ -579,60 +876,87 @@ fs::path StraxInserter::GetDirectoryPath(std::string id, bool temp){
   return write_path;
 }
 
-fs::path StraxInserter::GetFilePath(std::string id, bool temp){
+fs::path StraxInserter::GetFilePath(std::string id, bool temp, int part){
   fs::path write_path = GetDirectoryPath(id, temp);
   std::string filename = fHostname;
   std::stringstream ss;
   ss<<std::this_thread::get_id();
   filename += "_";
   filename += ss.str();
+  // a later piece of a chunk this thread already wrote goes next to it
+  if (part > 0) filename += "_" + std::to_string(part);
   write_path /= filename;
   return write_path;
 }
 
 void StraxInserter::CreateMissing(u_int32_t back_from_id){
-
+  // Every file this thread writes goes through fSubmitted, so anything that
+  // isn't in there doesn't exist and needs an empty placeholder. No need to
+  // ask the filesystem. The writer makes them all in one go, and never over
+  // a real file that showed up in the meantime.
+  // A chunk that's still open isn't missing, just not done yet, and neither
+  // is anything after it. Those get looked at again once it's written
+  for (auto& slot : fChunkSlots)
+    if (slot.chunk_id != -1 && slot.chunk_id >= fMissingVerified &&
+        (u_int32_t)slot.chunk_id < back_from_id)
+      back_from_id = slot.chunk_id;
+  std::vector<fs::path> placeholders;
   for(unsigned int x=fMissingVerified; x<back_from_id; x++){
     std::string chunk_index = GetStringFormat(x);
-    std::string chunk_index_pre = chunk_index+"_pre";
-    std::string chunk_index_post = chunk_index+"_post";
-    if(!fs::exists(GetFilePath(chunk_index, false))){
-      if(!fs::exists(GetDirectoryPath(chunk_index, false)))
-	fs::create_directory(GetDirectoryPath(chunk_index, false));
-      std::ofstream o;
-      o.open(GetFilePath(chunk_index, false));
-      o.close();
-    }
-    if(x!=0 && !fs::exists(GetFilePath(chunk_index_pre, false))){
-      if(!fs::exists(GetDirectoryPath(chunk_index_pre, false)))
-	fs::create_directory(GetDirectoryPath(chunk_index_pre, false));
-      std::ofstream o;
-      o.open(GetFilePath(chunk_index_pre, false));
-      o.close();
-    }
-    if(!fs::exists(GetFilePath(chunk_index_post, false))){
-      if(!fs::exists(GetDirectoryPath(chunk_index_post, false)))
-	fs::create_directory(GetDirectoryPath(chunk_index_post, false));
-      std::ofstream o;
-      o.open(GetFilePath(chunk_index_post, false));
-      o.close();
+    for (std::string name : {chunk_index, chunk_index+"_pre", chunk_index+"_post"}) {
+      if (x == 0 && name == chunk_index+"_pre") continue;
+      if (fSubmitted.erase(name) != 0) continue;
+      if (fAggregator != nullptr) {
+        // nothing from us, the host only gets a placeholder if nobody has anything
+        WriteJob *paths = new WriteJob;
+        paths->temp_dir = GetDirectoryPath(name, true);
+        paths->final_dir = GetDirectoryPath(name, false);
+        fAggregator->Add(fMember, name, paths, nullptr);
+      } else {
+        placeholders.push_back(GetFilePath(name, false));
+      }
     }
   }
-  fMissingVerified = back_from_id;
+  // chunks can be written out of order, but never go back over old ones
+  fMissingVerified = std::max<int>(fMissingVerified, back_from_id);
+  // and anything late for those is never looked up again
+  for (auto it = fSubmitted.begin(); it != fSubmitted.end(); ) {
+    if (std::stoi(*it) < fMissingVerified) it = fSubmitted.erase(it);
+    else it++;
+  }
+  if (placeholders.size() == 0) return;
+
+  WriteJob *job = new WriteJob;
+  job->buffer = nullptr;
+  job->placeholders = std::move(placeholders);
+  job->done = [this]{
+    const std::lock_guard<std::mutex> lg(fPendingMutex);
+    if (--fPendingWrites == 0) fPendingCV.notify_all();
+  };
+  {
+    const std::lock_guard<std::mutex> lg(fPendingMutex);
+    fPendingWrites++;
+  }
+  fWriter->Submit(job);
 }
 
 
 data_packet::data_packet() {
   buff = nullptr;
+  slab = nullptr;
   size = 0;
   clock_counter = 0;
   header_time = 0;
   bid = 0;
+  governed = false;
 }
 
 data_packet::~data_packet() {
-  if (buff != nullptr) delete[] buff;
+  if (governed) MemoryGovernor::Add(MemoryGovernor::Raw, -size);
+  if (slab != nullptr) slab->Release();
+  else if (buff != nullptr) delete[] buff;
   buff = nullptr;
+  slab = nullptr;
   size = clock_counter = header_time = bid = 0;
   //vBLT.clear();
 }
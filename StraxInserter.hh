@@ -13,26 +13,86 @@
 #include <numeric>
 #include <atomic>
 #include <vector>
+#include <array>
 #include <chrono>
 #include <thread>
+#include <set>
+#include <condition_variable>
 
-class DAQController;
+class DataSource;
 class Options;
 class MongoLog;
+class StraxWriter;
+class ChunkAggregator;
+class ChunkBuffer;
+struct BufferSlab;
 
 struct data_packet{
   public:
     data_packet();
     ~data_packet();
     u_int32_t *buff;
+    BufferSlab *slab; // what buff points into. Released rather than deleted
     int32_t size;
     u_int32_t clock_counter;
     u_int32_t header_time;
     int bid;
     std::vector<u_int32_t> vBLT;
+    std::chrono::steady_clock::time_point read_time;
+    bool governed; // counted by the MemoryGovernor until it's deleted
 };
 
 
+// The 24-byte header that starts every strax record, exactly as it's
+// written to disk. Followed by fFragmentBytes of (zero-padded) payload
+#pragma pack(push, 1)
+struct StraxHeader{
+  int64_t time;
+  int32_t length;
+  int16_t sample_width;
+  int16_t channel;
+  int32_t pulse_length;
+  int16_t fragment_i;
+  int16_t baseline;
+};
+#pragma pack(pop)
+static_assert(sizeof(StraxHeader) == 24, "strax record header must be 24 bytes");
+
+// What the processing saw of one channel or board since the status thread
+// last asked. The counters live on a cache line each, so the status thread
+// picking them up doesn't get in the way of the inserter adding to the next
+struct alignas(64) ChannelCounters{
+  std::atomic_long bytes, fragments;
+  std::atomic_long zle_kept, zle_dropped; // samples
+};
+struct ChannelStats{
+  long bytes = 0, fragments = 0, zle_kept = 0, zle_dropped = 0;
+};
+
+// Which specialization of the decoder a board's data goes through
+enum class Decoder {Generic, V1724, V1724_MV, V1730};
+
+// The parts of V1724::DataFormatDefinition the parser uses, copied out of
+// the map once so the decode loop doesn't do string lookups
+struct DataFormat{
+  bool valid; // false for boards we weren't told about
+  Decoder decoder;
+  int channel_mask_msb_idx;
+  int channel_header_words;
+  int channel_time_msb_idx;
+  int ns_per_sample;
+  int ns_per_clk;
+};
+
+// Everything buffered for one chunk: the chunk itself and the two overlap
+// regions around its start and end. Any of the buffers may be null
+struct ChunkSlot{
+  int chunk_id; // -1 if unused
+  ChunkBuffer *main;
+  ChunkBuffer *pre;
+  ChunkBuffer *post;
+};
+
 class StraxInserter{
   /*
     Reformats raw data into strax format
@@ -42,27 +102,54 @@ public:
   StraxInserter();
   ~StraxInserter();
   
-  int  Initialize(Options *options, MongoLog *log, 
-		  DAQController *dataSource, std::string hostname);
+  int  Initialize(Options *options, MongoLog *log, DataSource *dataSource,
+		  StraxWriter *writer, std::string hostname);
+  // Stops once everything already queued is processed, and then writes out
+  // whatever it has. Doesn't wait for that to happen
   void Close(std::map<int,int>& ret);
+  // false if the thread still isn't done when the deadline comes
+  bool WaitForStop(std::chrono::steady_clock::time_point deadline);
+  // false if ReadAndInsertData still hasn't started when the deadline comes
+  bool WaitForStart(std::chrono::steady_clock::time_point deadline);
+  // Throws away what's still queued, the chunks already built still go out
+  void ForceQuit() {fForceQuit = true;}
   
   int ReadAndInsertData();
   bool CheckError(){ bool ret = fErrorBit; fErrorBit = false; return ret;}
   long GetBufferSize() {return fFragmentSize.load();}
-  void GetDataPerChan(std::map<int, int>& ret);
+  // Adds what this thread saw since the last call, per strax channel and per
+  // board, and starts counting again
+  void GetChannelStats(std::map<int, ChannelStats>& channels, std::map<int, long>& board_bytes);
   void CheckError(int bid);
   int GetBufferLength() {return fBufferLength.load();}
+  bool Running() {return fRunning.load();}
+  long GetBytesProcessed() {return fBytesProcessed;}
+  long GetFragmentsProcessed() {return fFragmentsProcessed;}
+  // When this thread ran out of data after Close, and when its files were out
+  std::chrono::steady_clock::time_point DrainedAt() {return fDrainedAt;}
+  std::chrono::steady_clock::time_point StoppedAt() {return fStoppedAt;}
   
 private:
   void ParseDocuments(data_packet *dp);
+  template<typename Format>
+  int DecodePacket(data_packet *dp, const Format& fmt);
   void WriteOutFiles(int smallest_index_seen, bool end=false);
+  void WriteOutChunk(ChunkSlot& slot);
+  void WriteOutFile(ChunkBuffer* buffer, std::string name, int part);
+  ChunkSlot& GetChunkSlot(int chunk_id);
   void GenerateArtificialDeadtime(int64_t timestamp, int16_t bid);
-  int AddFragmentToBuffer(std::string& fragment, int64_t timestamp);
+  int AddFragmentToBuffer(const StraxHeader& header, const char* payload, int payload_bytes);
+  void WriteRecord(ChunkBuffer* buffer, const StraxHeader& header, const char* payload,
+      int payload_bytes);
+  ChunkBuffer* NewChunkBuffer(int chunk_id, std::string suffix);
+  void FlushOldest(int current_chunk);
+  void ReportMemory();
 
-  std::experimental::filesystem::path GetFilePath(std::string id, bool temp);
+  std::experimental::filesystem::path GetFilePath(std::string id, bool temp, int part=0);
   std::experimental::filesystem::path GetDirectoryPath(std::string id, bool temp);
   std::string GetStringFormat(int id);
   void CreateMissing(u_int32_t back_from_id);
+  void WaitForWrites();
   int fMissingVerified;
 
   int64_t fChunkLength; // ns
@@ -74,17 +161,58 @@ private:
   std::string fOutputPath, fHostname;
   Options *fOptions;
   MongoLog *fLog;
-  DAQController *fDataSource;
+  DataSource *fDataSource;
+  StraxWriter *fWriter;
+  // Null unless chunks are merged per host, then everything goes through it
+  ChunkAggregator *fAggregator;
+  int fMember;
+  // Files handed to the writer that might not be on disk yet, so
+  // CreateMissing doesn't put a placeholder in their way
+  std::set<std::string> fSubmitted;
+  // How often each chunk has been written out already. Data showing up for
+  // one after that goes into another file next to the first. Kept for the
+  // whole run, however late the data, so nothing ever goes over a file again
+  std::map<int, int> fChunkWrites;
+  // Packets from boards there's no format for, by board id
+  std::map<int, long> fUnknownBoards;
+  int fPendingWrites;
+  std::mutex fPendingMutex;
+  std::condition_variable fPendingCV;
   std::atomic_bool fActive, fRunning, fForceQuit;
+  std::mutex fStopMutex;
+  std::condition_variable fStopCV;
+  std::chrono::steady_clock::time_point fDrainedAt, fStoppedAt;
+  long fStopTimeout; // ms
   bool fErrorBit;
   std::string fCompressor;
-  std::map<std::string, std::string*> fFragments;
+  // Open chunks, indexed by chunk_id modulo the number of slots
+  std::vector<ChunkSlot> fChunkSlots;
   std::atomic_long fFragmentSize;
-  std::map<int, std::map<std::string, int>> fFmt;
+  long fReportedSize; // what the MemoryGovernor knows about
+  // How big the last flushed chunks were, so new ones can be reserved up front
+  std::size_t fChunkReserve, fOverlapReserve;
+  // Nonzero to compress chunks as they fill, this many bytes at a time
+  int fStreamBlockBytes;
+  // Put the records of each chunk in time order before they're written
+  bool fSortRecords;
+  // Write a sidecar index for every file that isn't streamed, see StraxReader
+  bool fIndexFiles;
+  // Zero suppression. Threshold 0 means off. With a prescale of N every Nth
+  // pulse is kept whole
+  u_int16_t fZLEThreshold, fZLEBaseline;
+  u_int32_t fZLEPreSamples, fZLEPostSamples;
+  long fZLEPrescale, fZLEPulses;
+  // Both indexed by board id
+  std::vector<DataFormat> fFormats;
+  std::vector<std::array<int16_t, 16>> fChannelMap; // -1 if not mapped
   std::map<int, int> fFailCounter;
   std::mutex fFC_mutex;
-  std::map<int, std::atomic_int> fDataPerChan;
-  std::mutex fDPC_mutex;
+  // Indexed by strax channel and board id, only this thread adds to them
+  ChannelCounters *fChannelCounters, *fBoardCounters;
+  int fNChannels, fNBoards;
+  static void Bump(std::atomic_long& counter, long by){
+    counter.fetch_add(by, std::memory_order_relaxed);
+  }
   std::map<int, long> fBufferCounter;
   std::atomic_int fBufferLength;
   long fBytesProcessed;
@@ -92,7 +220,7 @@ private:
   long fEventsProcessed;
 
   std::chrono::microseconds fProcTime;
-  std::chrono::microseconds fCompTime;
+  std::chrono::microseconds fSubmitTime; // handing chunks over, the writer compresses
   std::thread::id fThreadId;
 };
 
@@ -0,0 +1,216 @@
+#include "StraxReader.hh"
+#include "StraxInserter.hh"
+#include <lz4.h>
+#include <lz4frame.h>
+#include <vector>
+#include <limits>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+StraxReader::StraxReader(){
+  fData = fIndex = nullptr;
+  fDataBytes = fIndexBytes = 0;
+  fHeader = nullptr;
+  fBlocks = nullptr;
+  fEntries = nullptr;
+  fDecompressed = false;
+  fRecordBytes = 0;
+  fBlocksRead = 0;
+}
+
+StraxReader::~StraxReader(){
+  Close();
+}
+
+const char* StraxReader::Map(const std::string& path, std::size_t& bytes){
+  bytes = 0;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return nullptr;
+  struct stat st;
+  void *mem = MAP_FAILED;
+  if (fstat(fd, &st) == 0) {
+    bytes = st.st_size;
+    // can't map nothing, an empty placeholder just has no records
+    if (bytes > 0) mem = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mem == MAP_FAILED) return nullptr;
+  return static_cast<const char*>(mem);
+}
+
+int StraxReader::Open(const std::string& chunk_path, const std::string& index_path,
+    int record_bytes){
+  Close();
+  if (access(chunk_path.c_str(), R_OK) != 0) return -1;
+  fData = Map(chunk_path, fDataBytes);
+  if (fData == nullptr && fDataBytes > 0) return -1;
+  fRecordBytes = record_bytes > 0 ? record_bytes : sizeof(StraxHeader) + 220;
+  if (!index_path.empty()) {
+    fIndex = Map(index_path, fIndexBytes);
+    if (fIndex != nullptr && CheckIndex() != 0) {
+      // the chunk's fine, it just has to be read the slow way
+      munmap(const_cast<char*>(fIndex), fIndexBytes);
+      fIndex = nullptr;
+      fHeader = nullptr;
+    }
+  }
+  return 0;
+}
+
+int StraxReader::CheckIndex(){
+  if (fIndexBytes < sizeof(StraxIndexHeader)) return -1;
+  const StraxIndexHeader *header = reinterpret_cast<const StraxIndexHeader*>(fIndex);
+  if (std::memcmp(header->magic, "SIDX", 4) != 0 || header->version != kStraxIndexVersion)
+    return -1;
+  if (header->file_bytes != fDataBytes || header->record_bytes == 0 ||
+      header->record_bytes > kStraxIndexBlockBytes)
+    return -1;
+  std::size_t expected = sizeof(StraxIndexHeader) +
+    std::size_t(header->n_blocks)*sizeof(StraxIndexBlock) +
+    std::size_t(header->n_entries)*sizeof(StraxIndexEntry);
+  if (fIndexBytes != expected) return -1;
+  fHeader = header;
+  fBlocks = reinterpret_cast<const StraxIndexBlock*>(fIndex + sizeof(StraxIndexHeader));
+  fEntries = reinterpret_cast<const StraxIndexEntry*>(fBlocks + header->n_blocks);
+  fRecordBytes = header->record_bytes;
+  return 0;
+}
+
+void StraxReader::Close(){
+  if (fData != nullptr) munmap(const_cast<char*>(fData), fDataBytes);
+  if (fIndex != nullptr) munmap(const_cast<char*>(fIndex), fIndexBytes);
+  fData = fIndex = nullptr;
+  fDataBytes = fIndexBytes = 0;
+  fHeader = nullptr;
+  fBlocks = nullptr;
+  fEntries = nullptr;
+  fBlock.clear();
+  fWhole.clear();
+  fDecompressed = false;
+  fBlocksRead = 0;
+}
+
+int StraxReader::DecompressBlock(const StraxIndexBlock& block){
+  std::size_t bytes = std::size_t(block.n_records)*fRecordBytes;
+  if (bytes > kStraxIndexBlockBytes || block.offset + 4 > fDataBytes) return -1;
+  uint32_t block_header;
+  std::memcpy(&block_header, fData + block.offset, sizeof(block_header));
+  // the top bit says lz4 couldn't do better than storing it as it is
+  bool stored = block_header & 0x80000000u;
+  std::size_t size = block_header & 0x7FFFFFFFu;
+  if (block.offset + 4 + size > fDataBytes) return -1;
+  const char *src = fData + block.offset + 4;
+  fBlock.resize(bytes);
+  fBlocksRead++;
+  if (stored) {
+    if (size != bytes) return -1;
+    std::memcpy(&fBlock[0], src, bytes);
+    return 0;
+  }
+  int n = LZ4_decompress_safe(src, &fBlock[0], size, bytes);
+  return n == (int)bytes ? 0 : -1;
+}
+
+int StraxReader::DecompressAll(){
+  fDecompressed = true;
+  if (fDataBytes == 0) return 0;
+  LZ4F_decompressionContext_t ctx;
+  if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION))) return -1;
+  std::vector<char> out(4*kStraxIndexBlockBytes);
+  std::size_t pos = 0, ret = 1;
+  while (pos < fDataBytes && ret != 0) {
+    std::size_t src_bytes = fDataBytes - pos, dst_bytes = out.size();
+    ret = LZ4F_decompress(ctx, out.data(), &dst_bytes, fData + pos, &src_bytes, nullptr);
+    if (LZ4F_isError(ret)) {
+      LZ4F_freeDecompressionContext(ctx);
+      fWhole.clear();
+      return -1;
+    }
+    fWhole.append(out.data(), dst_bytes);
+    pos += src_bytes;
+  }
+  LZ4F_freeDecompressionContext(ctx);
+  fBlocksRead++;
+  return 0;
+}
+
+long StraxReader::Select(const char* records, std::size_t n, int channel, int64_t start,
+    int64_t end, std::string& out){
+  long found = 0;
+  StraxHeader header;
+  for (std::size_t i = 0; i < n; i++) {
+    const char *record = records + i*fRecordBytes;
+    std::memcpy(&header, record, sizeof(header));
+    if (channel >= 0 && header.channel != channel) continue;
+    int64_t record_end = header.time + int64_t(header.length)*header.sample_width;
+    if (header.time >= end || record_end <= start) continue;
+    out.append(record, fRecordBytes);
+    found++;
+  }
+  return found;
+}
+
+long StraxReader::Query(int channel, int64_t start, int64_t end, std::string& out){
+  if (fDataBytes == 0) return 0;
+  if (fHeader == nullptr) {
+    if (!fDecompressed && DecompressAll() != 0) return -1;
+    return Select(fWhole.data(), fWhole.size()/fRecordBytes, channel, start, end, out);
+  }
+  // The entries are by block, so each block that has anything is there once
+  long found = 0;
+  uint32_t last_block = std::numeric_limits<uint32_t>::max();
+  for (uint32_t e = 0; e < fHeader->n_entries; e++) {
+    const StraxIndexEntry& entry = fEntries[e];
+    if (entry.block == last_block || entry.block >= fHeader->n_blocks) continue;
+    if (channel >= 0 && entry.channel != channel) continue;
+    if (entry.start >= end || entry.end <= start) continue;
+    last_block = entry.block;
+    if (DecompressBlock(fBlocks[entry.block]) != 0) return -1;
+    found += Select(fBlock.data(), fBlocks[entry.block].n_records, channel, start, end, out);
+  }
+  return found;
+}
+
+void* strax_reader_open(const char* chunk_path, const char* index_path, int record_bytes){
+  StraxReader *reader = new StraxReader();
+  if (reader->Open(chunk_path, index_path != nullptr ? index_path : "", record_bytes) != 0) {
+    delete reader;
+    return nullptr;
+  }
+  return reader;
+}
+
+void strax_reader_close(void* reader){
+  delete static_cast<StraxReader*>(reader);
+}
+
+long strax_reader_query(void* reader, int channel, int64_t start, int64_t end, char** out){
+  *out = nullptr;
+  std::string records;
+  long n = static_cast<StraxReader*>(reader)->Query(channel, start, end, records);
+  if (n <= 0) return n;
+  *out = static_cast<char*>(std::malloc(records.size()));
+  if (*out == nullptr) return -1;
+  std::memcpy(*out, records.data(), records.size());
+  return n;
+}
+
+void strax_reader_free(char* buffer){
+  std::free(buffer);
+}
+
+int strax_reader_record_bytes(void* reader){
+  return static_cast<StraxReader*>(reader)->RecordBytes();
+}
+
+int strax_reader_indexed(void* reader){
+  return static_cast<StraxReader*>(reader)->Indexed() ? 1 : 0;
+}
+
+long strax_reader_blocks_read(void* reader){
+  return static_cast<StraxReader*>(reader)->BlocksRead();
+}
@@ -0,0 +1,110 @@
+#ifndef _STRAXREADER_HH_
+#define _STRAXREADER_HH_
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// With strax_index set, every lz4 chunk file gets a sidecar index in
+// <run>/index/<chunk>/<same name>. The chunk itself is still one ordinary lz4
+// frame, just with blocks that don't depend on each other and each holding a
+// whole number of records, so any one block can be decompressed by itself.
+// The index is this header, then one StraxIndexBlock per block in file order,
+// then one StraxIndexEntry per channel per block, by block and then channel.
+// Everything is little endian.
+#pragma pack(push, 1)
+struct StraxIndexHeader{
+  char magic[4]; // "SIDX"
+  uint32_t version;
+  uint32_t record_bytes; // header plus payload
+  uint32_t n_blocks;
+  uint32_t n_entries;
+  uint32_t reserved;
+  uint64_t file_bytes; // of the chunk file, so a stale index can be told apart
+};
+
+struct StraxIndexBlock{
+  uint64_t offset; // of the block header in the chunk file
+  uint64_t first_record;
+  uint32_t n_records;
+  uint32_t reserved;
+};
+
+struct StraxIndexEntry{
+  uint32_t block;
+  uint32_t n_records;
+  int16_t channel;
+  int16_t reserved[3];
+  int64_t start; // earliest record time
+  int64_t end; // latest record end, time plus length times sample width
+};
+#pragma pack(pop)
+static_assert(sizeof(StraxIndexHeader) == 32, "strax index header must be 32 bytes");
+static_assert(sizeof(StraxIndexBlock) == 24, "strax index block must be 24 bytes");
+static_assert(sizeof(StraxIndexEntry) == 32, "strax index entry must be 32 bytes");
+
+static const uint32_t kStraxIndexVersion = 1;
+// Uncompressed bytes per block at most, which is the frame's block size
+static const std::size_t kStraxIndexBlockBytes = 1<<18;
+
+class StraxReader{
+  /*
+    Reads the records of one chunk file for a channel and time range. The
+    file is mmapped and, if it has an index, only the blocks that have
+    something for the query are decompressed. Without one (or if it doesn't
+    match the file) the whole frame is decompressed once on the first query
+    and kept. Doesn't need anything else from redax, so it's also built as a
+    shared library for the python helpers, see the C functions below.
+  */
+
+public:
+  StraxReader();
+  ~StraxReader();
+
+  // index_path can be empty. record_bytes is only needed without an index.
+  // Returns 0 on success
+  int Open(const std::string& chunk_path, const std::string& index_path, int record_bytes);
+  void Close();
+
+  // Appends the records of channel (-1 for all of them) that overlap
+  // [start, end) in ns to out, in the order they're in the file. Returns how
+  // many, or -1 if the file couldn't be read
+  long Query(int channel, int64_t start, int64_t end, std::string& out);
+
+  int RecordBytes() {return fRecordBytes;}
+  bool Indexed() {return fHeader != nullptr;}
+  long BlocksRead() {return fBlocksRead;}
+
+private:
+  const char* Map(const std::string& path, std::size_t& bytes);
+  int CheckIndex();
+  int DecompressBlock(const StraxIndexBlock& block);
+  int DecompressAll();
+  long Select(const char* records, std::size_t n, int channel, int64_t start, int64_t end,
+      std::string& out);
+
+  const char *fData, *fIndex;
+  std::size_t fDataBytes, fIndexBytes;
+  const StraxIndexHeader *fHeader; // null unless there's a usable index
+  const StraxIndexBlock *fBlocks;
+  const StraxIndexEntry *fEntries;
+  std::string fBlock; // the block being looked at
+  std::string fWhole; // the whole file, without an index
+  bool fDecompressed;
+  int fRecordBytes;
+  long fBlocksRead;
+};
+
+// For ctypes and friends. Query hands back a buffer from malloc that the
+// caller frees with strax_reader_free, or null if nothing matched
+extern "C" {
+  void* strax_reader_open(const char* chunk_path, const char* index_path, int record_bytes);
+  void strax_reader_close(void* reader);
+  long strax_reader_query(void* reader, int channel, int64_t start, int64_t end, char** out);
+  void strax_reader_free(char* buffer);
+  int strax_reader_record_bytes(void* reader);
+  int strax_reader_indexed(void* reader);
+  long strax_reader_blocks_read(void* reader);
+}
+
+#endif
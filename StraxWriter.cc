@@ -0,0 +1,548 @@
+#include "StraxWriter.hh"
+#include "Options.hh"
+#include "MongoLog.hh"
+#include "UringWriter.hh"
+#include "ChunkAggregator.hh"
+#include "StraxInserter.hh"
+#include "Metrics.hh"
+#include "MemoryGovernor.hh"
+#include "StraxReader.hh"
+#include <lz4frame.h>
+#include <blosc.h>
+#include <fstream>
+#include <map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace fs=std::experimental::filesystem;
+
+// Can tune here as needed, these are defaults from the LZ4 examples
+static const LZ4F_preferences_t kPrefs = {
+  { LZ4F_max256KB, LZ4F_blockLinked, LZ4F_noContentChecksum, LZ4F_frame, 0, { 0, 0 } },
+    0,   /* compression level; 0 == default */
+    0,   /* autoflush */
+    { 0, 0, 0 },  /* reserved, must be set to 0 */
+};
+
+// For indexed files: the blocks don't depend on each other, and each one is
+// flushed as soon as it's handed over, so every update is exactly one block
+static LZ4F_preferences_t IndexPrefs(){
+  LZ4F_preferences_t prefs = kPrefs;
+  prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+  prefs.autoFlush = 1;
+  return prefs;
+}
+static const LZ4F_preferences_t kIndexPrefs = IndexPrefs();
+
+StraxWriter::StraxWriter(MongoLog *log){
+  fLog = log;
+  fOptions = nullptr;
+  fUring = nullptr;
+  fAggregator = nullptr;
+  fClosing = false;
+  fMaxQueuedBytes = 0;
+  fQueuedBytes = fBytesIn = fBytesOut = fFilesWritten = 0;
+  fCompTime = fWriteTime = fQueueTime = fStallTime = 0;
+}
+
+StraxWriter::~StraxWriter(){
+  Close();
+}
+
+int StraxWriter::Initialize(Options *options, std::string hostname){
+  fOptions = options;
+  int n_threads = fOptions->GetNestedInt("compression_threads."+hostname, 2);
+  fMaxQueuedBytes = long(fOptions->GetInt("compression_buffer_mb", 1024))<<20;
+  fClosing = false;
+  std::string backend = fOptions->GetString("strax_output_backend", "ofstream");
+  if (backend == "uring") {
+#ifdef HAVE_LIBURING
+    fUring = new UringWriter(fLog);
+    if (fUring->Initialize(fOptions->GetInt("strax_uring_depth", 32),
+          fOptions->GetInt("strax_output_direct", 1) != 0,
+          [this](WriteJob *job, bool ok, long us){FinishWrite(job, ok, us);})) {
+      delete fUring;
+      fUring = nullptr;
+      fLog->Entry(MongoLog::Warning, "Falling back to the ofstream output backend");
+    }
+#else
+    fLog->Entry(MongoLog::Warning, "Built without liburing, using the ofstream output backend");
+#endif
+  } else if (backend != "ofstream") {
+    fLog->Entry(MongoLog::Warning, "Unknown strax_output_backend %s, using ofstream",
+        backend.c_str());
+  }
+  if (fOptions->GetInt("strax_host_merge", 0) != 0) {
+    // an inserter never has chunks open further apart than its slots, so twice
+    // that behind is only waiting on a thread that's stuck
+    // the inserters sort their own parts, so those just need merging
+    int record_bytes = fOptions->GetInt("strax_sort", 1) != 0 ?
+      sizeof(StraxHeader) + fOptions->GetInt("strax_fragment_payload_bytes", 110*2) : 0;
+    fAggregator = new ChunkAggregator(this, fLog, hostname,
+        2*std::max(4, fOptions->GetInt("strax_chunk_slots", 16)), record_bytes);
+  }
+  for (int i = 0; i < n_threads; i++)
+    fThreads.push_back(new std::thread(&StraxWriter::Run, this, i));
+  fLog->Entry(MongoLog::Local, "Strax writer started with %i threads and %li MB budget",
+      n_threads, fMaxQueuedBytes>>20);
+  return 0;
+}
+
+void StraxWriter::Close(){
+  if (fAggregator != nullptr) {
+    // what it still holds has to go through us
+    fAggregator->Close();
+    delete fAggregator;
+    fAggregator = nullptr;
+  }
+  {
+    const std::lock_guard<std::mutex> lg(fQueueMutex);
+    if (fClosing) return;
+    fClosing = true;
+  }
+  fJobCV.notify_all();
+  // the workers empty the queue before they exit
+  for (auto t : fThreads) {
+    t->join();
+    delete t;
+  }
+  fThreads.clear();
+#ifdef HAVE_LIBURING
+  if (fUring != nullptr) {
+    fUring->Close(); // waits for what's still in flight
+    delete fUring;
+    fUring = nullptr;
+  }
+#endif
+  if (fOptions == nullptr || fFilesWritten == 0) return;
+  std::map<std::string, long> counters {
+    {"writer_bytes_in", fBytesIn.load()},
+    {"compressed_bytes", fBytesOut.load()},
+    {"files", fFilesWritten.load()}};
+  std::map<int, long> no_buffers;
+  std::map<std::string, double> times {
+    {"writer_compression_time_us", double(fCompTime.load())},
+    {"write_time_us", double(fWriteTime.load())},
+    {"queue_time_us", double(fQueueTime.load())},
+    {"stall_time_us", double(fStallTime.load())}};
+  fOptions->SaveBenchmarks(counters, no_buffers, times);
+}
+
+bool StraxWriter::EnsureDirectory(const fs::path& dir){
+  const std::lock_guard<std::mutex> lg(fDirMutex);
+  if (fDirectories.count(dir.string())) return true;
+  try{
+    // false if it was already there, which is fine too
+    fs::create_directory(dir);
+  }
+  catch(std::exception& e){
+    fLog->Entry(MongoLog::Error, "Couldn't create %s: %s", dir.c_str(), e.what());
+    return false;
+  }
+  fDirectories.insert(dir.string());
+  return true;
+}
+
+void StraxWriter::CreatePlaceholders(WriteJob *job){
+  for (auto& path : job->placeholders) {
+    if (!EnsureDirectory(path.parent_path())) continue;
+    // O_EXCL: real data that beat us here stays as it is
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0) close(fd);
+  }
+  if (job->done) job->done();
+  delete job;
+}
+
+void StraxWriter::Submit(WriteJob *job){
+  using namespace std::chrono;
+  long bytes = job->buffer != nullptr ? job->buffer->size() : 0;
+  if (fThreads.size() == 0) {
+    // no workers configured, do it on the caller's thread like in the old days
+    job->queued = system_clock::now();
+    fQueuedBytes += bytes;
+    if (job->buffer == nullptr) CreatePlaceholders(job);
+    else if (job->stream != nullptr) ProcessStream(job);
+    else Process(job);
+    fQueuedBytes -= bytes;
+    return;
+  }
+  std::unique_lock<std::mutex> lk(fQueueMutex);
+  // always let one job through so a single huge chunk can't deadlock us
+  if (fQueuedBytes > 0 && fQueuedBytes + bytes > fMaxQueuedBytes) {
+    auto stall_start = system_clock::now();
+    fSpaceCV.wait(lk, [&]{return fQueuedBytes == 0 || fQueuedBytes + bytes <= fMaxQueuedBytes;});
+    fStallTime += duration_cast<microseconds>(system_clock::now()-stall_start).count();
+  }
+  job->queued = system_clock::now();
+  fQueuedBytes += bytes;
+  MemoryGovernor::Add(MemoryGovernor::Compression, bytes);
+  fQueue.push_back(job);
+  lk.unlock();
+  fJobCV.notify_one();
+}
+
+void StraxWriter::Run(int index){
+  WriteJob *job;
+  long bytes;
+  Metrics::Register("writer_" + std::to_string(index));
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lk(fQueueMutex);
+      fJobCV.wait(lk, [&]{return fClosing || fQueue.size() > 0;});
+      if (fQueue.size() == 0) return; // closing and nothing left
+      job = fQueue.front();
+      fQueue.pop_front();
+    }
+    bytes = job->buffer != nullptr ? job->buffer->size() : 0;
+    if (job->buffer == nullptr) CreatePlaceholders(job);
+    else if (job->stream != nullptr) ProcessStream(job);
+    else Process(job);
+    {
+      // under the lock, or a producer about to wait could miss the wakeup
+      const std::lock_guard<std::mutex> lg(fQueueMutex);
+      fQueuedBytes -= bytes;
+    }
+    MemoryGovernor::Add(MemoryGovernor::Compression, -bytes);
+    fSpaceCV.notify_all();
+  }
+}
+
+void StraxWriter::Process(WriteJob *job){
+  // Compress one buffer, write it to its temp directory, then move it into place
+  using namespace std::chrono;
+  system_clock::time_point comp_start, comp_end;
+
+  comp_start = system_clock::now();
+  fQueueTime += duration_cast<microseconds>(comp_start-job->queued).count();
+  size_t uncompressed_size = job->buffer->size();
+
+  // page-aligned with room to round up, in case it goes out with O_DIRECT
+  bool indexed = job->compressor != "blosc" && job->index_record_bytes > 0 &&
+    std::size_t(job->index_record_bytes) <= kStraxIndexBlockBytes;
+  size_t max_compressed_size = job->compressor == "blosc" ?
+    uncompressed_size+BLOSC_MAX_OVERHEAD : LZ4F_compressFrameBound(uncompressed_size, &kPrefs);
+  if (indexed) {
+    // blocks a bit short of the full size, so possibly one or two more of them
+    size_t block_bytes = (kStraxIndexBlockBytes/job->index_record_bytes)*job->index_record_bytes;
+    size_t n_blocks = uncompressed_size/block_bytes + 1;
+    max_compressed_size = std::max(max_compressed_size, LZ4F_HEADER_SIZE_MAX +
+        n_blocks*LZ4F_compressBound(block_bytes, &kIndexPrefs) + 8);
+  }
+  void *mem = nullptr;
+  if (posix_memalign(&mem, 4096, ((max_compressed_size+4095)/4096)*4096) != 0)
+    throw std::bad_alloc();
+  char *out_buffer = static_cast<char*>(mem);
+  std::size_t wsize = 0;
+  if(job->compressor == "blosc"){
+    int ret = blosc_compress_ctx(5, 1, sizeof(char), uncompressed_size,  job->buffer->data(),
+				 out_buffer, max_compressed_size, "lz4", 0, 2);
+    if (ret > 0) wsize = ret;
+  }
+  else{
+    // Note: the current package repo version for Ubuntu 18.04 (Oct 2019) is 1.7.1, which is
+    // so old it is not tracked on the lz4 github. The API for frame compression has changed
+    // just slightly in the meantime. So if you update and it breaks you'll have to tune at least
+    // the LZ4F_preferences_t object to the new format.
+    if (indexed && (wsize = CompressIndexed(job, out_buffer, max_compressed_size)) == 0)
+      fLog->Entry(MongoLog::Warning, "Couldn't index %s, writing it without",
+          job->final_path.c_str());
+    if (wsize == 0) {
+      std::size_t ret = LZ4F_compressFrame(out_buffer, max_compressed_size,
+				 job->buffer->data(), uncompressed_size, &kPrefs);
+      if (!LZ4F_isError(ret)) wsize = ret;
+    }
+  }
+  if (wsize == 0 || wsize > max_compressed_size) {
+    // nothing sensible to write, and the size would take the writes past the buffer
+    fLog->Entry(MongoLog::Error, "Failed to compress %s", job->final_path.c_str());
+    std::free(out_buffer);
+    delete job->buffer;
+    job->buffer = nullptr;
+    delete job->index;
+    job->index = nullptr;
+    FinishWrite(job, false, 0);
+    return;
+  }
+  delete job->buffer;
+  job->buffer = nullptr;
+  comp_end = system_clock::now();
+  fCompTime += duration_cast<microseconds>(comp_end-comp_start).count();
+  Metrics::Record(Metrics::Compress, duration_cast<nanoseconds>(comp_end-comp_start).count(),
+      uncompressed_size);
+  fBytesIn += uncompressed_size;
+  fBytesOut += wsize;
+  job->compressed_bytes = wsize;
+
+  WriteOut(job, out_buffer, wsize, comp_end);
+}
+
+void StraxWriter::ProcessStream(WriteJob *job){
+  // The blocks of a frame are queued in order, so by the time one is taken
+  // the one before it is done or being worked on by another thread
+  using namespace std::chrono;
+  StreamState *stream = job->stream;
+  system_clock::time_point comp_start = system_clock::now();
+  fQueueTime += duration_cast<microseconds>(comp_start-job->queued).count();
+  std::size_t raw_bytes = job->buffer->size();
+  std::unique_lock<std::mutex> lk(stream->mutex);
+  stream->next_cv.wait(lk, [&]{return stream->next == job->sequence;});
+  std::size_t before = stream->out.size();
+  auto append = [&](std::size_t bound, auto compress){
+    if (stream->failed) return;
+    std::size_t pos = stream->out.size();
+    stream->out.resize(pos + bound);
+    std::size_t n = compress(&stream->out[pos], bound);
+    if (LZ4F_isError(n)) {
+      stream->failed = true;
+      n = 0;
+    }
+    stream->out.resize(pos + n);
+  };
+  if (job->sequence == 0) {
+    if (LZ4F_isError(LZ4F_createCompressionContext(&stream->ctx, LZ4F_VERSION))) {
+      stream->ctx = nullptr;
+      stream->failed = true;
+    }
+    append(LZ4F_HEADER_SIZE_MAX, [&](char *out, std::size_t cap){
+        return LZ4F_compressBegin(stream->ctx, out, cap, &kPrefs);});
+  }
+  if (raw_bytes > 0)
+    append(LZ4F_compressBound(raw_bytes, &kPrefs), [&](char *out, std::size_t cap){
+        return LZ4F_compressUpdate(stream->ctx, out, cap, job->buffer->data(), raw_bytes,
+            nullptr);});
+  if (job->finish)
+    append(LZ4F_compressBound(0, &kPrefs), [&](char *out, std::size_t cap){
+        return LZ4F_compressEnd(stream->ctx, out, cap, nullptr);});
+  // held until the file goes out
+  MemoryGovernor::Add(MemoryGovernor::Chunks, long(stream->out.size()) - long(before));
+  stream->next++;
+  lk.unlock();
+  stream->next_cv.notify_all();
+  delete job->buffer;
+  job->buffer = nullptr;
+  system_clock::time_point comp_end = system_clock::now();
+  fCompTime += duration_cast<microseconds>(comp_end-comp_start).count();
+  Metrics::Record(Metrics::Compress, duration_cast<nanoseconds>(comp_end-comp_start).count(),
+      raw_bytes);
+  fBytesIn += raw_bytes;
+  bool finish = job->finish;
+  delete job;
+  if (!finish) return;
+
+  // that was the last block, nobody else has the stream any more
+  WriteJob *out_job = stream->paths;
+  std::size_t wsize = stream->out.size();
+  MemoryGovernor::Add(MemoryGovernor::Chunks, -long(wsize));
+  if (stream->ctx != nullptr) LZ4F_freeCompressionContext(stream->ctx);
+  void *mem = nullptr;
+  if (!stream->failed && posix_memalign(&mem, 4096, ((wsize+4095)/4096)*4096) != 0)
+    throw std::bad_alloc();
+  if (stream->failed) {
+    fLog->Entry(MongoLog::Error, "Failed to compress %s", out_job->final_path.c_str());
+    delete stream;
+    FinishWrite(out_job, false, 0);
+    return;
+  }
+  char *out_buffer = static_cast<char*>(mem);
+  std::memcpy(out_buffer, stream->out.data(), wsize);
+  delete stream;
+  fBytesOut += wsize;
+  out_job->compressed_bytes = wsize;
+  WriteOut(out_job, out_buffer, wsize, comp_end);
+}
+
+void StraxWriter::WriteOut(WriteJob *job, char *out_buffer, std::size_t wsize,
+    std::chrono::system_clock::time_point comp_end){
+  using namespace std::chrono;
+  bool ok = EnsureDirectory(job->temp_dir);
+#ifdef HAVE_LIBURING
+  if (ok && fUring != nullptr) {
+    // the reaper thread takes it from here
+    fUring->Submit(out_buffer, wsize, job);
+    return;
+  }
+#endif
+  if (ok) {
+    std::ofstream writefile(job->temp_path, std::ios::binary);
+    writefile.write(out_buffer, wsize);
+    writefile.close();
+    ok = writefile.good();
+  }
+  std::free(out_buffer);
+  FinishWrite(job, ok, duration_cast<microseconds>(system_clock::now()-comp_end).count());
+}
+
+std::size_t StraxWriter::CompressIndexed(WriteJob *job, char *out, std::size_t capacity){
+  // One frame like any other, but a block at a time, noting where each one
+  // starts and what each channel has in it on the way
+  const std::string& in = *job->buffer;
+  const std::size_t record_bytes = job->index_record_bytes;
+  const std::size_t block_bytes = (kStraxIndexBlockBytes/record_bytes)*record_bytes;
+  std::vector<StraxIndexBlock> blocks;
+  std::vector<StraxIndexEntry> entries;
+  std::map<int16_t, StraxIndexEntry> channels;
+  StraxHeader header;
+
+  LZ4F_compressionContext_t ctx;
+  if (LZ4F_isError(LZ4F_createCompressionContext(&ctx, LZ4F_VERSION))) return 0;
+  std::size_t pos = LZ4F_compressBegin(ctx, out, capacity, &kIndexPrefs);
+  bool ok = !LZ4F_isError(pos);
+  for (std::size_t start = 0; ok && start < in.size(); start += block_bytes) {
+    std::size_t bytes = std::min(block_bytes, in.size()-start);
+    uint32_t block = blocks.size(), n_records = bytes/record_bytes;
+    blocks.push_back(StraxIndexBlock{pos, start/record_bytes, n_records, 0});
+    channels.clear();
+    for (uint32_t i = 0; i < n_records; i++) {
+      std::memcpy(&header, in.data() + start + i*record_bytes, sizeof(header));
+      int64_t end = header.time + int64_t(header.length)*header.sample_width;
+      auto it = channels.find(header.channel);
+      if (it == channels.end()) {
+        channels.emplace(header.channel,
+            StraxIndexEntry{block, 1, header.channel, {0, 0, 0}, header.time, end});
+        continue;
+      }
+      it->second.n_records++;
+      it->second.start = std::min(it->second.start, header.time);
+      it->second.end = std::max(it->second.end, end);
+    }
+    for (auto& p : channels) entries.push_back(p.second);
+    std::size_t n = LZ4F_compressUpdate(ctx, out+pos, capacity-pos, in.data()+start, bytes,
+        nullptr);
+    if (LZ4F_isError(n)) ok = false;
+    else pos += n;
+  }
+  if (ok) {
+    std::size_t n = LZ4F_compressEnd(ctx, out+pos, capacity-pos, nullptr);
+    if (LZ4F_isError(n)) ok = false;
+    else pos += n;
+  }
+  LZ4F_freeCompressionContext(ctx);
+  if (!ok) return 0;
+
+  StraxIndexHeader index_header{{'S', 'I', 'D', 'X'}, kStraxIndexVersion, uint32_t(record_bytes),
+    uint32_t(blocks.size()), uint32_t(entries.size()), 0, pos};
+  job->index = new std::string(reinterpret_cast<const char*>(&index_header),
+      sizeof(index_header));
+  job->index->append(reinterpret_cast<const char*>(blocks.data()),
+      blocks.size()*sizeof(StraxIndexBlock));
+  job->index->append(reinterpret_cast<const char*>(entries.data()),
+      entries.size()*sizeof(StraxIndexEntry));
+  return pos;
+}
+
+void StraxWriter::WriteIndex(WriteJob *job){
+  // After the chunk is in place, and moved into place itself, so whoever
+  // finds an index can count on the file being there too
+  fs::path path = job->index_dir / job->final_path.filename();
+  fs::path temp = job->index_dir / (job->final_path.filename().string() + "_temp");
+  if (!EnsureDirectory(job->index_dir.parent_path()) || !EnsureDirectory(job->index_dir))
+    return;
+  std::ofstream writefile(temp, std::ios::binary);
+  writefile.write(job->index->data(), job->index->size());
+  writefile.close();
+  try{
+    if (!writefile.good()) throw std::runtime_error("write failed");
+    fs::rename(temp, path);
+  }
+  catch(std::exception& e){
+    fLog->Entry(MongoLog::Warning, "Failed to write index %s: %s", path.c_str(), e.what());
+  }
+}
+
+void StraxWriter::FinishWrite(WriteJob *job, bool ok, long write_us){
+  if (ok) {
+    try{
+      // Move this chunk from *_TEMP to the same path without TEMP
+      EnsureDirectory(job->final_dir);
+      fs::rename(job->temp_path, job->final_path);
+      if (job->index != nullptr) WriteIndex(job);
+    }
+    catch(std::exception& e){
+      fLog->Entry(MongoLog::Error, "Failed to move %s into place: %s", job->final_path.c_str(),
+          e.what());
+    }
+  } else {
+    fLog->Entry(MongoLog::Error, "Failed to write %s", job->temp_path.c_str());
+  }
+  fWriteTime += write_us;
+  Metrics::Record(Metrics::Write, write_us*1000, job->compressed_bytes);
+  fFilesWritten++;
+  if (job->done) job->done();
+  delete job->index;
+  delete job;
+}
+
+ChunkBuffer::ChunkBuffer(std::size_t reserve){
+  fRaw = new std::string();
+  fRaw->reserve(reserve);
+  fStream = nullptr;
+  fWriter = nullptr;
+  fBlockBytes = fTotalBytes = 0;
+  fSequence = 0;
+}
+
+ChunkBuffer::ChunkBuffer(WriteJob *paths, std::size_t block_bytes){
+  fRaw = new std::string();
+  fRaw->reserve(block_bytes + (block_bytes>>4));
+  fStream = new StreamState();
+  fStream->paths = paths;
+  fWriter = paths->writer;
+  fBlockBytes = block_bytes;
+  fTotalBytes = 0;
+  fSequence = 0;
+}
+
+ChunkBuffer::~ChunkBuffer(){
+  // what's been streamed so far still ends up in a proper file
+  if (fStream != nullptr) Finish(nullptr);
+  if (fRaw != nullptr) delete fRaw;
+}
+
+long ChunkBuffer::Append(const char* data, std::size_t bytes){
+  fRaw->append(data, bytes);
+  fTotalBytes += bytes;
+  return (fStream != nullptr && fRaw->size() >= fBlockBytes) ? Flush(false) : 0;
+}
+
+long ChunkBuffer::AppendZeros(std::size_t bytes){
+  fRaw->append(bytes, '\0');
+  fTotalBytes += bytes;
+  return (fStream != nullptr && fRaw->size() >= fBlockBytes) ? Flush(false) : 0;
+}
+
+std::string* ChunkBuffer::Release(){
+  std::string *ret = fRaw;
+  fRaw = nullptr;
+  return ret;
+}
+
+long ChunkBuffer::Flush(bool finish){
+  long flushed = fRaw->size();
+  WriteJob *job = new WriteJob;
+  job->stream = fStream;
+  job->sequence = fSequence++;
+  job->finish = finish;
+  job->buffer = fRaw;
+  if (finish) {
+    // the writer gets rid of the stream once the file's out
+    fRaw = nullptr;
+    fStream = nullptr;
+  } else {
+    fRaw = new std::string();
+    fRaw->reserve(fBlockBytes + (fBlockBytes>>4));
+  }
+  // waits if the writer is over its budget, like for any other chunk
+  fWriter->Submit(job);
+  return flushed;
+}
+
+long ChunkBuffer::Finish(std::function<void()> done){
+  if (fStream == nullptr) return 0;
+  fStream->paths->done = done;
+  return Flush(true);
+}
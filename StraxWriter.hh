@@ -0,0 +1,165 @@
+#ifndef _STRAXWRITER_HH_
+#define _STRAXWRITER_HH_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <experimental/filesystem>
+#include <fstream>
+#include <lz4frame.h>
+
+class Options;
+class MongoLog;
+class StraxWriter;
+class UringWriter;
+class ChunkAggregator;
+struct StreamState;
+
+struct WriteJob{
+  std::string *buffer = nullptr; // uncompressed data, owned by the job. Null for placeholders
+  std::vector<std::experimental::filesystem::path> placeholders; // empty files to create
+  StraxWriter *writer = nullptr; // only set for streamed files
+  std::string compressor;
+  std::experimental::filesystem::path temp_dir, temp_path;
+  std::experimental::filesystem::path final_dir, final_path;
+  std::function<void()> done; // called from the worker once the file is in place
+  std::chrono::system_clock::time_point queued;
+  std::size_t compressed_bytes = 0;
+  // lz4 only: if set, the frame is written in blocks of whole records that
+  // can be read by themselves, and an index of them goes into index_dir
+  int index_record_bytes = 0;
+  std::experimental::filesystem::path index_dir;
+  std::string *index = nullptr; // filled in by the writer
+  // Streamed files: one block of the frame, where it goes in the frame,
+  // and whether it's the last one
+  StreamState *stream = nullptr;
+  int sequence = 0;
+  bool finish = false;
+};
+
+struct StreamState{
+  /*
+    A streamed file's lz4 frame while it's being put together. Its blocks
+    are compressed in order by whichever writer threads pick them up, into
+    memory, and the finished frame is written out like any other chunk
+  */
+  WriteJob *paths; // what goes out at the end
+  std::mutex mutex;
+  std::condition_variable next_cv;
+  int next = 0; // sequence number of the block that's due
+  LZ4F_compressionContext_t ctx = nullptr;
+  std::string out; // compressed so far
+  bool failed = false;
+};
+
+class ChunkBuffer{
+  /*
+    The records going into one output file. Normally they're all kept until
+    the chunk is done, then handed to the StraxWriter in one go. In streaming
+    mode each block is handed to the StraxWriter as soon as it's full, to be
+    compressed onto a single LZ4 frame, so only the current block is held
+    uncompressed.
+  */
+
+public:
+  ChunkBuffer(std::size_t reserve);
+  // Streaming. Takes ownership of the job, which only provides the paths
+  // and the writer
+  ChunkBuffer(WriteJob *paths, std::size_t block_bytes);
+  // Finishes a streamed file that wasn't finished yet
+  ~ChunkBuffer();
+
+  // Both return how many uncompressed bytes were handed to the writer
+  long Append(const char* data, std::size_t bytes);
+  long AppendZeros(std::size_t bytes);
+  // Streaming only: hands over the rest and ends the frame. done is called
+  // once the file's in place
+  long Finish(std::function<void()> done);
+  // Not streaming: the caller takes the buffer
+  std::string* Release();
+  // Not streaming: the last bytes appended
+  const char* Tail(std::size_t bytes) {return fRaw->data() + fRaw->size() - bytes;}
+
+  bool Streaming() {return fStream != nullptr;}
+  std::size_t Size() {return fTotalBytes;}
+
+private:
+  long Flush(bool finish);
+
+  std::string *fRaw;
+  StreamState *fStream; // null once finished
+  StraxWriter *fWriter;
+  std::size_t fBlockBytes, fTotalBytes;
+  int fSequence;
+};
+
+class StraxWriter{
+  /*
+    Compresses finished strax chunks and writes them to disk on its own
+    threads, so the inserters can keep parsing in the meantime. Shared by
+    all the inserters on a host. Submit() blocks while the data waiting to
+    be written is over the memory budget.
+  */
+
+public:
+  StraxWriter(MongoLog *log);
+  ~StraxWriter();
+
+  int Initialize(Options *options, std::string hostname);
+  void Close();
+
+  // Takes ownership of the job and its buffer
+  void Submit(WriteJob *job);
+  long GetBufferSize() {return fQueuedBytes.load();}
+  // Null unless the inserters' chunks are merged into one file per host
+  ChunkAggregator* Aggregator() {return fAggregator;}
+
+  // Creates the directory unless someone on this host already did during
+  // this run. Returns false if it couldn't
+  bool EnsureDirectory(const std::experimental::filesystem::path& dir);
+
+private:
+  void Run(int index);
+  void Process(WriteJob *job);
+  void ProcessStream(WriteJob *job);
+  // Writes a compressed file to its temp path and moves it into place.
+  // Takes ownership of out_buffer, which is from posix_memalign
+  void WriteOut(WriteJob *job, char *out_buffer, std::size_t wsize,
+      std::chrono::system_clock::time_point comp_end);
+  // Returns the compressed size, 0 if it didn't work out
+  std::size_t CompressIndexed(WriteJob *job, char *out, std::size_t capacity);
+  void WriteIndex(WriteJob *job);
+  void FinishWrite(WriteJob *job, bool ok, long write_us);
+  void CreatePlaceholders(WriteJob *job);
+
+  UringWriter *fUring; // null unless strax_output_backend is 'uring'
+  ChunkAggregator *fAggregator; // null unless strax_host_merge is set
+
+  // Every directory made (or found) so far this run
+  std::set<std::string> fDirectories;
+  std::mutex fDirMutex;
+
+  Options *fOptions;
+  MongoLog *fLog;
+  std::vector<std::thread*> fThreads;
+  std::deque<WriteJob*> fQueue;
+  std::mutex fQueueMutex;
+  std::condition_variable fJobCV;
+  std::condition_variable fSpaceCV;
+  bool fClosing;
+  long fMaxQueuedBytes;
+
+  std::atomic_long fQueuedBytes;
+  std::atomic_long fBytesIn, fBytesOut, fFilesWritten;
+  // all in microseconds
+  std::atomic_long fCompTime, fWriteTime, fQueueTime, fStallTime;
+};
+
+#endif
@@ -0,0 +1,188 @@
+#include "UringWriter.hh"
+
+#ifdef HAVE_LIBURING
+
+#include "StraxWriter.hh"
+#include "MongoLog.hh"
+#include "Metrics.hh"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+// O_DIRECT writes have to be whole blocks from aligned memory
+const std::size_t DirectAlignment(4096);
+
+// Consecutive failed waits on the ring before we give up on it
+const int MaxWaitFailures(100);
+
+static std::size_t AlignUp(std::size_t bytes){
+  return ((bytes + DirectAlignment - 1)/DirectAlignment)*DirectAlignment;
+}
+
+UringWriter::UringWriter(MongoLog *log){
+  fLog = log;
+  fOpen = false;
+  fDirect = false;
+  fBroken = false;
+  fDepth = fInFlight = 0;
+}
+
+UringWriter::~UringWriter(){
+  Close();
+}
+
+int UringWriter::Initialize(unsigned depth, bool direct, Callback done){
+  fDepth = std::max(1u, depth);
+  fDirect = direct;
+  fDone = done;
+  int ret = io_uring_queue_init(fDepth, &fRing, 0);
+  if (ret < 0) {
+    fLog->Entry(MongoLog::Warning, "Couldn't set up io_uring: %s", std::strerror(-ret));
+    return -1;
+  }
+  fOpen = true;
+  fReaper = std::thread(&UringWriter::Reap, this);
+  return 0;
+}
+
+void UringWriter::Close(){
+  if (!fOpen) return;
+  {
+    std::unique_lock<std::mutex> lk(fMutex);
+    fSlotCV.wait(lk, [&]{return fInFlight == 0;});
+    // a nop without a request tells the reaper to stop, unless it's gone already
+    if (!fBroken) {
+      io_uring_sqe *sqe = io_uring_get_sqe(&fRing);
+      io_uring_prep_nop(sqe);
+      io_uring_sqe_set_data(sqe, nullptr);
+      io_uring_submit(&fRing);
+    }
+  }
+  fReaper.join();
+  io_uring_queue_exit(&fRing);
+  fOpen = false;
+}
+
+void UringWriter::Submit(char *data, std::size_t bytes, WriteJob *job){
+  Request *req = new Request{-1, fDirect, data, bytes, job, std::chrono::system_clock::now()};
+  if (req->direct) {
+    req->fd = open(job->temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (req->fd < 0 && errno == EINVAL) req->direct = false; // filesystem can't do it
+  }
+  if (!req->direct)
+    req->fd = open(job->temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (req->fd < 0) {
+    fLog->Entry(MongoLog::Error, "Couldn't open %s: %s", job->temp_path.c_str(),
+        std::strerror(errno));
+    std::free(data);
+    fDone(job, false, 0);
+    delete req;
+    return;
+  }
+  std::size_t write_bytes = bytes;
+  if (req->direct) {
+    write_bytes = AlignUp(bytes);
+    std::memset(data + bytes, 0, write_bytes - bytes);
+  }
+
+  std::unique_lock<std::mutex> lk(fMutex);
+  fSlotCV.wait(lk, [&]{return fBroken || fInFlight < fDepth;});
+  if (fBroken) {
+    // nobody reaps any more, so the short write path does all of it
+    lk.unlock();
+    Complete(req, 0);
+    return;
+  }
+  io_uring_sqe *sqe = io_uring_get_sqe(&fRing);
+  io_uring_prep_write(sqe, req->fd, data, write_bytes, 0);
+  io_uring_sqe_set_data(sqe, req);
+  fInFlight++;
+  fPending.insert(req);
+  io_uring_submit(&fRing);
+}
+
+void UringWriter::Reap(){
+  io_uring_cqe *cqe;
+  int failures = 0;
+  Metrics::Register("uring");
+  while (true) {
+    int ret = io_uring_wait_cqe(&fRing, &cqe);
+    if (ret == -EINTR) continue;
+    if (ret < 0) {
+      if (failures++ == 0)
+        fLog->Entry(MongoLog::Error, "io_uring wait failed: %s", std::strerror(-ret));
+      if (failures >= MaxWaitFailures) {
+        Abandon();
+        return;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      continue;
+    }
+    failures = 0;
+    Request *req = static_cast<Request*>(io_uring_cqe_get_data(cqe));
+    int res = cqe->res;
+    io_uring_cqe_seen(&fRing, cqe);
+    if (req == nullptr) return;
+    {
+      const std::lock_guard<std::mutex> lg(fMutex);
+      fPending.erase(req);
+    }
+    Complete(req, res);
+    {
+      const std::lock_guard<std::mutex> lg(fMutex);
+      fInFlight--;
+    }
+    fSlotCV.notify_all();
+  }
+}
+
+void UringWriter::Abandon(){
+  std::set<Request*> pending;
+  {
+    const std::lock_guard<std::mutex> lg(fMutex);
+    fBroken = true;
+    pending.swap(fPending);
+    fInFlight = 0;
+  }
+  fSlotCV.notify_all();
+  fLog->Entry(MongoLog::Error, "Giving up on io_uring with %i writes in flight",
+      int(pending.size()));
+  for (auto req : pending) {
+    // the kernel may still be reading the buffer, so that stays where it is
+    fLog->Entry(MongoLog::Error, "Lost the write to %s", req->job->temp_path.c_str());
+    close(req->fd);
+    fDone(req->job, false, 0);
+    delete req;
+  }
+}
+
+void UringWriter::Complete(Request *req, int res){
+  std::size_t write_bytes = req->direct ? AlignUp(req->bytes) : req->bytes;
+  bool ok = res >= 0;
+  if (!ok) {
+    fLog->Entry(MongoLog::Error, "Write to %s failed: %s", req->job->temp_path.c_str(),
+        std::strerror(-res));
+  } else if ((std::size_t)res < write_bytes) {
+    // short write. Rare enough to just finish it the ordinary way
+    if (req->direct) fcntl(req->fd, F_SETFL, fcntl(req->fd, F_GETFL) & ~O_DIRECT);
+    std::size_t done = res;
+    while (ok && done < write_bytes) {
+      ssize_t n = pwrite(req->fd, req->data + done, write_bytes - done, done);
+      if (n <= 0) ok = false;
+      else done += n;
+    }
+  }
+  // get rid of the padding
+  if (ok && req->direct && ftruncate(req->fd, req->bytes) != 0) ok = false;
+  close(req->fd);
+  std::free(req->data);
+  long write_us = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now() - req->start).count();
+  fDone(req->job, ok, write_us);
+  delete req;
+}
+
+#endif // HAVE_LIBURING
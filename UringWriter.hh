@@ -0,0 +1,76 @@
+#ifndef _URINGWRITER_HH_
+#define _URINGWRITER_HH_
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+#include <cstddef>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <set>
+
+class MongoLog;
+struct WriteJob;
+
+class UringWriter{
+  /*
+    Writes compressed chunks through io_uring, so the compression threads hand
+    a file off and carry on rather than wait for the disk. A reaper thread
+    picks up the completions and calls back to close out each file.
+    Optionally opens with O_DIRECT to keep chunks out of the page cache, in
+    which case the file is written in whole pages and truncated after.
+  */
+
+public:
+  // ok is false if the write failed, write_us is how long it was in flight
+  typedef std::function<void(WriteJob*, bool ok, long write_us)> Callback;
+
+  UringWriter(MongoLog *log);
+  ~UringWriter();
+
+  int Initialize(unsigned depth, bool direct, Callback done);
+  void Close();
+
+  // Takes ownership of data, which has to be from malloc/posix_memalign,
+  // 4 kB aligned, and have room up to the next multiple of 4 kB. The file is
+  // job->temp_path, and done gets called (possibly from Submit itself, if
+  // the file can't be opened) once it's completely written and closed.
+  // Blocks while the maximum number of writes are in flight
+  void Submit(char *data, std::size_t bytes, WriteJob *job);
+
+private:
+  struct Request{
+    int fd;
+    bool direct;
+    char *data;
+    std::size_t bytes;
+    WriteJob *job;
+    std::chrono::system_clock::time_point start;
+  };
+  void Reap();
+  void Complete(Request *req, int res);
+  // The ring stopped handing back completions: fail what's in flight and
+  // write anything that comes after the ordinary way
+  void Abandon();
+
+  MongoLog *fLog;
+  struct io_uring fRing;
+  bool fOpen;
+  bool fDirect;
+  unsigned fDepth;
+  unsigned fInFlight;
+  std::set<Request*> fPending; // submitted, not completed yet
+  bool fBroken;
+  std::mutex fMutex;
+  std::condition_variable fSlotCV;
+  std::thread fReaper;
+  Callback fDone;
+};
+
+#endif // HAVE_LIBURING
+
+#endif
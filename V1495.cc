@@ -4,6 +4,7 @@
 
 #include <numeric>
 #include <iostream>
+#include <algorithm>
 #include "V1495.hh"
 #include "DAXHelpers.hh"
 #include "Options.hh"
@@ -35,5 +36,42 @@ int V1495::WriteReg(unsigned int reg, unsigned int value){
 	return 0;
 }
 
-
-
+// Same batching as V1724::WriteRegisters
+int V1495::WriteRegs(const std::vector<std::pair<u_int32_t, u_int32_t>>& regs){
+	if (fOptions->GetInt("vme_multiwrite", 1) == 0) {
+		int ret = 0;
+		for (auto& r : regs) ret += WriteReg(r.first, r.second);
+		return ret;
+	}
+	const unsigned MaxCycles = 64;
+	u_int32_t addrs[MaxCycles], vals[MaxCycles];
+	CVAddressModifier ams[MaxCycles];
+	CVDataWidth dws[MaxCycles];
+	CVErrorCodes ecs[MaxCycles];
+	std::fill_n(ams, MaxCycles, cvA32_U_DATA);
+	std::fill_n(dws, MaxCycles, cvD32);
+	int ret = 0;
+	for (unsigned start = 0; start < regs.size(); start += MaxCycles) {
+		unsigned n = std::min<std::size_t>(MaxCycles, regs.size() - start);
+		for (unsigned i = 0; i < n; i++) {
+			addrs[i] = fBaseAddress + regs[start+i].first;
+			vals[i] = regs[start+i].second;
+			ecs[i] = cvSuccess;
+		}
+		bool ok = CAENVME_MultiWrite(fBoardHandle, addrs, vals, n, ams, dws, ecs) == cvSuccess;
+		int failed = 0;
+		for (unsigned i = 0; i < n; i++) {
+			if (ok || ecs[i] == cvSuccess) {
+				fLog->Entry(MongoLog::Message, "V1495: %i written register 0x%04x with value %08x (handle %i)",
+						fBID, regs[start+i].first, regs[start+i].second, fBoardHandle);
+				continue;
+			}
+			fLog->Entry(MongoLog::Warning, "V1495: %i failed to write register 0x%04x with value %08x (handle %i)",
+					fBID, regs[start+i].first, regs[start+i].second, fBoardHandle);
+			failed++;
+		}
+		if (!ok && failed == 0) failed = 1; // failed, but no cycle says which
+		ret -= failed;
+	}
+	return ret;
+}
@@ -27,6 +27,9 @@ public:
       V1495(MongoLog *log, Options *options, int bid, int handle, unsigned int address);
       virtual ~V1495();	
       int WriteReg(unsigned int reg, unsigned int value);
+      // (register, value) pairs in order, as VME multi-write cycles unless
+      // vme_multiwrite is 0
+      int WriteRegs(const std::vector<std::pair<u_int32_t, u_int32_t>>& regs);
 
 private:
       int fBoardHandle, fBID;
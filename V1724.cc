@@ -10,6 +10,8 @@
 #include "MongoLog.hh"
 #include "Options.hh"
 #include "StraxInserter.hh"
+#include "HeaderScan.hh"
+#include "BufferPool.hh"
 #include <CAENVMElib.h>
 #include <chrono>
 #include <sstream>
@@ -22,11 +24,16 @@ V1724::V1724(MongoLog  *log, Options *options){
   fBoardHandle=fLink=fCrate=fBID=-1;
   fBaseAddress=0;
   fLog = log;
+  fPool = nullptr;
+  fSlab = nullptr;
+  fSlabOffset = 0;
+  fMultiWrite = true;
 
   fAqCtrlRegister = 0x8100;
   fAqStatusRegister = 0x8104;
   fSwTrigRegister = 0x8108;
   fResetRegister = 0xEF24;
+  fClearRegister = 0xEF28;
   fChStatusRegister = 0x1088;
   fChDACRegister = 0x1098;
   fNChannels = 8;
@@ -40,20 +47,19 @@ V1724::V1724(MongoLog  *log, Options *options){
   BLT_SIZE=512*1024; // one channel's memory
 
   DataFormatDefinition = {
-    {"channel_mask_msb_idx", -1},
+    {"channel_mask_msb_idx", Format::channel_mask_msb_idx},
     {"channel_mask_msb_mask", -1},
-    {"channel_header_words", 2},
-    {"ns_per_sample", 10},
-    {"ns_per_clk", 10},   
+    {"channel_header_words", Format::channel_header_words},
+    {"ns_per_sample", Format::ns_per_sample},
+    {"ns_per_clk", Format::ns_per_clk},
     // Channel indices are given relative to start of channel
     // i.e. the channel size is at index '0'
-    {"channel_time_msb_idx", -1},
+    {"channel_time_msb_idx", Format::channel_time_msb_idx},
     {"channel_time_msb_mask", -1},
 
   };
 
   fBLTSafety = 1.4;
-  fBufferSafety = 1.1;
 
 }
 
@@ -99,14 +105,32 @@ u_int32_t V1724::GetAcquisitionStatus(){
   return ReadRegister(fAqStatusRegister);
 }
 
-int V1724::CheckErrors(){
-  auto pll = ReadRegister(fBoardFailStatRegister);
+int V1724::DataReady(){
   auto ros = ReadRegister(fReadoutStatusRegister);
+  if (ros == 0xFFFFFFFF) return -1;
+  return ros & 0x1;
+}
+
+int V1724::ReadStatus(Status& status){
+  std::vector<u_int32_t> vals;
+  int ret = ReadRegisters({fAqStatusRegister, fReadoutStatusRegister, fBoardFailStatRegister},
+      vals);
+  status = Status{vals[0], vals[1], vals[2]};
+  return ret;
+}
+
+int V1724::CheckErrors(){
+  Status status;
+  ReadStatus(status);
+  return ErrorBits(status);
+}
+
+int V1724::ErrorBits(const Status& status){
   unsigned ERR = 0xFFFFFFFF;
-  if ((pll == ERR) || (ros == ERR)) return -1;
+  if ((status.board_fail == ERR) || (status.readout == ERR)) return -1;
   int ret = 0;
-  if (pll & (1 << 4)) ret |= 0x1;
-  if (ros & (1 << 2)) ret |= 0x2;
+  if (status.board_fail & (1 << 4)) ret |= 0x1;
+  if (status.readout & (1 << 2)) ret |= 0x2;
   return ret;
 }
 
@@ -126,17 +150,8 @@ int V1724::Init(int link, int crate, int bid, unsigned int address){
   fCrate = crate;
   fBID = bid;
   fBaseAddress=address;
-  clock_counter = 0;
-  last_time = 0;
-  last_event_num = 0;
-  seen_over_15 = false;
-  seen_under_5 = true; // starts run as true
-  u_int32_t word(0);
   int my_bid(0);
-  
-  fBLTSafety = fOptions->GetDouble("blt_safety_factor", 1.5);
-  fBufferSafety = fOptions->GetDouble("buffer_safety_factor", 1.1);
-  BLT_SIZE = fOptions->GetInt("blt_size", 512*1024);
+  NewRun();
 
   if (Reset()) {
     fLog->Entry(MongoLog::Error, "Board %i unable to pre-load registers", fBID);
@@ -144,18 +159,17 @@ int V1724::Init(int link, int crate, int bid, unsigned int address){
   } else {
     fLog->Entry(MongoLog::Local, "Board %i reset", fBID);
   }
-  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  if (!WaitForReady(fOptions->GetInt("arm_ready_timeout_ms", 2000))) {
+    fLog->Entry(MongoLog::Error, "Board %i not ready after reset", fBID);
+    return -1;
+  }
   if (fOptions->GetInt("do_sn_check", 0) != 0) {
-    if ((word = ReadRegister(fSNRegisterLSB)) == 0xFFFFFFFF) {
-      fLog->Entry(MongoLog::Error, "Board %i couldn't read its SN lsb", fBID);
-      return -1;
-    }
-    my_bid |= word&0xFF;
-    if ((word = ReadRegister(fSNRegisterMSB)) == 0xFFFFFFFF) {
-      fLog->Entry(MongoLog::Error, "Board %i couldn't read its SN msb", fBID);
+    std::vector<u_int32_t> sn;
+    if (ReadRegisters({fSNRegisterLSB, fSNRegisterMSB}, sn) != 0) {
+      fLog->Entry(MongoLog::Error, "Board %i couldn't read its SN", fBID);
       return -1;
     }
-    my_bid |= ((word&0xFF)<<8);
+    my_bid = (sn[0]&0xFF) | ((sn[1]&0xFF)<<8);
     if (my_bid != fBID) {
       fLog->Entry(MongoLog::Local, "Link %i crate %i should be SN %i but is actually %i",
         link, crate, fBID, my_bid);
@@ -164,20 +178,52 @@ int V1724::Init(int link, int crate, int bid, unsigned int address){
   return 0;
 }
 
+void V1724::NewRun(){
+  clock_counter = 0;
+  last_time = 0;
+  last_event_num = 0;
+  seen_over_15 = false;
+  seen_under_5 = true; // starts run as true
+
+  fBLTSafety = fOptions->GetDouble("blt_safety_factor", 1.5);
+  BLT_SIZE = fOptions->GetInt("blt_size", 512*1024);
+  fMultiWrite = fOptions->GetInt("vme_multiwrite", 1) != 0;
+}
+
+bool V1724::Rearm(Options *options){
+  fOptions = options;
+  NewRun();
+  // events still in the board from the last run mustn't end up in this one,
+  // the settings stay as they are
+  if (WriteRegister(fClearRegister, 0x1) != 0) return false;
+  return WaitForReady(fOptions->GetInt("arm_ready_timeout_ms", 2000));
+}
+
+void V1724::SetBufferPool(BufferPool *pool){
+  if (fSlab != nullptr) fSlab->Release();
+  fSlab = nullptr;
+  fSlabOffset = 0;
+  fPool = pool;
+}
+
+void V1724::Park(){
+  if (fSlab != nullptr) fSlab->Release();
+  fSlab = nullptr;
+  fSlabOffset = 0;
+  fPool = nullptr;
+  // the next run's Options come in with Rearm, these may be gone by then
+  fOptions = nullptr;
+}
+
 int V1724::Reset() {
-  int ret = WriteRegister(fResetRegister, 0x1);
-  ret += WriteRegister(fBoardErrRegister, 0x30);
-  return ret;
+  return WriteRegisters({{fResetRegister, 0x1}, {fBoardErrRegister, 0x30}});
 }
 
 u_int32_t V1724::GetHeaderTime(u_int32_t *buff, u_int32_t size, u_int32_t& num){
-  u_int32_t idx = 0;
-  while(idx < size/sizeof(u_int32_t)){
-    if(buff[idx]>>28==0xA){
-      num = buff[idx+2]&0xFFFFFF;
-      return buff[idx+3]&0x7FFFFFFF;
-    }
-    idx++;
+  u_int32_t idx = FindHeader(buff, 0, size/sizeof(u_int32_t));
+  if(idx < size/sizeof(u_int32_t)){
+    num = buff[idx+2]&0xFFFFFF;
+    return buff[idx+3]&0x7FFFFFFF;
   }
   num = 0;
   return 0xFFFFFFFF;
@@ -273,6 +319,85 @@ int V1724::WriteRegister(unsigned int reg, unsigned int value){
   return 0;
 }
 
+int V1724::WriteRegisters(const std::vector<std::pair<u_int32_t, u_int32_t>>& regs){
+  if (!fMultiWrite) {
+    int ret = 0;
+    for (auto& r : regs) ret += WriteRegister(r.first, r.second);
+    return ret;
+  }
+  // The library does each batch as a single transaction on the link
+  const unsigned MaxCycles = 64;
+  u_int32_t addrs[MaxCycles], vals[MaxCycles];
+  CVAddressModifier ams[MaxCycles];
+  CVDataWidth dws[MaxCycles];
+  CVErrorCodes ecs[MaxCycles];
+  std::fill_n(ams, MaxCycles, cvA32_U_DATA);
+  std::fill_n(dws, MaxCycles, cvD32);
+  int ret = 0;
+  for (unsigned start = 0; start < regs.size(); start += MaxCycles) {
+    unsigned n = std::min<std::size_t>(MaxCycles, regs.size() - start);
+    for (unsigned i = 0; i < n; i++) {
+      addrs[i] = fBaseAddress + regs[start+i].first;
+      vals[i] = regs[start+i].second;
+      ecs[i] = cvSuccess;
+    }
+    if (CAENVME_MultiWrite(fBoardHandle, addrs, vals, n, ams, dws, ecs) == cvSuccess) continue;
+    for (unsigned i = 0; i < n; i++) {
+      if (ecs[i] == cvSuccess) continue;
+      fLog->Entry(MongoLog::Warning, "Board %i write returned %i (ret), reg 0x%04x, value 0x%08x",
+          fBID, ecs[i], regs[start+i].first, regs[start+i].second);
+      ret--;
+    }
+    if (ret == 0) ret = -1; // failed, but no cycle says which
+  }
+  return ret;
+}
+
+int V1724::ReadRegisters(const std::vector<u_int32_t>& regs, std::vector<u_int32_t>& vals){
+  vals.assign(regs.size(), 0xFFFFFFFF);
+  if (!fMultiWrite) {
+    int ret = 0;
+    for (unsigned i = 0; i < regs.size(); i++)
+      if ((vals[i] = ReadRegister(regs[i])) == 0xFFFFFFFF) ret--;
+    return ret;
+  }
+  // Same batches as WriteRegisters
+  const unsigned MaxCycles = 64;
+  u_int32_t addrs[MaxCycles], data[MaxCycles];
+  CVAddressModifier ams[MaxCycles];
+  CVDataWidth dws[MaxCycles];
+  CVErrorCodes ecs[MaxCycles];
+  std::fill_n(ams, MaxCycles, cvA32_U_DATA);
+  std::fill_n(dws, MaxCycles, cvD32);
+  int ret = 0;
+  for (unsigned start = 0; start < regs.size(); start += MaxCycles) {
+    unsigned n = std::min<std::size_t>(MaxCycles, regs.size() - start);
+    for (unsigned i = 0; i < n; i++) {
+      addrs[i] = fBaseAddress + regs[start+i];
+      data[i] = 0xFFFFFFFF;
+      ecs[i] = cvSuccess;
+    }
+    bool ok = CAENVME_MultiRead(fBoardHandle, addrs, data, n, ams, dws, ecs) == cvSuccess;
+    int failed = 0;
+    for (unsigned i = 0; i < n; i++) {
+      if (ok || ecs[i] == cvSuccess) {
+        vals[start+i] = data[i];
+        continue;
+      }
+      fLog->Entry(MongoLog::Warning, "Board %i read returned: %i (ret) for reg 0x%04x",
+          fBID, ecs[i], regs[start+i]);
+      failed++;
+    }
+    if (!ok && failed == 0) {
+      // failed, but no cycle says which, so trust none of them
+      for (unsigned i = 0; i < n; i++) vals[start+i] = 0xFFFFFFFF;
+      failed = n;
+    }
+    ret -= failed;
+  }
+  return ret;
+}
+
 unsigned int V1724::ReadRegister(unsigned int reg){
   unsigned int temp;
   int ret = -100;
@@ -286,23 +411,40 @@ unsigned int V1724::ReadRegister(unsigned int reg){
   return temp;
 }
 
-int V1724::ReadMBLT(u_int32_t* &buffer, std::vector<unsigned int>* v){
+int V1724::ReadMBLT(u_int32_t* &buffer, BufferSlab* &slab, std::vector<unsigned int>* v){
   // Initialize
   int64_t blt_bytes=0;
   int nb=0,ret=-5;
-  std::list<std::pair<u_int32_t*, int>> xfer_buffers;
+  buffer = nullptr;
+  slab = nullptr;
+  if (fPool == nullptr) {
+    fLog->Entry(MongoLog::Error, "Board %i has no buffer pool to read into", fBID);
+    return -1;
+  }
 
+  // The BLTs go straight into the current slab, one after another, so the data from
+  // this readout ends up contiguous and nothing needs to be copied afterwards. Each
+  // BLT needs the full safety margin free behind it in case the board overdelivers.
   int count = 0;
-  int alloc_size = BLT_SIZE/sizeof(u_int32_t)*fBLTSafety;
-  u_int32_t* thisBLT = nullptr;
+  std::size_t blts_before = v != nullptr ? v->size() : 0;
+  std::size_t alloc_bytes = ((std::size_t)(BLT_SIZE*fBLTSafety) + 7) & ~(std::size_t)7;
+  if (fSlab == nullptr || fSlabOffset + alloc_bytes > fSlab->bytes) NextSlab(alloc_bytes);
+  std::size_t start = fSlabOffset;
   do{
 
-    // Reserve space for this block transfer
-    thisBLT = new u_int32_t[alloc_size];
-    
+    if (start + blt_bytes + alloc_bytes > fSlab->bytes) {
+      // This readout outgrew what's left of the slab. Move what we have so far to the
+      // start of a fresh one. Only happens for readouts spanning many BLTs
+      BufferSlab *fresh = fPool->Get(blt_bytes + alloc_bytes);
+      std::memcpy(fresh->buff, ((unsigned char*)fSlab->buff)+start, blt_bytes);
+      fSlab->Release();
+      fSlab = fresh;
+      start = 0;
+    }
+
     try{
       ret = CAENVME_FIFOBLTReadCycle(fBoardHandle, fBaseAddress,
-				     ((unsigned char*)thisBLT),
+				     ((unsigned char*)fSlab->buff)+start+blt_bytes,
 				     BLT_SIZE, cvA32_U_MBLT, cvD64, &nb);
     }catch(std::exception E){
       std::cout<<fBoardHandle<<" sucks"<<std::endl;
@@ -316,71 +458,67 @@ int V1724::ReadMBLT(u_int32_t* &buffer, std::vector<unsigned int>* v){
 		  "Board %i read error after %i reads: (%i) and transferred %i bytes this read",
 		  fBID, count, ret, nb);
 
-      // Delete all reserved data and fail
-      delete[] thisBLT;
-      for (auto b : xfer_buffers) delete[] b.first;
+      // Nothing was handed out, so the slab space can simply be reused
+      fSlabOffset = start;
+      if (v != nullptr) v->resize(blts_before);
       return -1;
     }
     if (nb > (int)BLT_SIZE) fLog->Entry(MongoLog::Message,
         "Board %i got %i more bytes than asked for (headroom %i)",
-        fBID, nb-BLT_SIZE, alloc_size-nb);
+        fBID, nb-BLT_SIZE, (int)alloc_bytes-nb);
 
     count++;
     blt_bytes+=nb;
-    xfer_buffers.push_back(std::make_pair(thisBLT, nb));
+    if (v != nullptr) v->push_back(nb);
 
   }while(ret != cvBusError);
 
-  // Now, unfortunately we need to make one copy of the data here or else our memory
-  // usage explodes. We declare above a buffer of several MB, which is the maximum capacity
-  // of the board in case every channel is 100% saturated (the practical largest
-  // capacity is certainly smaller depending on settings). But if we just keep reserving
-  // O(MB) blocks and filling 50kB with actual data, we're gonna run out of memory.
-  // So here we declare the return buffer as *just* large enough to hold the actual
-  // data and free up the rest of the memory reserved as buffer.
-  // In tests this does not seem to impact our ability to read out the V1724 at the
-  // maximum bandwidth of the link.
   if(blt_bytes>0){
-    u_int32_t bytes_copied = 0;
-    alloc_size = blt_bytes/sizeof(u_int32_t)*fBufferSafety;
-    buffer = new u_int32_t[alloc_size];
-    for (auto& xfer : xfer_buffers) {
-      std::memcpy(((unsigned char*)buffer)+bytes_copied, xfer.first, xfer.second);
-      bytes_copied += xfer.second;
-      if (v != nullptr) v->push_back(xfer.second);
-    }
+    buffer = (u_int32_t*)(((unsigned char*)fSlab->buff)+start);
+    slab = fSlab;
+    slab->AddReference();
+    // keep the next readout on its own cache line
+    fSlabOffset = start + ((blt_bytes + 63) & ~63L);
     fBLTCounter[count]++;
-    if (bytes_copied != blt_bytes) fLog->Entry(MongoLog::Message,
-        "Board %i funny buffer accumulation: %i/%i from %i BLTs",
-        fBID, bytes_copied, blt_bytes, count);
+  } else {
+    fSlabOffset = start;
+    if (v != nullptr) v->resize(blts_before);
   }
-  for (auto b : xfer_buffers) delete[] b.first;
   return blt_bytes;
 }
 
+void V1724::NextSlab(std::size_t min_bytes){
+  if (fSlab != nullptr) fSlab->Release();
+  fSlab = fPool->Get(min_bytes);
+  fSlabOffset = 0;
+}
+
 int V1724::LoadDAC(std::vector<u_int16_t> &dac_values){
   // Loads DAC values into registers
-  for(unsigned int x=0; x<fNChannels; x++){
-    if(WriteRegister((fChDACRegister)+(0x100*x), dac_values[x])!=0){
-      fLog->Entry(MongoLog::Error, "Board %i failed writing DAC 0x%04x in channel %i",
-		  fBID, dac_values[x], x);
-      return -1;
-    }
-
+  std::vector<std::pair<u_int32_t, u_int32_t>> regs;
+  for(unsigned int x=0; x<fNChannels; x++)
+    regs.emplace_back(fChDACRegister + 0x100*x, dac_values[x]);
+  if (WriteRegisters(regs) != 0) {
+    fLog->Entry(MongoLog::Error, "Board %i failed writing DACs", fBID);
+    return -1;
   }
   return 0;
 }
 
 int V1724::SetThresholds(std::vector<u_int16_t> vals) {
-  int ret = 0;
+  std::vector<std::pair<u_int32_t, u_int32_t>> regs;
   for (unsigned ch = 0; ch < fNChannels; ch++)
-    ret += WriteRegister(fChTrigRegister + 0x100*ch, vals[ch]);
-  return ret;
+    regs.emplace_back(fChTrigRegister + 0x100*ch, vals[ch]);
+  return WriteRegisters(regs);
 }
 
 int V1724::End(){
   if(fBoardHandle>=0)
     CAENVME_End(fBoardHandle);
+  if(fSlab != nullptr)
+    fSlab->Release();
+  fSlab = nullptr;
+  fSlabOffset = 0;
   fBoardHandle=fLink=fCrate=-1;
   fBaseAddress=0;
   return 0;
@@ -403,6 +541,21 @@ void V1724::ClampDACValues(std::vector<u_int16_t> &dac_values,
   }
 }
 
+bool V1724::WaitForReady(int timeout_ms){
+  // failed reads only mean the board isn't back yet, so they're not logged
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  u_int32_t val = 0;
+  do{
+    if (CAENVME_ReadCycle(fBoardHandle, fBaseAddress+fAqStatusRegister, &val,
+          cvA32_U_DATA, cvD32) == cvSuccess && (val & 0x100))
+      return true;
+    usleep(100);
+  }while(std::chrono::steady_clock::now() < deadline);
+  fLog->Entry(MongoLog::Warning, "Board %i not ready after %i ms (status 0x%04x)",
+      fBID, timeout_ms, val);
+  return false;
+}
+
 bool V1724::MonitorRegister(u_int32_t reg, u_int32_t mask, int ntries, int sleep, u_int32_t val){
   u_int32_t rval = 0;
   if(val == 0) rval = 0xffffffff;
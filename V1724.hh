@@ -2,12 +2,16 @@
 #define _V1724_HH_
 
 #include <cstdint>
+#include <cstddef>
 #include <vector>
 #include <map>
+#include <utility>
 
 class MongoLog;
 class Options;
 class data_packet;
+class BufferPool;
+struct BufferSlab;
 
 class V1724{
 
@@ -16,9 +20,26 @@ class V1724{
   virtual ~V1724();
 
   int Init(int link, int crate, int bid, unsigned int address=0);
-  int ReadMBLT(u_int32_t* &buffer, std::vector<unsigned int>* v=nullptr);
+  // For a board kept from the last run with its settings: takes the new
+  // options and clears out old events, but doesn't reset it. false if the
+  // board doesn't come back ready
+  bool Rearm(Options *options);
+  // Between runs, for a board that's being kept. Gives back its slab, which
+  // belongs to a pool that's about to go, but leaves the link open
+  void Park();
+  int ReadMBLT(u_int32_t* &buffer, BufferSlab* &slab, std::vector<unsigned int>* v=nullptr);
+  // Gives back the slab it's reading into, which is from the old pool
+  void SetBufferPool(BufferPool *pool);
+  BufferPool* GetBufferPool() {return fPool;}
   int WriteRegister(unsigned int reg, unsigned int value);
+  // (register, value) pairs, written in order. Goes out as a few VME
+  // multi-write cycles rather than one transaction per register
+  int WriteRegisters(const std::vector<std::pair<u_int32_t, u_int32_t>>& regs);
   unsigned int ReadRegister(unsigned int reg);
+  // The same the other way round, values come back in the order of the
+  // registers. A read that failed comes back as 0xFFFFFFFF. Returns 0 if
+  // they all worked
+  int ReadRegisters(const std::vector<u_int32_t>& regs, std::vector<u_int32_t>& vals);
   int GetClockCounter(u_int32_t timestamp, u_int32_t this_event_num);
   int End();
 
@@ -40,11 +61,33 @@ class V1724{
   bool EnsureReady(int ntries, int sleep);
   bool EnsureStarted(int ntries, int sleep);
   bool EnsureStopped(int ntries, int sleep);
+  // Like EnsureReady, but doesn't give up if the board doesn't answer at
+  // first, as happens just after a reset
+  bool WaitForReady(int timeout_ms);
+  // What the readout wants to know about a board, read in one transaction
+  struct Status{
+    u_int32_t acquisition, readout, board_fail;
+  };
+  int ReadStatus(Status& status);
+  // Bit 0 for PLL unlock, bit 1 for a VME bus error, -1 if the read failed
   int CheckErrors();
+  static int ErrorBits(const Status& status);
   u_int32_t GetAcquisitionStatus();
+  // 1 if there's at least one event waiting to be read out, -1 if the
+  // register read failed
+  int DataReady();
   u_int32_t GetHeaderTime(u_int32_t *buff, u_int32_t size, u_int32_t& num);
 
   std::map<std::string, int> DataFormatDefinition;
+  // The same format as compile-time constants, so the strax decoder can be
+  // specialized on it. Derived boards override what differs
+  struct Format{
+    static constexpr int channel_mask_msb_idx = -1;
+    static constexpr int channel_header_words = 2;
+    static constexpr int channel_time_msb_idx = -1;
+    static constexpr int ns_per_sample = 10;
+    static constexpr int ns_per_clk = 10;
+  };
 
 protected:
   // Some values for base classes to override 
@@ -52,6 +95,7 @@ protected:
   unsigned int fAqStatusRegister;
   unsigned int fSwTrigRegister;
   unsigned int fResetRegister;
+  unsigned int fClearRegister;
   unsigned int fChStatusRegister;
   unsigned int fChDACRegister;
   unsigned int fChTrigRegister;
@@ -66,6 +110,14 @@ protected:
   int BLT_SIZE;
   std::map<int, long> fBLTCounter;
 
+  // Slab currently being filled by BLTs, and how far into it we are
+  BufferPool *fPool;
+  BufferSlab *fSlab;
+  std::size_t fSlabOffset;
+
+  void NextSlab(std::size_t min_bytes);
+  // What Init and Rearm both do at the start of a run
+  void NewRun();
   bool MonitorRegister(u_int32_t reg, u_int32_t mask, int ntries,
 		       int sleep, u_int32_t val=1);
   Options *fOptions;
@@ -82,7 +134,8 @@ protected:
 
   MongoLog *fLog;
 
-  float fBLTSafety, fBufferSafety;
+  float fBLTSafety;
+  bool fMultiWrite;
 
 };
 
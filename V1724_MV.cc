@@ -4,7 +4,7 @@
 
 V1724_MV::V1724_MV(MongoLog *log, Options *options)
   :V1724(log, options){
-	  DataFormatDefinition["channel_header_words"] = 0;
+	  DataFormatDefinition["channel_header_words"] = Format::channel_header_words;
 	  // MV boards seem to have reg 0x1n80 for channel n threshold
 	  fChTrigRegister = 0x1080;
 }
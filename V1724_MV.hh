@@ -9,6 +9,11 @@ public:
   V1724_MV(MongoLog *log, Options *options);
   virtual ~V1724_MV();
 
+  // Default firmware, so no channel headers
+  struct Format : V1724::Format{
+    static constexpr int channel_header_words = 0;
+  };
+
 };
 
 #endif
@@ -5,12 +5,12 @@
 V1730::V1730(MongoLog *log, Options *options)
   :V1724(log, options){
   fNChannels = 16;
-  DataFormatDefinition["ns_per_sample"] = 2;
-  DataFormatDefinition["ns_per_clk"] = 2;
-  DataFormatDefinition["channel_header_words"] = 3;
-  DataFormatDefinition["channel_mask_msb_idx"] = 2;
+  DataFormatDefinition["ns_per_sample"] = Format::ns_per_sample;
+  DataFormatDefinition["ns_per_clk"] = Format::ns_per_clk;
+  DataFormatDefinition["channel_header_words"] = Format::channel_header_words;
+  DataFormatDefinition["channel_mask_msb_idx"] = Format::channel_mask_msb_idx;
   DataFormatDefinition["channel_mask_msb_mask"] = -1;
-  DataFormatDefinition["channel_time_msb_idx"] = 2; 
+  DataFormatDefinition["channel_time_msb_idx"] = Format::channel_time_msb_idx;
   DataFormatDefinition["channel_time_msb_mask"] = -1;
   // Channel indices are given relative to start of channel
   // i.e. the channel size is at index '0'
@@ -9,6 +9,14 @@ public:
   V1730(MongoLog *log, Options *options);
   virtual ~V1730();
 
+  struct Format : V1724::Format{
+    static constexpr int channel_mask_msb_idx = 2;
+    static constexpr int channel_header_words = 3;
+    static constexpr int channel_time_msb_idx = 2;
+    static constexpr int ns_per_sample = 2;
+    static constexpr int ns_per_clk = 2;
+  };
+
 private:
 
 };
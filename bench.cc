@@ -0,0 +1,263 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <list>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "DataSource.hh"
+#include "StraxInserter.hh"
+#include "StraxWriter.hh"
+#include "PacketCapture.hh"
+#include "RingBuffer.hh"
+#include "Metrics.hh"
+#include "MongoLog.hh"
+#include "Options.hh"
+#include <bsoncxx/builder/stream/document.hpp>
+#include <bsoncxx/json.hpp>
+
+/*
+  Replays raw data captured during a run (see the capture_file option)
+  through the processing and compression threads, without any hardware, and
+  reports how fast it went. Meant for checking changes to the decoder or the
+  output before they get anywhere near the detector.
+*/
+
+class ReplaySource : public DataSource{
+  /*
+    Stands in for the DAQController. A feeder thread copies the captured
+    packets into a ring, as fast as it can or at a fixed rate, and the
+    inserters take them out of it like they would from the readout.
+  */
+
+public:
+  ReplaySource(std::vector<data_packet*>& packets,
+      std::map<int, std::map<std::string, int>>& formats, int loops, double rate_mbps) :
+    fPackets(packets), fFormats(formats), fRing(0x10000) {
+    fLoops = loops;
+    fRate = rate_mbps;
+    fDone = false;
+    fBytes = fErrors = 0;
+    fBufferLength = 0;
+    // each time round, the clock carries on from where the capture ended
+    u_int32_t first = packets.size() > 0 ? packets.front()->clock_counter : 0;
+    u_int32_t last = packets.size() > 0 ? packets.back()->clock_counter : 0;
+    fLoopOffset = last - first + 1;
+  }
+  ~ReplaySource() {
+    if (fFeeder.joinable()) fFeeder.join();
+    data_packet *dp;
+    while (fRing.Pop(dp)) delete dp;
+  }
+
+  void Start() {fFeeder = std::thread(&ReplaySource::Feed, this);}
+  bool Finished() {return fDone && fBufferLength.load() == 0;}
+  long Bytes() {return fBytes.load();}
+  long Errors() {return fErrors.load();}
+
+  int GetData(std::list<data_packet*>* retQ, unsigned num = 0) {
+    if (num == 0) num = 16;
+    data_packet *dp;
+    int ret = 0;
+    unsigned popped = 0;
+    while (popped < num && fRing.Pop(dp)) {
+      fBufferLength--;
+      ret += dp->size;
+      retQ->push_back(dp);
+      popped++;
+    }
+    return ret;
+  }
+  int GetData(data_packet* &dp) {
+    if (!fRing.Pop(dp)) return 0;
+    fBufferLength--;
+    return dp->size;
+  }
+  void WaitForData(std::chrono::microseconds timeout) {
+    std::this_thread::sleep_for(std::min(timeout, std::chrono::microseconds(10)));
+  }
+  void CheckError(int) {fErrors++;}
+  void GetDataFormat(std::map<int, std::map<std::string, int>>& ret) {ret = fFormats;}
+
+private:
+  void Feed() {
+    Metrics::Register("replay");
+    auto start = std::chrono::steady_clock::now();
+    long sent = 0;
+    for (int loop = 0; loop < fLoops; loop++) {
+      for (auto src : fPackets) {
+        data_packet *dp = new data_packet;
+        dp->bid = src->bid;
+        dp->header_time = src->header_time;
+        dp->clock_counter = src->clock_counter + loop*fLoopOffset;
+        dp->size = src->size;
+        dp->vBLT = src->vBLT;
+        dp->buff = new u_int32_t[(src->size+3)/4];
+        std::memcpy(dp->buff, src->buff, src->size);
+        if (fRate > 0) {
+          // bytes per us is MB/s
+          std::this_thread::sleep_until(start + std::chrono::microseconds(long(sent/fRate)));
+        }
+        dp->read_time = std::chrono::steady_clock::now();
+        fBufferLength++;
+        while (!fRing.Push(dp)) std::this_thread::sleep_for(std::chrono::microseconds(10));
+        sent += dp->size;
+        fBytes += dp->size;
+      }
+    }
+    fDone = true;
+  }
+
+  std::vector<data_packet*>& fPackets;
+  std::map<int, std::map<std::string, int>>& fFormats;
+  RingBuffer<data_packet*> fRing;
+  std::thread fFeeder;
+  int fLoops;
+  u_int32_t fLoopOffset;
+  double fRate;
+  std::atomic_bool fDone;
+  std::atomic_int fBufferLength;
+  std::atomic_long fBytes, fErrors;
+};
+
+void Usage(){
+  std::cout<<"Replays captured raw data through the strax processing"<<std::endl;
+  std::cout<<"./redax_bench [-t threads] [-r MB/s] [-l loops] [-o output_dir] options.json capture [capture ...]"<<std::endl;
+  std::cout<<"  -t  number of processing threads (default 8)"<<std::endl;
+  std::cout<<"  -r  replay at this rate rather than as fast as possible"<<std::endl;
+  std::cout<<"  -l  go through the capture this many times (default 1)"<<std::endl;
+  std::cout<<"  -o  where to write the strax output (default ./bench_output)"<<std::endl;
+}
+
+int main(int argc, char** argv){
+  int n_threads = 8, loops = 1;
+  double rate = 0;
+  std::string output_path = "./bench_output";
+  int opt;
+  while ((opt = getopt(argc, argv, "t:r:l:o:h")) != -1) {
+    switch (opt) {
+      case 't': n_threads = std::stoi(optarg); break;
+      case 'r': rate = std::stod(optarg); break;
+      case 'l': loops = std::stoi(optarg); break;
+      case 'o': output_path = optarg; break;
+      default: Usage(); return 1;
+    }
+  }
+  if (argc - optind < 2) {
+    Usage();
+    return 1;
+  }
+
+  MongoLog *logger = new MongoLog();
+  std::string hostname = "bench";
+  std::ifstream json_file(argv[optind]);
+  std::stringstream json;
+  json << json_file.rdbuf();
+  Options *options;
+  try{
+    // through the builder, so whatever is in the path comes out as valid json
+    auto overrides = bsoncxx::builder::stream::document{} <<
+      "strax_output_path" << output_path << "run_identifier" << "bench" <<
+      bsoncxx::builder::stream::finalize;
+    options = new Options(logger, json.str(), hostname, bsoncxx::to_json(overrides.view()));
+  }catch(const std::exception& e){
+    std::cout<<e.what()<<std::endl;
+    delete logger;
+    return 1;
+  }
+
+  // Everything goes into memory first, so the replay only measures processing
+  std::vector<data_packet*> packets;
+  std::map<int, std::map<std::string, int>> formats;
+  long captured_bytes = 0;
+  for (int i = optind+1; i < argc; i++) {
+    PacketCapture capture;
+    if (capture.OpenRead(argv[i])) {
+      std::cout<<"Can't read capture "<<argv[i]<<std::endl;
+      continue;
+    }
+    for (auto& p : capture.Formats()) formats[p.first] = p.second;
+    data_packet *dp;
+    while ((dp = capture.Read()) != nullptr) packets.push_back(dp);
+    captured_bytes += capture.Bytes();
+  }
+  // the inserters expect roughly time-ordered data across boards
+  std::stable_sort(packets.begin(), packets.end(), [](auto a, auto b) {
+      return a->clock_counter < b->clock_counter ||
+      (a->clock_counter == b->clock_counter && a->header_time < b->header_time);});
+  std::cout<<"Loaded "<<packets.size()<<" packets ("<<captured_bytes/1e6<<" MB) from "<<
+    formats.size()<<" boards"<<std::endl;
+  if (packets.size() == 0) return 1;
+
+  ReplaySource source(packets, formats, loops, rate);
+  StraxWriter writer(logger);
+  writer.Initialize(options, hostname);
+  std::vector<StraxInserter*> inserters;
+  std::vector<std::thread*> threads;
+  for (int i = 0; i < n_threads; i++) {
+    StraxInserter *inserter = new StraxInserter();
+    if (inserter->Initialize(options, logger, &source, &writer, hostname)) {
+      std::cout<<"Failed to initialize processing thread "<<i<<std::endl;
+      delete inserter;
+      continue;
+    }
+    inserters.push_back(inserter);
+    threads.push_back(new std::thread([inserter, i]{
+        Metrics::Register("inserter_" + std::to_string(i));
+        inserter->ReadAndInsertData();}));
+  }
+
+  // a thread that only starts after Close() would never stop
+  for (auto inserter : inserters)
+    while (!inserter->WaitForStart(std::chrono::steady_clock::now() + std::chrono::seconds(1)))
+      std::cout<<"Still waiting for a processing thread to start"<<std::endl;
+  auto start = std::chrono::steady_clock::now();
+  source.Start();
+  while (!source.Finished()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  std::map<int,int> board_fails;
+  for (auto inserter : inserters) inserter->Close(board_fails);
+  long fragments = 0, bytes = 0;
+  for (unsigned i = 0; i < threads.size(); i++) {
+    threads[i]->join();
+    delete threads[i];
+    fragments += inserters[i]->GetFragmentsProcessed();
+    bytes += inserters[i]->GetBytesProcessed();
+    delete inserters[i]; // waits for its files
+  }
+  writer.Close();
+  double elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - start).count()/1e6;
+
+  Metrics::Summary stages;
+  std::map<std::string, Metrics::Summary> per_thread;
+  std::map<int, Metrics::Summary> per_board;
+  Metrics::Snapshot(stages, per_thread, per_board);
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  std::cout<<std::fixed<<std::setprecision(2);
+  std::cout<<"Processed "<<bytes/1e6<<" MB in "<<elapsed<<" s with "<<inserters.size()<<" threads"<<std::endl;
+  std::cout<<"  "<<bytes/1e6/elapsed<<" MB/s, "<<fragments/elapsed<<" fragments/s"<<std::endl;
+  std::cout<<"  peak memory "<<usage.ru_maxrss/1024.<<" MB, "<<source.Errors()<<" data errors"<<std::endl;
+  std::cout<<std::setw(12)<<"stage"<<std::setw(10)<<"count"<<std::setw(10)<<"MB"<<
+    std::setw(10)<<"mean_us"<<std::setw(10)<<"p50_us"<<std::setw(10)<<"p90_us"<<
+    std::setw(10)<<"p99_us"<<std::setw(10)<<"total_s"<<std::endl;
+  for (auto& s : stages) {
+    auto& v = s.second;
+    std::cout<<std::setw(12)<<s.first<<std::setw(10)<<long(v["count"])<<std::setw(10)<<v["MB"]<<
+      std::setw(10)<<v["mean_us"]<<std::setw(10)<<v["p50_us"]<<std::setw(10)<<v["p90_us"]<<
+      std::setw(10)<<v["p99_us"]<<std::setw(10)<<v["mean_us"]*v["count"]/1e6<<std::endl;
+  }
+
+  for (auto dp : packets) delete dp;
+  delete options;
+  delete logger;
+  return 0;
+}
@@ -1,6 +1,7 @@
 #include "CControl_Handler.hh"
 #include "Options.hh"
 #include "MongoLog.hh"
+#include "CommandWatcher.hh"
 #include <string>
 #include <iostream>
 #include <limits.h>
@@ -58,31 +59,17 @@ int main(int argc, char** argv){
   // Holds session data
   CControl_Handler *fHandler = new CControl_Handler(logger, hostname);  
 
+  // Commands are waited for in between the status updates
+  CommandWatcher watcher(control, hostname, logger, std::chrono::milliseconds(1000));
   while(1){
 
-    auto order = bsoncxx::builder::stream::document{} <<
-      "_id" << 1 <<bsoncxx::builder::stream::finalize;
-    auto opts = mongocxx::options::find{};
-    opts.sort(order.view());
-    mongocxx::cursor cursor = control.find
-      (
-       bsoncxx::builder::stream::document{}<< "host" << hostname <<"acknowledged" <<
-       bsoncxx::builder::stream::open_document << "$ne" << hostname <<
-       bsoncxx::builder::stream::close_document << bsoncxx::builder::stream::finalize,
-       opts
-       );
-    
-    for (auto doc : cursor) {
-      // Acknowledge the commands
-      control.update_one
-        (bsoncxx::builder::stream::document{} << "_id" << doc["_id"].get_oid() <<
-         bsoncxx::builder::stream::finalize,
-         bsoncxx::builder::stream::document{} << "$push" <<
-         bsoncxx::builder::stream::open_document << "acknowledged" << hostname <<
-         bsoncxx::builder::stream::close_document <<
-         bsoncxx::builder::stream::finalize
-         );
-      
+    auto commands = watcher.Get();
+    // Acknowledge the commands
+    watcher.Acknowledge(commands);
+
+    for (auto& command_doc : commands) {
+      auto doc = command_doc.view();
+
       // Strip data from the supplied doc
       int run = -1;
       std::string command = "";
@@ -122,7 +109,7 @@ int main(int argc, char** argv){
 	 delete options;
 	 options = NULL;
        }
-       options = new Options(logger, mode, mongo_uri, dbname, override_json);
+       options = new Options(logger, mode, hostname, mongo_uri, dbname, override_json);
 	 
        // Initialise the V2178, V1495 and DDC10...etc.      
        if(fHandler->DeviceArm(run, options) != 0){
@@ -146,7 +133,6 @@ int main(int argc, char** argv){
  
     // Report back on what we are doing
     status.insert_one(fHandler->GetStatusDoc(hostname));
-   usleep(1000000);
   }
   return 0;
 }
@@ -1,26 +1,28 @@
-import blosc
+import sys
 import numpy as np
-import strax
+import strax_reader
 
 #path = '/home/coderre/trigger_buffer/263/000000/fdaq00'
 path = '/home/coderre/eventbuilder/testdata/from_fake_daq/000000/reader_0'
+channel = -1
+# path [channel], only the blocks with that channel get read if there's an index
+if len(sys.argv) > 1:
+    path = sys.argv[1]
+if len(sys.argv) > 2:
+    channel = int(sys.argv[2])
 
-f = open(path, "rb")
-data = blosc.decompress(f.read())
-darr = np.frombuffer(data, dtype=strax.record_dtype())
+darr = strax_reader.load(path, channel)
 
 for i in range(0, len(darr)):
     #print(darr[i])
-    print("Channel: %i"%darr[i][0])
-    print("Time resolution: %i ns"%darr[i][1])
-    print("Timestamp: %i"%darr[i][2])
-    print("Interval length: %i samples"%darr[i][3])
-    print("Integral: %i"%darr[i][4])
-    print("Pulse length: %i samples"%darr[i][5])
-    print("Fragment in pulse: %i"%darr[i][6])
-    print("Baseline: %i"%darr[i][7])
-    print("Reduction level: %i"%darr[i][8])
-    print("Payload (%i): %s"%(len(darr[i][9]), str(darr[i][9])))
+    print("Channel: %i"%darr[i]['channel'])
+    print("Time resolution: %i ns"%darr[i]['sample_width'])
+    print("Timestamp: %i"%darr[i]['time'])
+    print("Interval length: %i samples"%darr[i]['length'])
+    print("Pulse length: %i samples"%darr[i]['pulse_length'])
+    print("Fragment in pulse: %i"%darr[i]['fragment_i'])
+    print("Baseline: %i"%darr[i]['baseline'])
+    print("Payload (%i): %s"%(len(darr[i]['data']), str(darr[i]['data'])))
     print("Record %i/%i shown."%(i, len(darr)))
     inp = input("(p)revious or (n)ext record. Or (s)kip ahead 100")
     if inp == 'p':
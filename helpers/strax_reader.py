@@ -0,0 +1,97 @@
+# Python side of libstraxreader.so (make reader), for looking at a few
+# channels of a chunk file without decompressing all of it. With strax_index
+# set, redax writes an index for every chunk file next to the run's chunks,
+# in <run>/index/<chunk>/<same name>, and only the blocks that have something
+# for the query are decompressed. Without one the whole file is read.
+import ctypes
+import os
+import numpy as np
+
+_lib = None
+
+
+def _load_library():
+    global _lib
+    if _lib is not None:
+        return _lib
+    path = os.environ.get('STRAX_READER_LIB',
+                          os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                       '..', 'libstraxreader.so'))
+    lib = ctypes.CDLL(path)
+    lib.strax_reader_open.restype = ctypes.c_void_p
+    lib.strax_reader_open.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int]
+    lib.strax_reader_close.argtypes = [ctypes.c_void_p]
+    lib.strax_reader_query.restype = ctypes.c_long
+    lib.strax_reader_query.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int64,
+                                       ctypes.c_int64, ctypes.POINTER(ctypes.c_void_p)]
+    lib.strax_reader_free.argtypes = [ctypes.c_void_p]
+    lib.strax_reader_record_bytes.argtypes = [ctypes.c_void_p]
+    lib.strax_reader_indexed.argtypes = [ctypes.c_void_p]
+    lib.strax_reader_blocks_read.restype = ctypes.c_long
+    lib.strax_reader_blocks_read.argtypes = [ctypes.c_void_p]
+    _lib = lib
+    return lib
+
+
+def record_dtype(record_bytes=244):
+    # The StraxHeader from StraxInserter.hh, then the payload
+    return np.dtype([('time', '<i8'), ('length', '<i4'), ('sample_width', '<i2'),
+                     ('channel', '<i2'), ('pulse_length', '<i4'), ('fragment_i', '<i2'),
+                     ('baseline', '<i2'), ('data', '<i2', ((record_bytes-24)//2,))])
+
+
+def index_path(path):
+    chunk_dir, name = os.path.split(os.path.abspath(path))
+    run_dir, chunk = os.path.split(chunk_dir)
+    return os.path.join(run_dir, 'index', chunk, name)
+
+
+class ChunkFile:
+    def __init__(self, path, index=None, record_bytes=244):
+        self.handle = None
+        self.lib = _load_library()
+        if index is None:
+            index = index_path(path)
+        self.handle = self.lib.strax_reader_open(path.encode(), index.encode(), record_bytes)
+        if not self.handle:
+            raise IOError("Can't open %s" % path)
+        self.record_bytes = self.lib.strax_reader_record_bytes(self.handle)
+        self.indexed = self.lib.strax_reader_indexed(self.handle) == 1
+
+    def query(self, channel=-1, start=None, end=None):
+        # Records of channel (-1 for all) overlapping [start, end) in ns
+        start = -2**63 if start is None else start
+        end = 2**63-1 if end is None else end
+        out = ctypes.c_void_p()
+        n = self.lib.strax_reader_query(self.handle, channel, start, end, ctypes.byref(out))
+        if n < 0:
+            raise IOError("Couldn't read the chunk")
+        if n == 0:
+            return np.zeros(0, dtype=record_dtype(self.record_bytes))
+        try:
+            data = ctypes.string_at(out, n*self.record_bytes)
+        finally:
+            self.lib.strax_reader_free(out)
+        return np.frombuffer(data, dtype=record_dtype(self.record_bytes))
+
+    def blocks_read(self):
+        return self.lib.strax_reader_blocks_read(self.handle)
+
+    def close(self):
+        if self.handle:
+            self.lib.strax_reader_close(self.handle)
+            self.handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __del__(self):
+        self.close()
+
+
+def load(path, channel=-1, start=None, end=None, record_bytes=244):
+    with ChunkFile(path, record_bytes=record_bytes) as f:
+        return f.query(channel, start, end)
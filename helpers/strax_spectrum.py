@@ -1,15 +1,22 @@
-import blosc
+import sys
 import numpy as np
-import strax
+import strax_reader
 import matplotlib.pyplot as plt
 
 path = '/home/coderre/trigger_buffer/301/000000/fdaq00'
 #path = '/home/coderre/eventbuilder/testdata/from_fake_daq/000000/reader_0'
 
 
-f = open(path, "rb")
-data = blosc.decompress(f.read())
-darr = np.frombuffer(data, dtype=strax.record_dtype())
+channel = -1
+# path [channel], only the blocks with that channel get read if there's an index
+if len(sys.argv) > 1:
+    path = sys.argv[1]
+if len(sys.argv) > 2:
+    channel = int(sys.argv[2])
+
+darr = strax_reader.load(path, channel)
+# the files are in time order, but a pulse's fragments need to be together
+darr = darr[np.lexsort((darr['time'], darr['channel']))]
 
 def plot_waveform(data, baseline, integral):
     thresh = 500
@@ -25,7 +32,7 @@ def plot_waveform(data, baseline, integral):
 direction = 'f'
 integrals = []
 for i in range(0, len(darr)):
-    if darr[i][6]!=0:
+    if darr[i]['fragment_i']!=0:
         if direction == 'f':
             continue
         else:
@@ -34,37 +41,33 @@ for i in range(0, len(darr)):
         
     # Print some stuff about the channel
     '''
-    print("Channel: %i"%darr[i][0])
-    print("Time resolution: %i ns"%darr[i][1])
-    print("Timestamp: %i"%darr[i][2])
-    print("Interval length: %i samples"%darr[i][3])
-    print("Integral: %i"%darr[i][4])
-    print("Pulse length: %i samples"%darr[i][5])
-    print("Fragment in pulse: %i"%darr[i][6])
-    print("Baseline: %i"%darr[i][7])
-    print("Reduction level: %i"%darr[i][8])
-    #print("Payload (%i): %s"%(len(darr[i][9]), str(darr[i][9])))
+    print("Channel: %i"%darr[i]['channel'])
+    print("Time resolution: %i ns"%darr[i]['sample_width'])
+    print("Timestamp: %i"%darr[i]['time'])
+    print("Interval length: %i samples"%darr[i]['length'])
+    print("Pulse length: %i samples"%darr[i]['pulse_length'])
+    print("Fragment in pulse: %i"%darr[i]['fragment_i'])
+    print("Baseline: %i"%darr[i]['baseline'])
+    #print("Payload (%i): %s"%(len(darr[i]['data']), str(darr[i]['data'])))
     print("Record %i/%i shown."%(i, len(darr)))
     '''
     
     data = []
-    data.extend(darr[i][9][:darr[i][3]])
-    thisi = darr[i][6]+1
-    while len(data) < darr[i][5]:
-        #print("Channel: %i"%darr[i+thisi][0])
-        #print("Time resolution: %i ns"%darr[i+thisi][1])
-        #print("Timestamp: %i"%darr[i+thisi][2])
-        #print("Interval length: %i samples"%darr[i+thisi][3])
-        #print("Integral: %i"%darr[i+thisi][4])
-        #print("Pulse length: %i samples"%darr[i+thisi][5])
-        #print("Fragment in pulse: %i"%darr[i+thisi][6])
-        #print("Baseline: %i"%darr[i+thisi][7])
-        #print("Reduction level: %i"%darr[i+thisi][8])
-        #print("Payload (%i): %s"%(len(darr[i][9]), str(darr[i][9])))                                    
+    data.extend(darr[i]['data'][:darr[i]['length']])
+    thisi = darr[i]['fragment_i']+1
+    while len(data) < darr[i]['pulse_length']:
+        #print("Channel: %i"%darr[i+thisi]['channel'])
+        #print("Time resolution: %i ns"%darr[i+thisi]['sample_width'])
+        #print("Timestamp: %i"%darr[i+thisi]['time'])
+        #print("Interval length: %i samples"%darr[i+thisi]['length'])
+        #print("Pulse length: %i samples"%darr[i+thisi]['pulse_length'])
+        #print("Fragment in pulse: %i"%darr[i+thisi]['fragment_i'])
+        #print("Baseline: %i"%darr[i+thisi]['baseline'])
+        #print("Payload (%i): %s"%(len(darr[i]['data']), str(darr[i]['data'])))                                    
         if i%1000==0:
             print("Record %i/%i shown."%(i+thisi, len(darr)))
 
-        data.extend(darr[i+thisi][9][:darr[i+thisi][3]])
+        data.extend(darr[i+thisi]['data'][:darr[i+thisi]['length']])
         thisi+=1
 
     baseline = float(sum(data[:20]))/20.
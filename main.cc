@@ -3,13 +3,18 @@
 #include <iomanip>
 #include <csignal>
 #include "DAQController.hh"
+#include "StraxInserter.hh"
 #include <thread>
 #include <unistd.h>
 #include "MongoLog.hh"
 #include "Options.hh"
+#include "Metrics.hh"
+#include "CommandWatcher.hh"
+#include "MemoryGovernor.hh"
 #include <limits.h>
 #include <chrono>
 #include <thread>
+#include <exception>
 
 #include <mongocxx/instance.hpp>
 #include <bsoncxx/builder/stream/document.hpp>
@@ -17,6 +22,7 @@
 
 std::atomic_bool b_run = true;
 std::string hostname = "";
+MongoLog *terminate_logger = nullptr;
 
 void SignalHandler(int signum) {
     std::cout << "\nReceived signal "<<signum<<std::endl;
@@ -24,12 +30,35 @@ void SignalHandler(int signum) {
     return;
 }
 
-void UpdateStatus(std::string suri, std::string dbname, DAQController* controller) {
+// Whatever was queued up to the crash is what anyone will want to read
+void TerminateHandler() {
+  if (terminate_logger != nullptr) terminate_logger->Flush();
+  std::abort();
+}
+
+void UpdateStatus(std::string suri, std::string dbname, DAQController* controller,
+    MongoLog* logger) {
   mongocxx::uri uri(suri);
   mongocxx::client c(uri);
   mongocxx::collection status = c[dbname]["status"];
+  using Summary = Metrics::Summary;
+  auto summary_doc = [](bsoncxx::builder::stream::key_context<> doc, const Summary& summary){
+    for( auto const& stage : summary ){
+      doc << stage.first << bsoncxx::builder::stream::open_document <<
+      [&](bsoncxx::builder::stream::key_context<> sdoc){
+	for( auto const& pair : stage.second ) sdoc << pair.first << pair.second;
+      } << bsoncxx::builder::stream::close_document;
+    }
+  };
   while (b_run == true) {
     try{
+      Summary stages;
+      std::map<std::string, Summary> threads;
+      std::map<int, Summary> boards;
+      Metrics::Snapshot(stages, threads, boards);
+      std::map<int, ChannelStats> channels;
+      std::map<int, long> board_bytes;
+      controller->GetChannelStats(channels, board_bytes);
       // Put in status update document
       auto insert_doc = bsoncxx::builder::stream::document{};
       insert_doc << "host" << hostname <<
@@ -41,9 +70,76 @@ void UpdateStatus(std::string suri, std::string dbname, DAQController* controlle
 	"run_mode" << controller->run_mode() <<
 	"channels" << bsoncxx::builder::stream::open_document <<
 	[&](bsoncxx::builder::stream::key_context<> doc){
-	for( auto const& pair : controller->GetDataPerChan() )
-	  doc << std::to_string(pair.first) << (pair.second>>10); // KB not MB
-	} << bsoncxx::builder::stream::close_document;
+	for( auto const& pair : channels )
+	  doc << std::to_string(pair.first) << (pair.second.bytes>>10); // KB not MB
+	} << bsoncxx::builder::stream::close_document <<
+	"fragments" << bsoncxx::builder::stream::open_document <<
+	[&](bsoncxx::builder::stream::key_context<> doc){
+	for( auto const& pair : channels )
+	  doc << std::to_string(pair.first) << pair.second.fragments;
+	} << bsoncxx::builder::stream::close_document <<
+	"board_rate" << bsoncxx::builder::stream::open_document <<
+	[&](bsoncxx::builder::stream::key_context<> doc){
+	for( auto const& pair : board_bytes )
+	  doc << std::to_string(pair.first) << (pair.second>>10); // KB
+	} << bsoncxx::builder::stream::close_document <<
+	"zle" << bsoncxx::builder::stream::open_document <<
+	[&](bsoncxx::builder::stream::key_context<> doc){
+	for( auto const& pair : channels ){
+	  if (pair.second.zle_kept + pair.second.zle_dropped == 0) continue;
+	  doc << std::to_string(pair.first) << bsoncxx::builder::stream::open_document <<
+	    "kept" << pair.second.zle_kept << "dropped" << pair.second.zle_dropped <<
+	    bsoncxx::builder::stream::close_document;
+	}
+	} << bsoncxx::builder::stream::close_document <<
+	"blt_pool" << bsoncxx::builder::stream::open_document <<
+	[&](bsoncxx::builder::stream::key_context<> doc){
+	for( auto const& link : controller->GetBufferPoolStatus() ){
+	  doc << std::to_string(link.first) << bsoncxx::builder::stream::open_document <<
+	  [&](bsoncxx::builder::stream::key_context<> ldoc){
+	    for( auto const& pair : link.second ) ldoc << pair.first << pair.second;
+	  } << bsoncxx::builder::stream::close_document;
+	}
+	} << bsoncxx::builder::stream::close_document <<
+	"readout" << bsoncxx::builder::stream::open_document <<
+	[&](bsoncxx::builder::stream::key_context<> doc){
+	for( auto const& board : controller->GetReadoutStats() ){
+	  doc << std::to_string(board.first) << bsoncxx::builder::stream::open_document <<
+	  [&](bsoncxx::builder::stream::key_context<> bdoc){
+	    for( auto const& pair : board.second ) bdoc << pair.first << pair.second;
+	  } << bsoncxx::builder::stream::close_document;
+	}
+	} << bsoncxx::builder::stream::close_document <<
+	"metrics" << bsoncxx::builder::stream::open_document <<
+	  "stages" << bsoncxx::builder::stream::open_document <<
+	  [&](bsoncxx::builder::stream::key_context<> doc){ summary_doc(doc, stages); } <<
+	  bsoncxx::builder::stream::close_document <<
+	  "threads" << bsoncxx::builder::stream::open_document <<
+	  [&](bsoncxx::builder::stream::key_context<> doc){
+	  for( auto const& t : threads ){
+	    doc << t.first << bsoncxx::builder::stream::open_document <<
+	    [&](bsoncxx::builder::stream::key_context<> tdoc){ summary_doc(tdoc, t.second); } <<
+	    bsoncxx::builder::stream::close_document;
+	  }
+	  } << bsoncxx::builder::stream::close_document <<
+	  "boards" << bsoncxx::builder::stream::open_document <<
+	  [&](bsoncxx::builder::stream::key_context<> doc){
+	  for( auto const& b : boards ){
+	    doc << std::to_string(b.first) << bsoncxx::builder::stream::open_document <<
+	    [&](bsoncxx::builder::stream::key_context<> bdoc){ summary_doc(bdoc, b.second); } <<
+	    bsoncxx::builder::stream::close_document;
+	  }
+	  } << bsoncxx::builder::stream::close_document <<
+	bsoncxx::builder::stream::close_document <<
+	"memory" << bsoncxx::builder::stream::open_document <<
+	[&](bsoncxx::builder::stream::key_context<> doc){
+	for( auto const& pair : MemoryGovernor::Status() ) doc << pair.first << pair.second;
+	} << bsoncxx::builder::stream::close_document <<
+	"log" << bsoncxx::builder::stream::open_document <<
+	  "queued" << logger->QueueDepth() <<
+	  "dropped" << logger->Dropped() <<
+	  "coalesced" << logger->Coalesced() <<
+	bsoncxx::builder::stream::close_document;
 	status.insert_one(insert_doc << bsoncxx::builder::stream::finalize);
     }catch(const std::exception &e){
       std::cout<<"Can't connect to DB to update."<<std::endl;
@@ -103,6 +199,8 @@ int main(int argc, char** argv){
     std::cout<<"Exiting"<<std::endl;
     exit(-1);
   }
+  terminate_logger = logger;
+  std::set_terminate(TerminateHandler);
 
   //Options
   Options *fOptions = NULL;
@@ -111,46 +209,22 @@ int main(int argc, char** argv){
   // boards and tracking the status
   DAQController *controller = new DAQController(logger, hostname);
   std::vector<std::thread*> readoutThreads;
-  std::thread status_update(&UpdateStatus, suri, dbname, controller);
+  std::thread status_update(&UpdateStatus, suri, dbname, controller, logger);
   
-  // Main program loop. Scan the database and look for commands addressed
-  // to this hostname. 
+  // Main program loop. Wait for commands addressed to this hostname.
+  CommandWatcher watcher(control, hostname, logger, std::chrono::milliseconds(100));
   while(b_run == true){
 
-    // Try to poll for commands
-    bsoncxx::stdx::optional<bsoncxx::document::value> querydoc;
-
     try{
+      auto commands = watcher.Get();
+      // Very first thing: acknowledge we've seen the commands. If a command
+      // fails then we still acknowledge it because we tried
+      watcher.Acknowledge(commands);
 
-      // Sort oldest to newest
-      auto order = bsoncxx::builder::stream::document{} <<
-	"_id" << 1 <<bsoncxx::builder::stream::finalize;
-      auto opts = mongocxx::options::find{};
-      opts.sort(order.view());
-      
-      mongocxx::cursor cursor = control.find 
-	(
-	 bsoncxx::builder::stream::document{} << "host" << hostname << "acknowledged" <<
-	 bsoncxx::builder::stream::open_document << "$ne" << hostname <<
-	 bsoncxx::builder::stream::close_document << 
-	 bsoncxx::builder::stream::finalize, opts
-	 );
-
-      for(auto doc : cursor) {	
+      for(auto& command_doc : commands) {
+	auto doc = command_doc.view();
 	logger->Entry(MongoLog::Debug, "Found a doc with command %s",
 	  doc["command"].get_utf8().value.to_string().c_str());
-	// Very first thing: acknowledge we've seen the command. If the command
-	// fails then we still acknowledge it because we tried
-	control.update_one
-	  (
-	   bsoncxx::builder::stream::document{} << "_id" << (doc)["_id"].get_oid() <<
-	   bsoncxx::builder::stream::finalize,
-	   bsoncxx::builder::stream::document{} << "$push" <<
-	   bsoncxx::builder::stream::open_document << "acknowledged" << hostname <<
-	   bsoncxx::builder::stream::close_document <<
-	   bsoncxx::builder::stream::finalize
-	   );
-	std::cout<<"Updated doc"<<std::endl;
 
 	// Get the command out of the doc
 	std::string command = "";
@@ -296,11 +370,11 @@ int main(int argc, char** argv){
 
     // Insert some information on this readout node back to the monitor DB
     controller->CheckErrors();
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
   }
   status_update.join();
   delete controller;
   if (fOptions != NULL) delete fOptions;
+  terminate_logger = nullptr;
   delete logger;
   exit(0);
 